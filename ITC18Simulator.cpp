@@ -0,0 +1,371 @@
+/*
+ *  ITC18Simulator.cpp
+ *  ITC18StimPlugin
+ *
+ *  A software stand-in for the ITC18.  The simulator has the same FIFOs as the hardware and works out what would
+ *  have been played from the wall clock and the programmed sampling interval, so that the FIFOs fill and drain
+ *  as they would on the ITC18.  Everything played is recorded so that it can be checked.  The AD inputs are looped 
+ *  back: each instruction puts the value it wrote (or zero, if the write FIFO was empty) in the read FIFO.
+ *
+ */
+
+#include "ITC18Simulator.h"
+#include <stdlib.h>
+#include <string.h>
+#include <sys/time.h>
+
+#define kSimFIFOSize			(0x1 << 20)		// entries in each FIFO
+#define kSimGarbageEntries		3				// entries in the read FIFO that come before the first instruction
+#define kSimOutputLimit			(0x1 << 24)		// most entries of played output kept
+#define kSimTickTimeUS			1.25
+#define kSimTriggerDelayUS		1000			// synthetic external trigger after an armed start
+
+#define kSimError				-1
+
+typedef struct {
+	long		FIFOSize;						// entries the write FIFO holds, the read FIFO holds kSimFIFOSize
+	short		*writeFIFO;						// ring buffer of entries waiting to be played
+	long		writeHead;
+	long		writeCount;
+	short		*readFIFO;						// ring buffer of entries waiting to be read
+	long		readHead;
+	long		readCount;
+	bool		readOverflow;
+	long		sequenceLength;
+	long		ticksPerInstruction;
+	double		tickTimeUS;						// on the host clock, which the simulated ITC18 clock can drift from
+	bool		running;
+	bool		awaitingTrigger;				// started on the external trigger, which has not come yet
+	long		triggerDelayUS;					// when the synthetic trigger follows an armed start, < 0 for never
+	double		startUS;						// when the first instruction was played
+	long long	instructionsDone;				// instructions played since the start
+	long		underflows;						// instructions played dry before entries that were played later
+	long		dryInstructions;				// instructions played dry since the last entry was played
+	short		*output;						// record of what has been played
+	long		outputLength;
+	long		outputCapacity;
+} ITC18SimState;
+
+const ITC18Functions hardwareITC18 = {
+	ITC18_Close, ITC18_GetFIFOReadAvailableOverflow, ITC18_GetFIFOSize, ITC18_GetFIFOWriteAvailable,
+	ITC18_GetStructureSize, ITC18_Initialize, ITC18_Open, ITC18_ReadFIFO, ITC18_SetDigitalInputMode,
+	ITC18_SetExternalTriggerMode, ITC18_SetSamplingInterval, ITC18_SetSequence, ITC18_Start, ITC18_Stop,
+	ITC18_StopAndInitialize, ITC18_WriteFIFO
+};
+
+static double currentTimeUS(void) {
+
+	struct timeval now;
+
+	gettimeofday(&now, NULL);
+	return now.tv_sec * 1000000.0 + now.tv_usec;
+}
+
+// Keep a copy of played entries, growing the record as needed up to kSimOutputLimit
+
+static void recordOutput(ITC18SimState *pState, const short *pEntries, long count) {
+
+	long newCapacity;
+	short *pNewOutput;
+
+	count = (count < kSimOutputLimit - pState->outputLength) ? count : kSimOutputLimit - pState->outputLength;
+	if (count <= 0) {
+		return;
+	}
+	if (pState->outputLength + count > pState->outputCapacity) {
+		for (newCapacity = (pState->outputCapacity > 0) ? pState->outputCapacity : 0x1 << 16;
+			 newCapacity < pState->outputLength + count; newCapacity *= 2) {
+		}
+		newCapacity = (newCapacity < kSimOutputLimit) ? newCapacity : kSimOutputLimit;
+		if ((pNewOutput = (short *)realloc(pState->output, newCapacity * sizeof(short))) == NULL) {
+			return;
+		}
+		pState->output = pNewOutput;
+		pState->outputCapacity = newCapacity;
+	}
+	memcpy(&pState->output[pState->outputLength], pEntries, count * sizeof(short));
+	pState->outputLength += count;
+}
+
+// Put entries in the read FIFO, or zeros if pEntries is NULL.  Entries that do not fit are lost and flag overflow.
+
+static void pushRead(ITC18SimState *pState, const short *pEntries, long count) {
+	
+	long tail, chunk;
+	
+	if (count > kSimFIFOSize - pState->readCount) {
+		count = kSimFIFOSize - pState->readCount;
+		pState->readOverflow = true;
+	}
+	while (count > 0) {
+		tail = (pState->readHead + pState->readCount) % kSimFIFOSize;
+		chunk = kSimFIFOSize - tail;
+		chunk = (count < chunk) ? count : chunk;
+		if (pEntries != NULL) {
+			memcpy(&pState->readFIFO[tail], pEntries, chunk * sizeof(short));
+			pEntries += chunk;
+		}
+		else {
+			memset(&pState->readFIFO[tail], 0, chunk * sizeof(short));
+		}
+		pState->readCount += chunk;
+		count -= chunk;
+	}
+}
+
+// Play everything that the ITC18 would have played by now.  Every instruction takes one entry from the write
+// FIFO (if there is one) and puts one in the read FIFO.
+
+static void advance(ITC18SimState *pState) {
+
+	long long due, count, played, chunk, dry;
+
+	if (!pState->running || pState->awaitingTrigger) {
+		return;
+	}
+	due = (long long)((currentTimeUS() - pState->startUS) / (pState->tickTimeUS * pState->ticksPerInstruction));
+	count = due - pState->instructionsDone;
+	if (count <= 0) {
+		return;
+	}
+	played = (count < pState->writeCount) ? count : pState->writeCount;
+	dry = count - played;
+	if (played > 0) {
+		pState->underflows += pState->dryInstructions;
+		pState->dryInstructions = 0;
+	}
+	pState->dryInstructions += dry;
+	while (played > 0) {
+		chunk = pState->FIFOSize - pState->writeHead;
+		chunk = (played < chunk) ? played : chunk;
+		recordOutput(pState, &pState->writeFIFO[pState->writeHead], chunk);
+		pushRead(pState, &pState->writeFIFO[pState->writeHead], chunk);
+		pState->writeHead = (pState->writeHead + chunk) % pState->FIFOSize;
+		pState->writeCount -= chunk;
+		played -= chunk;
+	}
+	pushRead(pState, NULL, dry);
+	pState->instructionsDone = due;
+}
+
+static int simStopAndInitialize(void *device, int stop, int initialize) {
+
+	ITC18SimState *pState = (ITC18SimState *)device;
+
+	if (stop) {
+		advance(pState);
+		pState->running = false;
+	}
+	if (initialize) {
+		pState->writeHead = pState->writeCount = pState->readHead = pState->readCount = 0;
+		pState->readOverflow = false;
+	}
+	return 0;
+}
+
+static int simClose(void *device) {
+
+	ITC18SimState *pState = (ITC18SimState *)device;
+
+	free(pState->writeFIFO);
+	free(pState->readFIFO);
+	free(pState->output);
+	pState->writeFIFO = pState->readFIFO = pState->output = NULL;
+	return 0;
+}
+
+static int simGetFIFOReadAvailableOverflow(void *device, int *available, int *overflow) {
+
+	ITC18SimState *pState = (ITC18SimState *)device;
+
+	advance(pState);
+	*available = pState->readCount;
+	*overflow = pState->readOverflow;
+	return 0;
+}
+
+static int simGetFIFOSize(void *device) {
+
+	return ((ITC18SimState *)device)->FIFOSize;
+}
+
+static int simGetFIFOWriteAvailable(void *device, int *available) {
+
+	ITC18SimState *pState = (ITC18SimState *)device;
+
+	advance(pState);
+	*available = pState->FIFOSize - pState->writeCount;
+	return 0;
+}
+
+static int simGetStructureSize(void) {
+
+	return sizeof(ITC18SimState);
+}
+
+static int simInitialize(void *device, int setup) {
+
+	return simStopAndInitialize(device, true, true);
+}
+
+static int simOpen(void *device, int deviceNumber) {
+
+	ITC18SimState *pState = (ITC18SimState *)device;
+
+	memset(pState, 0, sizeof(ITC18SimState));
+	pState->FIFOSize = kSimFIFOSize;
+	pState->ticksPerInstruction = ITC18_MINIMUM_TICKS;
+	pState->tickTimeUS = kSimTickTimeUS;
+	pState->triggerDelayUS = kSimTriggerDelayUS;
+	if ((pState->writeFIFO = (short *)malloc(kSimFIFOSize * sizeof(short))) == NULL ||
+			(pState->readFIFO = (short *)malloc(kSimFIFOSize * sizeof(short))) == NULL) {
+		return kSimError;
+	}
+	return 0;
+}
+
+static int simReadFIFO(void *device, int length, short *buffer) {
+
+	ITC18SimState *pState = (ITC18SimState *)device;
+	long chunk;
+
+	advance(pState);
+	if (length > pState->readCount) {
+		return kSimError;
+	}
+	while (length > 0) {
+		chunk = kSimFIFOSize - pState->readHead;
+		chunk = (length < chunk) ? length : chunk;
+		memcpy(buffer, &pState->readFIFO[pState->readHead], chunk * sizeof(short));
+		pState->readHead = (pState->readHead + chunk) % kSimFIFOSize;
+		pState->readCount -= chunk;
+		buffer += chunk;
+		length -= chunk;
+	}
+	return 0;
+}
+
+static int simSetDigitalInputMode(void *device, int latch, int invert) {
+
+	return 0;
+}
+
+static int simSetExternalTriggerMode(void *device, int transition, int invert) {
+
+	return 0;
+}
+
+static int simSetSamplingInterval(void *device, int timer, int externalClock) {
+
+	ITC18SimState *pState = (ITC18SimState *)device;
+
+	if (timer < ITC18_MINIMUM_TICKS || timer > ITC18_MAXIMUM_TICKS) {
+		return kSimError;
+	}
+	pState->ticksPerInstruction = timer;
+	return 0;
+}
+
+static int simSetSequence(void *device, int length, int *instructions) {
+
+	((ITC18SimState *)device)->sequenceLength = length;
+	return 0;
+}
+
+// An armed start (externalTrigger) plays nothing until the trigger.  The trigger is synthetic: it comes 
+// triggerDelayUS after the start, or when ITC18Sim_Trigger is called.
+
+static int simStart(void *device, int externalTrigger, int outputEnable, int stopOnOverflow, int reserved) {
+
+	ITC18SimState *pState = (ITC18SimState *)device;
+
+	pState->running = true;
+	pState->awaitingTrigger = externalTrigger && pState->triggerDelayUS < 0;
+	pState->startUS = currentTimeUS() + ((externalTrigger && pState->triggerDelayUS > 0) ? pState->triggerDelayUS : 0);
+	pState->instructionsDone = 0;
+	pState->underflows = pState->dryInstructions = 0;
+	pState->outputLength = 0;
+	pushRead(pState, NULL, kSimGarbageEntries);
+	return 0;
+}
+
+static int simStop(void *device) {
+
+	return simStopAndInitialize(device, true, false);
+}
+
+static int simWriteFIFO(void *device, int length, short *buffer) {
+
+	ITC18SimState *pState = (ITC18SimState *)device;
+	long tail, chunk;
+
+	advance(pState);
+	if (length > pState->FIFOSize - pState->writeCount) {
+		return kSimError;
+	}
+	while (length > 0) {
+		tail = (pState->writeHead + pState->writeCount) % pState->FIFOSize;
+		chunk = pState->FIFOSize - tail;
+		chunk = (length < chunk) ? length : chunk;
+		memcpy(&pState->writeFIFO[tail], buffer, chunk * sizeof(short));
+		pState->writeCount += chunk;
+		buffer += chunk;
+		length -= chunk;
+	}
+	return 0;
+}
+
+const ITC18Functions simulatedITC18 = {
+	simClose, simGetFIFOReadAvailableOverflow, simGetFIFOSize, simGetFIFOWriteAvailable, simGetStructureSize,
+	simInitialize, simOpen, simReadFIFO, simSetDigitalInputMode, simSetExternalTriggerMode, simSetSamplingInterval,
+	simSetSequence, simStart, simStop, simStopAndInitialize, simWriteFIFO
+};
+
+long ITC18Sim_GetOutput(void *device, const short **ppOutput) {
+
+	ITC18SimState *pState = (ITC18SimState *)device;
+
+	advance(pState);
+	*ppOutput = pState->output;
+	return pState->outputLength;
+}
+
+long ITC18Sim_GetUnderflows(void *device) {
+
+	ITC18SimState *pState = (ITC18SimState *)device;
+
+	advance(pState);
+	return pState->underflows;
+}
+
+int ITC18Sim_SetWriteFIFOSize(void *device, long entries) {
+
+	ITC18SimState *pState = (ITC18SimState *)device;
+
+	if (pState->running || pState->writeCount > 0 || entries <= 0 || entries > kSimFIFOSize) {
+		return kSimError;
+	}
+	pState->FIFOSize = entries;
+	pState->writeHead = 0;
+	return 0;
+}
+
+void ITC18Sim_SetClockDrift(void *device, double ppm) {
+	
+	((ITC18SimState *)device)->tickTimeUS = kSimTickTimeUS * (1.0 + ppm * 1e-6);
+}
+
+void ITC18Sim_SetTriggerDelay(void *device, long delayUS) {
+	
+	((ITC18SimState *)device)->triggerDelayUS = delayUS;
+}
+
+void ITC18Sim_Trigger(void *device) {
+	
+	ITC18SimState *pState = (ITC18SimState *)device;
+	
+	if (pState->running && pState->awaitingTrigger) {
+		pState->awaitingTrigger = false;
+		pState->startUS = currentTimeUS();
+	}
+}
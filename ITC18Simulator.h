@@ -0,0 +1,61 @@
+/*
+ *  ITC18Simulator.h
+ *  ITC18StimPlugin
+ *
+ *  A software stand-in for the ITC18, so that the whole device can be run and profiled without hardware.
+ *
+ */
+
+#pragma once
+
+#include "ITC/ITC18.h"
+
+// The ITC18 driver calls used by ITC18StimDevice.  The device makes all its calls through one of these tables,
+// so that the simulator can take the place of the hardware.
+
+typedef struct {
+	int (*Close)(void *device);
+	int (*GetFIFOReadAvailableOverflow)(void *device, int *available, int *overflow);
+	int (*GetFIFOSize)(void *device);
+	int (*GetFIFOWriteAvailable)(void *device, int *available);
+	int (*GetStructureSize)(void);
+	int (*Initialize)(void *device, int setup);
+	int (*Open)(void *device, int deviceNumber);
+	int (*ReadFIFO)(void *device, int length, short *buffer);
+	int (*SetDigitalInputMode)(void *device, int latch, int invert);
+	int (*SetExternalTriggerMode)(void *device, int transition, int invert);
+	int (*SetSamplingInterval)(void *device, int timer, int externalClock);
+	int (*SetSequence)(void *device, int length, int *instructions);
+	int (*Start)(void *device, int externalTrigger, int outputEnable, int stopOnOverflow, int reserved);
+	int (*Stop)(void *device);
+	int (*StopAndInitialize)(void *device, int stop, int initialize);
+	int (*WriteFIFO)(void *device, int length, short *buffer);
+} ITC18Functions;
+
+extern const ITC18Functions hardwareITC18;
+extern const ITC18Functions simulatedITC18;
+
+// The simulator keeps a copy of everything it has played since the last start, one entry per instruction, in
+// sequence order (DA values and digital words interleaved as they were written).  The record outlasts the stop
+// and the upload of the next train, so it can be read once a train is over.  Underflows are the instructions
+// that found the write FIFO empty when more was written and played after them; the ITC18 running dry once the
+// whole train has played is not counted.
+
+long ITC18Sim_GetOutput(void *device, const short **ppOutput);
+long ITC18Sim_GetUnderflows(void *device);
+
+// The FIFOs hold 1M entries, like the ITC18's.  The write FIFO can be made smaller, so that a train can be streamed
+// through it without lasting for seconds, but only while the simulator is stopped and the write FIFO is empty.  The
+// read FIFO keeps its size, so that the write FIFO can run dry without the read FIFO overflowing first.
+
+int ITC18Sim_SetWriteFIFOSize(void *device, long entries);
+
+// The simulated ITC18 clock runs ppm parts per million slower than the host clock (faster if ppm is negative)
+
+void ITC18Sim_SetClockDrift(void *device, double ppm);
+
+// A start on the external trigger waits for a synthetic trigger, which comes delayUS after the start (1 ms unless 
+// set), or, when delayUS is negative, only when ITC18Sim_Trigger is called.
+
+void ITC18Sim_SetTriggerDelay(void *device, long delayUS);
+void ITC18Sim_Trigger(void *device);
@@ -7,16 +7,27 @@
 #include "ITC18StimDevice.h"
 #include "boost/bind.hpp"
 #include <MWorksCore/Component.h>
+#include <MWorksCore/Clock.h>
 #include <unistd.h>
 #include <assert.h>
+#include <algorithm>
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <vector>
 
 #define kDebugITC18StimDevice	1
 
 #define kBufferLength		2048
 #define kDIDeadtimeUS		5000	
 #define kDIReportTimeUS		5000
-#define kDriftTimeLimitMS	0.010
+#define kDriftTimeLimitMS	0.010				// Drift over a train that is warned about
+#define kDriftNoiseMargin	5.0					// Drift warned about is this many times the estimate error
 #define kDriftFractionLimit	0.001
+#define kDriftMinSxx		6e12				// Spread of polls (us^2) before the drift estimate is used (see fitDrift)
+#define kDriftDecay			0.9					// Weight left on earlier trains in the drift estimate after each train
 #define kGatePorchMS		25
 #define kGarbageLength		3					// Invalid entries at the start of sequence
 #define kGateBit			0
@@ -24,8 +35,29 @@
 #define kITC18TickTimeUS	1.25
 #define	kMaxChannels		4
 #define kPulseMarkerBit		0
+#define kExpandChunkSets	1024				// Sample sets expanded from runs or a waveform file per FIFO write
+#define kFillDirectSets		32					// Sample sets stored one by one before fillSets starts doubling
+#define kArenaFreeBlocks	4					// Released blocks of each size kept for reuse
+#define kPlanFractionTolerance	1e-6			// Pulse period fractions of a sample set that count as exact
+#define kPlanTicksSearched	32					// Tick counts beyond the fastest that planTiming considers
+#define kPlanWarnFraction	0.01				// Pulse timing error that planTiming warns about
 
-#define	kITC18ReadPeriodUS		25000
+#define	kBatchCodeShift			8					// Digital bits that carry the number of each train in a batch
+#define	kBatchCodeMask			0xff
+#define	kStartAttempts			2					// Primes that startStimulus will try before giving up
+#define	kLatencyReportTrains	50					// Latency percentiles are published after this many trains
+#define	kPrimedBatch			-1L					// primedGeneration of a batch, which parameter changes leave alone
+#define	kReprimeQuietUS			5000				// Parameters must be unchanged this long before a re-prime
+
+#define	kITC18CompletionLeadUS	2000				// First completion check comes this long before the expected end
+#define	kITC18CompletionPollUS	250					// Poll period once the end of a train is near
+#define	kITC18FeedPeriodUS		5000				// Poll period while streaming a train into the FIFO
+#define	kITC18TriggerPollUS		5000				// Poll period while an armed train waits for its trigger
+#define	kDriftPollPeriodUS		100000				// Poll period while a long train in the FIFO plays, for fitDrift
+#define	kADPublishPeriodUS		50000				// AD samples are published in one event this often
+#define	kADRingEntries			(0x1 << 20)			// Read FIFO entries held for publishing, about 5 s at full rate
+#define	kVerifyMaxLagSets		64					// Largest offset, in sample sets, that verifyTrain looks for
+#define	kVerifyLagAccumulators	8					// Independent sums in laggedProduct, so that it vectorizes
 #define	kReadTaskWarnSlopUS		100000
 #define	kReadTaskFailSlopUS		200000
 
@@ -64,6 +96,365 @@ void *readLaunch(const weak_ptr<ITC18StimDevice> &pITC18StimDevice) {
 	return NULL;
 }
 
+void *publishLaunch(const weak_ptr<ITC18StimDevice> &pITC18StimDevice) {
+	
+	shared_ptr <ITC18StimDevice> sp = pITC18StimDevice.lock();
+	if (sp != NULL) {
+		sp->publishADData();
+	}
+	sp.reset();
+	
+	return NULL;
+}
+
+void *verifyLaunch(const weak_ptr<ITC18StimDevice> &pITC18StimDevice, boost::shared_ptr<VerifyJob> pJob) {
+	
+	shared_ptr <ITC18StimDevice> sp = pITC18StimDevice.lock();
+	if (sp != NULL) {
+		sp->verifyTrain(pJob);
+	}
+	sp.reset();
+	
+	return NULL;
+}
+
+// The arming thread.  It sleeps until a train starts, then builds the next one, until the device goes away.  The 
+// device is only held while a train is being built.
+
+void *armLoop(const weak_ptr<ITC18StimDevice> &pITC18StimDevice, boost::shared_ptr<ArmRequests> pRequests) {
+	
+	shared_ptr <ITC18StimDevice> sp;
+	
+	for (;;) {
+		{
+			boost::mutex::scoped_lock lock(pRequests->lock);
+			while (!pRequests->armRequested && !pRequests->stopping) {
+				pRequests->wake.wait(lock);
+			}
+			if (pRequests->stopping) {
+				break;
+			}
+			pRequests->armRequested = false;
+		}
+		if ((sp = pITC18StimDevice.lock()) == NULL) {
+			break;
+		}
+		sp->armNextTrain();
+		sp.reset();
+	}
+	
+	return NULL;
+}
+
+void *reprimeLaunch(const weak_ptr<ITC18StimDevice> &pITC18StimDevice) {
+	
+	shared_ptr <ITC18StimDevice> sp = pITC18StimDevice.lock();
+	if (sp != NULL) {
+		sp->reprime();
+	}
+	sp.reset();
+	
+	return NULL;
+}
+
+// Deleter for train samples taken from the train arena.  The block goes back to the arena for reuse, unless the
+// arena already holds enough free blocks of that size, or the device (and with it the arena) is gone.
+
+class ArenaRelease {
+	
+	boost::weak_ptr<TrainArena>	arena;
+	long						sizeClass;
+	
+public:
+	ArenaRelease(const boost::shared_ptr<TrainArena> &_arena, long _sizeClass) : arena(_arena), sizeClass(_sizeClass) {}
+	
+	void operator()(short *pBlock) const {
+		
+		boost::shared_ptr<TrainArena> pArena = arena.lock();
+		
+		if (pArena != NULL) {
+			boost::mutex::scoped_lock lock(pArena->lock);
+			if (pArena->freeBlocks[sizeClass].size() < kArenaFreeBlocks) {
+				pArena->freeBlocks[sizeClass].push_front(pBlock);
+				return;
+			}
+			pArena->bytesHeld -= (kArenaMinBlockShorts << sizeClass) * sizeof(short);
+		}
+		free(pBlock);
+	}
+};
+
+// Optional variables are only present if the corresponding attribute was given in the experiment XML
+
+static boost::shared_ptr <Variable> optionalVariable(const map<string, boost::shared_ptr <Variable> > &variables, 
+													 const char *name) {
+	
+	map<string, boost::shared_ptr <Variable> >::const_iterator entry = variables.find(name);
+	
+	return (entry == variables.end()) ? boost::shared_ptr <Variable>() : entry->second;
+}
+
+// Per-channel variables are named with the channel number as a suffix (e.g. pulse_amplitude_2).  Channel 0 uses the
+// unsuffixed variables, and other channels fall back to those for any variable that is not given.
+
+static boost::shared_ptr <Variable> channelVariable(const map<string, boost::shared_ptr <Variable> > &variables,
+													const char *name, long channel, 
+													const boost::shared_ptr <Variable> &channel0Variable) {
+	
+	char channelName[128];
+	boost::shared_ptr <Variable> variable;
+	
+	if (channel == 0) {
+		return channel0Variable;
+	}
+	snprintf(channelName, sizeof(channelName), "%s_%ld", name, channel);
+	variable = optionalVariable(variables, channelName);
+	return (variable != NULL) ? variable : channel0Variable;
+}
+
+// Devices that prime and start together, by group name (see primeGroup and startGroup)
+
+static map<string, vector<weak_ptr<ITC18StimDevice> > > deviceGroups;
+static boost::mutex deviceGroupsLock;
+
+static const char *latencyStageNames[kLatencyStages] = {"load", "make", "upload", "write_fifo", "start", "completion"};
+
+// Latency below which the given fraction of the samples in a histogram fall.  This is the top of the bin holding 
+// that fraction, but never more than the longest latency seen.
+
+static MWTime latencyPercentile(const LatencyHistogram *pHistogram, float fraction) {
+	
+	long bin, count = 0;
+	
+	for (bin = 0; bin < kLatencyBins - 1; bin++) {
+		count += pHistogram->counts[bin];
+		if (count >= fraction * pHistogram->samples) {
+			break;
+		}
+	}
+	return min(((MWTime)1 << bin) - 1, pHistogram->maxUS);
+}
+
+// FNV-1a hash, used to key compiled trains in the train cache.  Fields are hashed one at a time so that struct
+// padding does not enter the key.
+
+static unsigned long hashBytes(unsigned long hash, const void *bytes, size_t length) {
+	
+	const unsigned char *pByte = (const unsigned char *)bytes;
+	
+	while (length-- > 0) {
+		hash = (hash ^ *pByte++) * 16777619UL;
+	}
+	return hash;
+}
+
+static unsigned long hashTrainData(const PulseTrainData *pTrain, long activeChannels, long FIFOSize) {
+	
+	unsigned long hash = 2166136261UL;
+	
+	hash = hashBytes(hash, &activeChannels, sizeof(activeChannels));
+	hash = hashBytes(hash, &FIFOSize, sizeof(FIFOSize));
+	for (long index = 0; index < activeChannels; index++, pTrain++) {
+		hash = hashBytes(hash, &pTrain->currentPulses, sizeof(pTrain->currentPulses));
+		hash = hashBytes(hash, &pTrain->amplitude, sizeof(pTrain->amplitude));
+		hash = hashBytes(hash, &pTrain->DAChannel, sizeof(pTrain->DAChannel));
+		hash = hashBytes(hash, &pTrain->doPulseMarkers, sizeof(pTrain->doPulseMarkers));
+		hash = hashBytes(hash, &pTrain->doGate, sizeof(pTrain->doGate));
+		hash = hashBytes(hash, &pTrain->durationMS, sizeof(pTrain->durationMS));
+		hash = hashBytes(hash, &pTrain->frequencyHZ, sizeof(pTrain->frequencyHZ));
+		hash = hashBytes(hash, &pTrain->fullRangeV, sizeof(pTrain->fullRangeV));
+		hash = hashBytes(hash, &pTrain->gateBit, sizeof(pTrain->gateBit));
+		hash = hashBytes(hash, &pTrain->gatePorchMS, sizeof(pTrain->gatePorchMS));
+		hash = hashBytes(hash, &pTrain->pulseBiphasic, sizeof(pTrain->pulseBiphasic));
+		hash = hashBytes(hash, &pTrain->pulseMarkerBit, sizeof(pTrain->pulseMarkerBit));
+		hash = hashBytes(hash, &pTrain->pulseWidthUS, sizeof(pTrain->pulseWidthUS));
+		hash = hashBytes(hash, &pTrain->UAPerV, sizeof(pTrain->UAPerV));
+	}
+	return hash;
+}
+
+// Host memory held by a compiled train, charged against the train cache budget
+
+static long compiledTrainBytes(const CompiledTrain &compiled) {
+	
+	long pulses = 0;
+	
+	for (long channel = 0; channel < compiled.channels; channel++) {
+		pulses += compiled.pulseCounts[channel];
+	}
+	return compiled.sampleCapacity * sizeof(short) + compiled.numRuns * sizeof(TrainRun) + pulses * sizeof(long);
+}
+
+// Fill sample sets with copies of one set.  The first few sets are stored directly, and a long fill then doubles
+// what has been written, as in tileShortsInRange.
+
+template <long kSetLength> static void fillSets(short *buffer, const short *values, long numSets) {
+	
+	short set[kSetLength];
+	long index, done, chunk, total = numSets * kSetLength;
+	
+	memcpy(set, values, sizeof(set));
+	for (index = 0; index < min(numSets, (long)kFillDirectSets); index++) {
+		for (long entry = 0; entry < kSetLength; entry++) {
+			buffer[index * kSetLength + entry] = set[entry];
+		}
+	}
+	for (done = index * kSetLength; done < total; done += chunk) {
+		chunk = min(done, total - done);
+		memcpy(buffer + done, buffer, chunk * sizeof(short));
+	}
+}
+
+// Scale frames of the waveform file into sample sets.  The digital word holds the gate bits, and the marker bits
+// for any frame that is not zero on every channel.
+
+template <long kSetLength> static void scaleFrames(short *buffer, const short *pFrames, const float *scale,
+												   short gateBits, short markerBits, long numFrames) {
+	
+	long frame, channel;
+	short anyValue;
+	
+	for (frame = 0; frame < numFrames; frame++, buffer += kSetLength, pFrames += kSetLength - 1) {
+		for (channel = 0, anyValue = 0; channel < kSetLength - 1; channel++) {
+			buffer[channel] = pFrames[channel] * scale[channel];
+			anyValue |= pFrames[channel];
+		}
+		buffer[kSetLength - 1] = gateBits | ((anyValue != 0) ? markerBits : 0);
+	}
+}
+
+// The sample set kernels for each number of DA channels, from 0 to ITC18_NUMBEROFDACOUTPUTS
+
+static const SetKernels setKernelTable[ITC18_NUMBEROFDACOUTPUTS + 1] = {
+	{fillSets<1>, scaleFrames<1>},
+	{fillSets<2>, scaleFrames<2>},
+	{fillSets<3>, scaleFrames<3>},
+	{fillSets<4>, scaleFrames<4>},
+	{fillSets<5>, scaleFrames<5>}
+};
+
+// The sample set kernels for a train on numChannels DA channels
+
+const SetKernels *ITC18StimDevice::kernelsForChannels(long numChannels) {
+	
+	return &setKernelTable[numChannels];
+}
+
+// Keep the sample set where each pulse of a compiled train starts, channel by channel, so that reportPulseOnsets can 
+// time the pulses once the train has played and patchCachedTrain can find them.  The starts are recorded as the 
+// pulses are laid down, counting from the first sample set of the train proper, and firstSet is where that is in 
+// the compiled train.  A pulse counts whatever its amplitude, and however closely it follows the last one.
+
+static void setPulseStarts(CompiledTrain *pCompiled, const vector<long> *starts, long firstSet) {
+	
+	long channel, pulses;
+	vector<long>::const_iterator pStart;
+	
+	memset(pCompiled->pulseCounts, 0, sizeof(pCompiled->pulseCounts));
+	pCompiled->pulseSets.reset();
+	for (channel = 0, pulses = 0; channel < pCompiled->channels; channel++) {
+		pCompiled->pulseCounts[channel] = starts[channel].size();
+		pulses += starts[channel].size();
+	}
+	if (pulses > 0) {
+		pCompiled->pulseSets = boost::shared_array<long>(new long[pulses]);
+		for (channel = 0, pulses = 0; channel < pCompiled->channels; channel++) {
+			for (pStart = starts[channel].begin(); pStart != starts[channel].end(); pStart++) {
+				pCompiled->pulseSets[pulses++] = firstSet + *pStart;
+			}
+		}
+	}
+}
+
+// Trains with the same timing differ at most in the DA values inside their pulses (see patchCachedTrain)
+
+static bool sameTrainTiming(const PulseTrainData *pA, const PulseTrainData *pB) {
+	
+	return (pA->DAChannel == pB->DAChannel && pA->doPulseMarkers == pB->doPulseMarkers && 
+			pA->doGate == pB->doGate && pA->durationMS == pB->durationMS && pA->frequencyHZ == pB->frequencyHZ && 
+			pA->fullRangeV == pB->fullRangeV && pA->gateBit == pB->gateBit && pA->gatePorchMS == pB->gatePorchMS && 
+			pA->pulseBiphasic == pB->pulseBiphasic && pA->pulseMarkerBit == pB->pulseMarkerBit && 
+			pA->pulseWidthUS == pB->pulseWidthUS);
+}
+
+static bool sameTrainData(const PulseTrainData *pA, const PulseTrainData *pB) {
+	
+	return (pA->currentPulses == pB->currentPulses && pA->amplitude == pB->amplitude && 
+			pA->UAPerV == pB->UAPerV && sameTrainTiming(pA, pB));
+}
+
+// The pulse amplitude as a fraction of the DA range
+
+static float trainRangeFraction(const PulseTrainData *pTrain) {
+	
+	return (pTrain->amplitude / pTrain->fullRangeV) / ((pTrain->currentPulses) ? pTrain->UAPerV : 1000);
+}
+
+// Number of pulses in a trace: the times the magnitude rises above threshold.  Both phases of a biphasic pulse 
+// are above threshold in magnitude, so they count as one pulse.
+
+static long countPulses(const float *values, long length, float threshold) {
+	
+	long pulses = 0;
+	bool inPulse = false;
+	
+	for (long index = 0; index < length; index++) {
+		if (fabs(values[index]) > threshold) {
+			pulses += !inPulse;
+			inPulse = true;
+		}
+		else {
+			inPulse = false;
+		}
+	}
+	return pulses;
+}
+
+// Sum of x[index + lag] * y[index] over the indices where both are defined.  The sum is split over 
+// kVerifyLagAccumulators independent accumulators, so that the compiler can vectorize the loop without being
+// allowed to reorder floating point additions.
+
+static double laggedProduct(const float *x, const float *y, long length, long lag) {
+	
+	float sums[kVerifyLagAccumulators] = {0};
+	const float *pX = x + max(lag, 0L), *pY = y + max(-lag, 0L);
+	long index, count = length - labs(lag);
+	double total = 0;
+	
+	for (index = 0; index + kVerifyLagAccumulators <= count; index += kVerifyLagAccumulators) {
+		for (long sum = 0; sum < kVerifyLagAccumulators; sum++) {
+			sums[sum] += pX[index + sum] * pY[index + sum];
+		}
+	}
+	for ( ; index < count; index++) {
+		total += pX[index] * pY[index];
+	}
+	for (long sum = 0; sum < kVerifyLagAccumulators; sum++) {
+		total += sums[sum];
+	}
+	return total;
+}
+
+// Worst fractional error in pulse width or in the interval between pulses for a given sample set period
+
+static double pulseTimingError(const PulseTrainData *pTrain, double sampleSetPeriodUS) {
+	
+	double pulsePeriodUS, setsPerPeriod, fraction, widthError, intervalError;
+	
+	widthError = (pTrain->pulseWidthUS > 0) ? fabs(round(pTrain->pulseWidthUS / sampleSetPeriodUS) * 
+						sampleSetPeriodUS - pTrain->pulseWidthUS) / pTrain->pulseWidthUS : 0;
+	intervalError = 0;
+	pulsePeriodUS = ((pTrain->frequencyHZ > 0) ? 1000000.0 / pTrain->frequencyHZ : 0);
+	if (pulsePeriodUS > 0) {
+		setsPerPeriod = pulsePeriodUS / sampleSetPeriodUS;
+		fraction = setsPerPeriod - floor(setsPerPeriod);
+		if (fraction > kPlanFractionTolerance && fraction < 1.0 - kPlanFractionTolerance) {
+			intervalError = max(fraction, 1.0 - fraction) * sampleSetPeriodUS / pulsePeriodUS;
+		}
+	}
+	return max(widthError, intervalError);
+}
+
 /********************************************************************************************************************
  Constructor and destructor functions
 ********************************************************************************************************************/
@@ -79,7 +470,9 @@ ITC18StimDevice::ITC18StimDevice(bool _noAlternativeDevice,
                                  const boost::shared_ptr <Variable> _pulse_amplitude,
                                  const boost::shared_ptr <Variable> _pulse_width_us,
                                  const boost::shared_ptr <Variable> _pulse_freq_hz,
-                                 const boost::shared_ptr <Variable> _ua_per_v) {
+                                 const boost::shared_ptr <Variable> _ua_per_v,
+								 const ITC18StimOptions &_options,
+								 const map<string, boost::shared_ptr <Variable> > &_optionalVariables) {
 
 	if (VERBOSE_IO_DEVICE >= 2) {
 		mprintf("ITC18StimDevice: constructor");
@@ -96,11 +489,100 @@ ITC18StimDevice::ITC18StimDevice(bool _noAlternativeDevice,
 	pulseWidthUS = _pulse_width_us;
 	pulseFreqHz = _pulse_freq_hz;
 	UAPerV = _ua_per_v;
+	options = _options;
+	for (long channel = 0; channel < ITC18_NUMBEROFDACOUTPUTS; channel++) {
+		ChannelVariables *pVars = &channelVariables[channel];
+		
+		pVars->biphasicPulses = channelVariable(_optionalVariables, "biphasic_pulses", channel, biphasicPulses);
+		pVars->currentPulses = channelVariable(_optionalVariables, "current_pulses", channel, currentPulses);
+		pVars->pulseAmplitude = channelVariable(_optionalVariables, "pulse_amplitude", channel, pulseAmplitude);
+		pVars->pulseFreqHz = channelVariable(_optionalVariables, "pulse_freq_hz", channel, pulseFreqHz);
+		pVars->pulseWidthUS = channelVariable(_optionalVariables, "pulse_width_us", channel, pulseWidthUS);
+		pVars->trainDurationMS = channelVariable(_optionalVariables, "train_duration_ms", channel, trainDurationMS);
+		pVars->UAPerV = channelVariable(_optionalVariables, "ua_per_v", channel, UAPerV);
+	}
+	achievedPulseFreqHz = optionalVariable(_optionalVariables, "achieved_pulse_freq_hz");
+	achievedPulseWidthUS = optionalVariable(_optionalVariables, "achieved_pulse_width_us");
+	FIFOUnderruns = optionalVariable(_optionalVariables, "fifo_underruns");
+	FIFOOverflows = optionalVariable(_optionalVariables, "fifo_overflows");
+	FIFOStats = optionalVariable(_optionalVariables, "fifo_stats");
+	trainCacheHitCount = optionalVariable(_optionalVariables, "train_cache_hits");
+	trainCacheMissCount = optionalVariable(_optionalVariables, "train_cache_misses");
+	latencyStats = optionalVariable(_optionalVariables, "latency_stats");
+	triggerArmedTime = optionalVariable(_optionalVariables, "trigger_armed_time_us");
+	stimulusOnsetTime = optionalVariable(_optionalVariables, "stimulus_onset_time_us");
+	startSkew = optionalVariable(_optionalVariables, "start_skew_us");
+	queueTrain = optionalVariable(_optionalVariables, "queue_train");
+	interTrainIntervalMS = optionalVariable(_optionalVariables, "inter_train_interval_ms");
+	batchTrainOnset = optionalVariable(_optionalVariables, "batch_train_onset");
+	pulseOnsets = optionalVariable(_optionalVariables, "pulse_onsets");
+	clockDriftPPM = optionalVariable(_optionalVariables, "clock_drift_ppm");
+	ADData = optionalVariable(_optionalVariables, "ad_data");
+	verifyAmplitudeError = optionalVariable(_optionalVariables, "verify_amplitude_error");
+	verifyPulseCountError = optionalVariable(_optionalVariables, "verify_pulse_count_error");
+	verifyOffsetUS = optionalVariable(_optionalVariables, "verify_offset_us");
 
-	ITC18Running = false;
+	pITC18 = (options.simulate) ? &simulatedITC18 : &hardwareITC18;
+	deviceState = kDeviceIdle;
 	run->setValue(false);
 	running->setValue(false);
 	itc = NULL;
+	streamingTrain = false;
+	waitingForTrigger = false;
+	totalUnderruns = trainUnderruns = 0;
+	totalOverflows = 0;
+	readHighWater = 0;
+	writeLowWater = -1;
+	readOverflowed = false;
+	trainCacheBytes = trainCacheHits = trainCacheMisses = 0;
+	parameterGeneration = primedGeneration = 0;
+	timingWarnedGeneration = -1;
+	lastParameterChangeUS = 0;
+	reprimePending = false;
+	armedTrainReady = false;
+	waveformData = NULL;
+	waveformBytes = 0;
+	waveformFrames = 0;
+	waveformTrain = false;
+	setKernels = kernelsForChannels(0);
+	memset(latency, 0, sizeof(latency));
+	madeTrainBytes = 0;
+	armRequests = boost::shared_ptr<ArmRequests>(new ArmRequests);
+	armRequests->armRequested = armRequests->stopping = false;
+	trainArena = boost::shared_ptr<TrainArena>(new TrainArena);
+	trainArena->bytesHeld = trainArena->highWaterBytes = 0;
+	trainsSinceLatencyReport = 0;
+	runRequestTimeUS = 0;
+	readCountUS = 0;
+	memset(&driftPolls, 0, sizeof(driftPolls));
+	driftRatio = 1.0;
+	driftSxx = driftSxy = 0;
+	driftScatterUS = 0;
+	driftWarned = false;
+	startedUS = 0;
+	pollingPeriodUS = 0;
+	batchTrains = batchTrainsReported = 0;
+	memset(pulseCounts, 0, sizeof(pulseCounts));
+	
+	// AD samples are only taken if there is somewhere to publish them, or a channel to verify.  The verified channel
+	// is looped back to the AD input of the same number, so that input is always sampled.
+	
+	options.verifyChannel = (options.verifyChannel < options.channels) ? options.verifyChannel : -1;
+	options.ADChannels = (ADData == NULL) ? 0 : min(options.ADChannels, (long)kMaxChannels);
+	options.ADChannels = max(options.ADChannels, options.verifyChannel + 1);
+	ADChannels = 0;
+	verifyChannel = -1;
+	verifyRunning = false;
+	ADStartUS = 0;
+	ADSamples.capacity = kADRingEntries;
+	ADSamples.head = ADSamples.tail = 0;
+	if (options.ADChannels > 0) {
+		ADSamples.entries = boost::shared_array<short>(new short[ADSamples.capacity]);
+	}
+	setOptionalValue(FIFOUnderruns, 0L);
+	setOptionalValue(FIFOOverflows, 0L);
+	setOptionalValue(trainCacheHitCount, 0L);
+	setOptionalValue(trainCacheMissCount, 0L);
 }
 
 // Copy constructor should never be called
@@ -122,6 +604,38 @@ ITC18StimDevice::~ITC18StimDevice(){
         pulseScheduleNode->cancel();
 		pulseScheduleNode->kill();
     }
+	{
+		boost::mutex::scoped_lock locker(reprimeNodeLock);
+		if (reprimeNode != NULL) {
+			reprimeNode->cancel();
+		}
+	}
+	{
+		boost::mutex::scoped_lock lock(armRequests->lock);
+		armRequests->stopping = true;
+		armRequests->wake.notify_one();
+	}
+	if (armThread.joinable() && armThread.get_id() != boost::this_thread::get_id()) {
+		armThread.join();
+	}
+	else {
+		armThread.detach();							// the last reference was dropped by the arming thread itself
+	}
+	if (verifyThread.joinable() && verifyThread.get_id() != boost::this_thread::get_id()) {
+		verifyThread.join();
+	}
+	else {
+		verifyThread.detach();
+	}
+	if (waveformData != NULL) {
+		munmap((void *)waveformData, waveformBytes);
+	}
+	for (long sizeClass = 0; sizeClass < kArenaSizes; sizeClass++) {
+		while (!trainArena->freeBlocks[sizeClass].empty()) {
+			free(trainArena->freeBlocks[sizeClass].front());
+			trainArena->freeBlocks[sizeClass].pop_front();
+		}
+	}
 }
 
 /********************************************************************************************************************
@@ -137,6 +651,10 @@ bool ITC18StimDevice::initialize() {
 		mprintf("ITC18StimDevice: initialize");
 	}
     this->variableSetup();
+	if (!options.group.empty()) {
+		boost::mutex::scoped_lock lock(deviceGroupsLock);
+		deviceGroups[options.group].push_back(weak_ptr<ITC18StimDevice>(shared_from_this()));
+	}
 	openITC18();
 	if (itc != NULL && VERBOSE_IO_DEVICE >= 0) {
         mprintf("ITC18StimDevice::initialize: found ITC18StimDevice");
@@ -144,6 +662,9 @@ bool ITC18StimDevice::initialize() {
 	if (itc == NULL && noAlternativeDevice) {
         mprintf("ITC18StimDevice::initialize: no ITC18 or alternative device, running without ITC18 hardware");
 	}
+	if (!openWaveform()) {
+		return false;
+	}
 	loadInstructions();									// and make and load those instructions
 	return ((itc != NULL) || noAlternativeDevice);
 }
@@ -161,6 +682,17 @@ void ITC18StimDevice::variableSetup() {
 	this->pulseWidthUS->addNotification(notif);
 	this->pulseFreqHz->addNotification(notif);
 	this->UAPerV->addNotification(notif);
+	for (long channel = 1; channel < options.channels; channel++) {		// only those not shared with channel 0
+		ChannelVariables *pVars = &channelVariables[channel];
+		
+		if (pVars->trainDurationMS != trainDurationMS) pVars->trainDurationMS->addNotification(notif);
+		if (pVars->currentPulses != currentPulses) pVars->currentPulses->addNotification(notif);
+		if (pVars->biphasicPulses != biphasicPulses) pVars->biphasicPulses->addNotification(notif);
+		if (pVars->pulseAmplitude != pulseAmplitude) pVars->pulseAmplitude->addNotification(notif);
+		if (pVars->pulseWidthUS != pulseWidthUS) pVars->pulseWidthUS->addNotification(notif);
+		if (pVars->pulseFreqHz != pulseFreqHz) pVars->pulseFreqHz->addNotification(notif);
+		if (pVars->UAPerV != UAPerV) pVars->UAPerV->addNotification(notif);
+	}
 	
 	// set up to detect requests to prime the instructions
     
@@ -173,12 +705,161 @@ void ITC18StimDevice::variableSetup() {
 	weak_ptr<ITC18StimDevice> weak_self_ref3(getSelfPtr<ITC18StimDevice>());
 	shared_ptr<VariableNotification> notif3(new ITC18StimDeviceRunNotification(weak_self_ref3));
 	this->run->addNotification(notif3); 
+	
+	// set up to detect requests to queue a train for a batch
+	
+	if (queueTrain != NULL) {
+		weak_ptr<ITC18StimDevice> weak_self_ref4(getSelfPtr<ITC18StimDevice>());
+		shared_ptr<VariableNotification> notif4(new ITC18StimDeviceQueueNotification(weak_self_ref4));
+		queueTrain->addNotification(notif4);
+	}
 }
 
 /********************************************************************************************************************
  Object functions
 ********************************************************************************************************************/
 
+// Write the pulses for one channel into a train whose channels have different pulse timing.  Each pulse sets the 
+// channel's DA value and adds the pulse marker bits to the digital word of every sample set it covers, and its 
+// first sample set is added to pStarts.  Pulses that would run past the end of the channel's own duration are left 
+// out.
+
+void ITC18StimDevice::addChannelPulses(short *trainValues, PulseTrainData *pTrain, long channel, 
+									   long instructionsPerSampleSet, float sampleSetPeriodUS, float rangeFraction, 
+									   short pulseBits, vector<long> *pStarts) {
+	
+	long pulseCount, sampleSetIndex, setIndex, sampleSetsPerPhase, sampleSetsPerPulse, sampleSetsInTrain;
+	short phaseValues[2], *pSampleSet;
+	float pulsePeriodUS;
+	
+	sampleSetsPerPhase = round(pTrain->pulseWidthUS / sampleSetPeriodUS);
+	sampleSetsPerPulse = sampleSetsPerPhase * ((pTrain->pulseBiphasic) ? 2 : 1);
+	sampleSetsInTrain = pTrain->durationMS * 1000.0 / sampleSetPeriodUS;
+	pulsePeriodUS = ((pTrain->frequencyHZ > 0) ? 1.0 / pTrain->frequencyHZ * 1000000.0 : 0);
+	if ((pulsePeriodUS <= 0) || (sampleSetsPerPhase <= 0)) {
+		return;
+	}
+	phaseValues[0] = rangeFraction * 0x7fff;
+	phaseValues[1] = -rangeFraction * 0x7fff;
+	for (pulseCount = 0; ; pulseCount++) {
+		sampleSetIndex = pulseCount * pulsePeriodUS / sampleSetPeriodUS;
+		if (sampleSetIndex + sampleSetsPerPulse > sampleSetsInTrain) {
+			break;
+		}
+		pStarts->push_back(sampleSetIndex);
+		pSampleSet = trainValues + sampleSetIndex * instructionsPerSampleSet;
+		for (setIndex = 0; setIndex < sampleSetsPerPulse; setIndex++, pSampleSet += instructionsPerSampleSet) {
+			pSampleSet[channel] = phaseValues[setIndex / sampleSetsPerPhase];
+			pSampleSet[instructionsPerSampleSet - 1] |= pulseBits;
+		}
+	}
+}
+
+/*
+ Get a buffer for the samples of a train from the train arena.  The arena holds blocks in power-of-two sizes, from 
+ kArenaMinBlockShorts up to the first size that holds a train as long as the FIFO.  Blocks come back to the arena 
+ when the last reference to their train goes away (see ArenaRelease), so once the arena is warm a prime needs no 
+ allocation.  Longer trains (which must be streamed) are allocated on their own.  The number of shorts in the buffer 
+ is returned in pCapacity.  If there is no memory for the buffer, an empty one is returned.
+ */
+
+boost::shared_array<short> ITC18StimDevice::allocateSamples(long length, long *pCapacity) {
+	
+	long sizeClass, blockLength;
+	short *pBlock;
+	
+	for (sizeClass = 0; sizeClass < kArenaSizes - 1 && (kArenaMinBlockShorts << sizeClass) < length; sizeClass++) {
+	}
+	blockLength = kArenaMinBlockShorts << sizeClass;
+	if (blockLength < length || blockLength >= 2 * max(FIFOSize, (long)kArenaMinBlockShorts)) {
+		if ((pBlock = (short *)malloc(length * sizeof(short))) == NULL) {
+			merror(M_IODEVICE_MESSAGE_DOMAIN, "ITC18StimDevice: no memory for a train of %ld samples", length);
+			*pCapacity = 0;
+			return boost::shared_array<short>();
+		}
+		{
+			boost::mutex::scoped_lock lock(latencyLock);
+			madeTrainBytes += length * sizeof(short);
+		}
+		*pCapacity = length;
+		return boost::shared_array<short>(pBlock, free);
+	}
+	boost::mutex::scoped_lock lock(trainArena->lock);
+	if (!trainArena->freeBlocks[sizeClass].empty()) {
+		pBlock = trainArena->freeBlocks[sizeClass].front();
+		trainArena->freeBlocks[sizeClass].pop_front();
+	}
+	else {
+		if ((pBlock = (short *)malloc(blockLength * sizeof(short))) == NULL) {
+			merror(M_IODEVICE_MESSAGE_DOMAIN, "ITC18StimDevice: no memory for a train of %ld samples", length);
+			*pCapacity = 0;
+			return boost::shared_array<short>();
+		}
+		trainArena->bytesHeld += blockLength * sizeof(short);
+		trainArena->highWaterBytes = max(trainArena->highWaterBytes, trainArena->bytesHeld);
+		lock.unlock();
+		boost::mutex::scoped_lock statsLock(latencyLock);
+		madeTrainBytes += blockLength * sizeof(short);
+	}
+	*pCapacity = blockLength;
+	return boost::shared_array<short>(pBlock, ArenaRelease(trainArena, sizeClass));
+}
+
+// Build the next train from the current parameters, ready for loadInstructions to upload.  The train is tagged with
+// the parameter generation it was read under.  If a parameter changes while the values are being read or the train
+// is being built, the train is stale, and it is dropped rather than armed.
+
+void ITC18StimDevice::armNextTrain(void) {
+	
+	PulseTrainData trains[ITC18_NUMBEROFDACOUTPUTS];
+	CompiledTrain compiled;
+	long generation = parameterGeneration;
+	
+	getTrainData(trains);
+	if (parameterGeneration != generation || !compileTrain(trains, options.channels, &compiled)) {
+		return;
+	}
+	boost::mutex::scoped_lock lock(armedTrainLock);
+	if (parameterGeneration != generation) {
+		return;
+	}
+	armedTrain = compiled;
+	armedGeneration = generation;
+	armedTrainReady = true;
+}
+
+// Add a train that was just made to the front of the train cache, then drop least recently used trains until the
+// cache is back within its memory budget.  Trains that are bigger than the whole budget are not cached.
+
+void ITC18StimDevice::cacheTrain(const CompiledTrain &compiled) {
+	
+	long trainBytes = compiledTrainBytes(compiled);
+	
+	if (trainBytes > options.trainCacheMB * 1024L * 1024L) {
+		return;
+	}
+	boost::mutex::scoped_lock lock(trainCacheLock);
+	trainCache.push_front(compiled);
+	trainCacheBytes += trainBytes;
+	while (trainCacheBytes > options.trainCacheMB * 1024L * 1024L) {
+		trainCacheBytes -= compiledTrainBytes(trainCache.back());
+		trainCache.pop_back();
+	}
+}
+
+// Move the device from one state to another, if it is in the first state.  Returns false if it was not.  All 
+// changes of state go through here, so that each one is a single step that other threads cannot split.
+
+bool ITC18StimDevice::changeDeviceState(long fromState, long toState) {
+	
+	boost::mutex::scoped_lock lock(deviceStateLock);
+	if (deviceState != fromState) {
+		return false;
+	}
+	deviceState = toState;
+	return true;
+}
+
 // Start the stimulus when "run" is set true.  Do nothing if it is set false.  The only way to stop the stimulus
 // is to let it self terminate or call stopDeviceIO.
 
@@ -188,6 +869,7 @@ void ITC18StimDevice::changeRunState(void) {
 		return;
 	}
 	if (run->getValue()) {					// command to start run
+		runRequestTimeUS = Clock::instance()->getCurrentTimeUS();
 		startStimulus();
 	}
 //	else {									// command to shut down
@@ -195,6 +877,14 @@ void ITC18StimDevice::changeRunState(void) {
 //	}
 }
 
+// Drop any trains queued for a batch
+
+void ITC18StimDevice::clearTrainQueue(void) {
+	
+	boost::mutex::scoped_lock lock(batchQueueLock);
+	batchQueue.clear();
+}
+
 // Close the ITC18.  We do a round-about with the pointers to make sure that the
 // pointer is nulled out before we close the ITC.  This is needed so that interrupt
 // driven routines won't use the itc after ITC18_Close has been called.
@@ -208,139 +898,711 @@ void ITC18StimDevice::closeITC18(void) {
 		pLocal = itc;
 		itc = NULL;
 		boost::mutex::scoped_lock lock(ITC18DeviceLock); 
-		ITC18_Close(pLocal);
+		pITC18->Close(pLocal);
 	}
 }
 
-// Get the number of entries ready to be read from the FIFO.  We assume that the device has been locked before
-// this method is called
+// Get a compiled train for a set of train parameters: a waveform train if a waveform file is configured, otherwise 
+// a pulse train from the train cache, or newly made (and cached) if it is not there.
 
-int	ITC18StimDevice::getAvailable() {
+bool ITC18StimDevice::compileTrain(PulseTrainData *pTrain, long activeChannels, CompiledTrain *pCompiled) {
+	
+	MWTime startUS;
+	
+	if (!options.waveformFile.empty()) {
+		return makeWaveformTrain(pTrain, activeChannels, pCompiled);
+	}
+	if (findCachedTrain(pTrain, activeChannels, pCompiled)) {
+		return true;
+	}
+	startUS = Clock::instance()->getCurrentTimeUS();
+	if (patchCachedTrain(pTrain, activeChannels, pCompiled)) {
+		recordLatency(kMakeLatency, startUS);
+		return true;
+	}
+	if (!makeTrainSamples(pTrain, activeChannels, pCompiled)) {
+		return false;
+	}
+	recordLatency(kMakeLatency, startUS);
+	cacheTrain(*pCompiled);
+	return true;
+}
 
-	int available, overflow;
+// Read everything the ITC18 has put in the read FIFO, and return the number of entries it has put there since the 
+// start.  The garbage entries at the start of the sequence, and everything when no AD channels are sampled, are 
+// read into a scratch buffer and dropped.  The entries of a train with AD channels are read straight into the AD 
+// ring for publishADData to pick up.  If the ring is full, the rest are left in the read FIFO, which holds another few
+// seconds of entries, until the next call.
+
+long ITC18StimDevice::drainReadFIFO(void) {
+	
+	int available, overflow, result;
+	long head, chunk, trainEnd = kGarbageLength + bufferLengthSamples;
+	short scratch[kBufferLength];
 	
 	boost::mutex::scoped_lock lock(ITC18DeviceLock);
-	ITC18_GetFIFOReadAvailableOverflow(itc, &available, &overflow);
+	readCountUS = Clock::instance()->getCurrentTimeUS();		// before the call, whose length varies with the count
+	pITC18->GetFIFOReadAvailableOverflow(itc, &available, &overflow);
+	readHighWater = max(readHighWater, (long)available);
 	if (overflow != 0) {
-        merror(M_IODEVICE_MESSAGE_DOMAIN, "ITC18StimDevice::getAvailable: Fatal FIFO overflow.");
-		exit(0);
+		readOverflowed = true;
 	}
-	return available;
+	while (available > 0) {
+		if (ADChannels > 0 && samplesRead >= kGarbageLength && samplesRead < trainEnd) {
+			head = ADSamples.head;
+			chunk = min((long)available, trainEnd - samplesRead);
+			chunk = min(chunk, ADSamples.capacity - (head - ADSamples.tail));
+			chunk = min(chunk, ADSamples.capacity - (head & (ADSamples.capacity - 1)));
+			if (chunk <= 0) {
+				break;
+			}
+			result = pITC18->ReadFIFO(itc, chunk, &ADSamples.entries[head & (ADSamples.capacity - 1)]);
+			__sync_synchronize();								// the entries are in the ring before head moves
+			ADSamples.head = head + chunk;
+		}
+		else {
+			chunk = min(available, kBufferLength);
+			if (ADChannels > 0 && samplesRead < kGarbageLength) {
+				chunk = min(chunk, kGarbageLength - samplesRead);
+			}
+			result = pITC18->ReadFIFO(itc, chunk, scratch);
+		}
+		if (result != noErr) {
+			merror(M_IODEVICE_MESSAGE_DOMAIN, "ITC18StimDevice::drainReadFIFO: ITC18_ReadFIFO failed, result: %d", 
+				   result);
+			break;
+		}
+		samplesRead += chunk;
+		available -= chunk;
+	}
+	return samplesRead + available;
 }
 
-// Load ITC18 with instructions based on current stimulus parameters 
+/*
+ Add a train to the batch that the next prime will load.  A batch plays its trains one after another as a single 
+ ITC18 sequence with one start, each train followed by intervalMS with all outputs off.  pTrains holds one 
+ PulseTrainData for each channel.  Trains can be queued while a train or a batch is playing.
+ */
 
-void ITC18StimDevice::loadInstructions(void) {
+void ITC18StimDevice::enqueueTrain(PulseTrainData *pTrains, long intervalMS) {
 	
-	PulseTrainData train;
+	BatchEntry entry;
 	
-	train.currentPulses = currentPulses->getValue();				// true for current, false for voltage
-	train.amplitude = pulseAmplitude->getValue();
-	train.DAChannel = 0;
-	train.doPulseMarkers = true;
-	train.doGate = true;
-	train.durationMS = trainDurationMS->getValue();
-	train.frequencyHZ = pulseFreqHz->getValue();
-	train.fullRangeV = POSITIVEVOLT;
-	train.gateBit = 0;
-	train.gatePorchMS = 25;
-	train.pulseBiphasic = biphasicPulses->getValue();
-	train.pulseMarkerBit = 1;
-	train.pulseWidthUS = pulseWidthUS->getValue();
-	train.UAPerV = UAPerV->getValue();
-	
-	loadInstructionsFromTrainData(&train, 1L);
-	parametersDirty = false;
+	memset(&entry, 0, sizeof(entry));
+	memcpy(entry.trains, pTrains, min(options.channels, (long)ITC18_NUMBEROFDACOUTPUTS) * sizeof(PulseTrainData));
+	entry.intervalMS = max(0L, intervalMS);
+	boost::mutex::scoped_lock lock(batchQueueLock);
+	batchQueue.push_back(entry);
 }
 
-/* 
- Make the instruction sequence for the ITC18 and load the ITC18 so it is ready to run
- 
+// Expand sample sets of a train made of runs (see makeTrainRuns) into buffer
+
+void ITC18StimDevice::expandRuns(short *buffer, long firstSet, long numSets) {
+	
+	long low = 0, high = numRuns - 1, middle, run, runEnd, sets;
+	long instructionsPerSampleSet = channels + 1;
+	
+	while (low < high) {								// find the run holding firstSet
+		middle = (low + high + 1) / 2;
+		if (runs[middle].firstSet <= firstSet) {
+			low = middle;
+		}
+		else {
+			high = middle - 1;
+		}
+	}
+	for (run = low; numSets > 0; run++) {
+		runEnd = (run + 1 < numRuns) ? runs[run + 1].firstSet : bufferLengthSamples / instructionsPerSampleSet;
+		sets = min(runEnd - firstSet, numSets);
+		setKernels->fillSets(buffer, runs[run].values, sets);
+		buffer += sets * instructionsPerSampleSet;
+		firstSet += sets;
+		numSets -= sets;
+	}
+}
+
+// Expand sample sets of a waveform train into buffer.  Each set holds one frame of the waveform file scaled for 
+// each channel, or zeros in the gate porches.  The digital word carries the gate bits throughout, the pulse marker 
+// bits wherever any channel is non-zero, and is cleared in the very last set to close the gate.
+
+void ITC18StimDevice::expandWaveform(short *buffer, long firstSet, long numSets) {
+	
+	short porchSet[kMaxChannels + 1], *pLastSet = NULL;
+	long channel, sets, instructionsPerSampleSet = channels + 1;
+	
+	for (channel = 0; channel < channels; channel++) {
+		porchSet[channel] = 0;
+	}
+	porchSet[channels] = waveformGateBits;
+	if (firstSet <= bufferLengthSets - 1 && bufferLengthSets - 1 < firstSet + numSets) {
+		pLastSet = buffer + (bufferLengthSets - 1 - firstSet) * instructionsPerSampleSet;
+	}
+	sets = min(numSets, max(0L, porchSets - firstSet));					// front porch
+	setKernels->fillSets(buffer, porchSet, sets);
+	buffer += sets * instructionsPerSampleSet;
+	firstSet += sets;
+	numSets -= sets;
+	sets = min(numSets, max(0L, porchSets + waveformFrames - firstSet));	// frames
+	setKernels->scaleFrames(buffer, waveformData + (firstSet - porchSets) * channels, waveformScale, 
+							waveformGateBits, waveformMarkerBits, sets);
+	buffer += sets * instructionsPerSampleSet;
+	setKernels->fillSets(buffer, porchSet, numSets - sets);				// back porch
+	if (pLastSet != NULL) {
+		pLastSet[channels] = 0;											// close the gate
+	}
+}
+
+// Top up the ITC18 FIFO from the host copy (or waveform file) of a train that is too long to fit in the FIFO all at 
+// once.  The write FIFO has run dry (an underrun) if it is as empty as it was before the train was loaded. 
+
+void ITC18StimDevice::feedFIFO(void) {
+	
+	int writeAvailable, result;
+	
+	if (itc == NULL) {
+		return;
+	}
+	if (samplesWritten < bufferLengthSamples) {
+		{
+			boost::mutex::scoped_lock lock(ITC18DeviceLock);
+			pITC18->GetFIFOWriteAvailable(itc, &writeAvailable);
+		}
+		if (writeAvailable >= emptyWriteAvailable) {
+			trainUnderruns++;
+			totalUnderruns++;
+		}
+		writeLowWater = (writeLowWater < 0) ? emptyWriteAvailable - writeAvailable : 
+				min(writeLowWater, (long)(emptyWriteAvailable - writeAvailable));
+		result = writeTrainToFIFO(writeAvailable);
+		if (result != noErr) { 
+			merror(M_IODEVICE_MESSAGE_DOMAIN, "ITC18StimDevice::feedFIFO: ITC18_WriteFIFO failed, result: %d", result);
+		}
+	}
+}
+
+// Look for a train with the same parameters in the train cache.  If there is one, return it in pCompiled and move 
+// it to the front of the cache.
+
+bool ITC18StimDevice::findCachedTrain(PulseTrainData *pTrain, long activeChannels, CompiledTrain *pCompiled) {
+	
+	unsigned long key = hashTrainData(pTrain, activeChannels, FIFOSize);
+	list<CompiledTrain>::iterator entry;
+	long index;
+	
+	boost::mutex::scoped_lock lock(trainCacheLock);
+	for (entry = trainCache.begin(); entry != trainCache.end(); entry++) {
+		if (entry->key != key || entry->activeChannels != activeChannels || entry->FIFOSize != FIFOSize) {
+			continue;
+		}
+		for (index = 0; index < activeChannels && sameTrainData(&entry->trains[index], &pTrain[index]); index++) {
+		}
+		if (index == activeChannels) {
+			break;
+		}
+	}
+	if (entry == trainCache.end()) {
+		setOptionalValue(trainCacheMissCount, ++trainCacheMisses);
+		return false;
+	}
+	trainCache.splice(trainCache.begin(), trainCache, entry);
+	*pCompiled = *entry;
+	setOptionalValue(trainCacheHitCount, ++trainCacheHits);
+	return true;
+}
+
+// Complete a start once the ITC18 has been started: report the start, and schedule the polling and the arming of 
+// the next train.
+
+void ITC18StimDevice::finishStart(void) {
+	
+	recordLatency(kStartLatency, runRequestTimeUS);
+	if (options.externalTrigger) {
+		waitingForTrigger = true;
+		if (triggerArmedTime != NULL) {
+			triggerArmedTime->setValue(Datum((long long)startedUS), startedUS);
+		}
+	}
+	
+	// A train in the FIFO needs little attention until it is about to end (see scheduleEndPolling).  A train being 
+	// streamed needs topping up throughout.  An armed train has no expected end until its trigger comes.  The onsets 
+	// of the trains in a batch are reported as they come, so a batch is polled throughout, as is a train whose AD 
+	// samples are being collected.
+	
+	if (streamingTrain || batchTrains > 0 || ADChannels > 0) {
+		schedulePolling(0, kITC18FeedPeriodUS);
+	}
+	else if (options.externalTrigger) {
+		schedulePolling(0, kITC18TriggerPollUS);
+	}
+	else {
+		scheduleEndPolling((MWTime)((kGarbageLength + bufferLengthSamples + 1) * ticksPerInstruction * kITC18TickTimeUS));
+	}
+	if (ADChannels > 0) {
+		ADStartUS = startedUS + (MWTime)(kGarbageLength * ticksPerInstruction * kITC18TickTimeUS);
+		boost::mutex::scoped_lock lock(ADPublishNodeLock);
+		if (ADPublishNode != NULL) {
+			ADPublishNode->cancel();
+		}
+		ADPublishNode = scheduler->scheduleUS(std::string(FILELINE ": ") + tag, kADPublishPeriodUS, kADPublishPeriodUS,
+											  M_REPEAT_INDEFINITELY, 
+											  boost::bind(publishLaunch, weak_ptr<ITC18StimDevice>(shared_from_this())),
+											  M_DEFAULT_IODEVICE_PRIORITY, kReadTaskWarnSlopUS, kReadTaskFailSlopUS, 
+											  M_MISSED_EXECUTION_DROP);
+	}
+	if (!armThread.joinable()) {
+		armThread = boost::thread(boost::bind(armLoop, weak_ptr<ITC18StimDevice>(shared_from_this()), armRequests));
+	}
+	boost::mutex::scoped_lock lock(armRequests->lock);
+	armRequests->armRequested = true;
+	armRequests->wake.notify_one();
+}
+
+/*
+ Update the estimate of how fast the ITC18 clock runs against the host clock with the polls of the train that has 
+ just ended.  Every poll pairs a read FIFO count, which is nominal ITC18 time, with the host time it was taken.  The
+ slope of host time against ITC18 time within each train is the drift ratio, and the sums for the slope are pooled 
+ over trains (fading by kDriftDecay each train), so trains polled over a longer time count for more.  A train whose 
+ own slope is wildly off (the host clock jumped, say) is left out.  The ratio is used to correct the times worked 
+ out from FIFO counts once the pooled polls are spread widely enough to pin it down.  The error of the slope is the
+ timing noise of a poll over the square root of the spread (Sxx), so kDriftMinSxx puts it within 20 ppm for polls
+ good to 50 us.  Polled every kDriftPollPeriodUS, a train of 1 s gives an Sxx of about 1.5e12 us^2, so the estimate 
+ is used after a handful of such trains, or a single train of a few seconds.
+ 
+ The noise is measured as the scatter of each train's polls about their line (driftScatterUS).  A drift is warned 
+ about when it moves a train by more than kDriftTimeLimitMS, and is also kDriftNoiseMargin times the error that 
+ this scatter gives the estimate, so that noisy polls do not raise warnings about drift that is not there.  The 
+ polls of the software ITC18 scatter by a couple of microseconds (see DriftTest), well inside both limits.
+ */
+
+void ITC18StimDevice::fitDrift(void) {
+	
+	double sxx, sxy, syy, drift, noise, trainUS;
+	
+	if (driftPolls.polls >= 3) {
+		sxx = driftPolls.sumXX - driftPolls.sumX * driftPolls.sumX / driftPolls.polls;
+		sxy = driftPolls.sumXY - driftPolls.sumX * driftPolls.sumY / driftPolls.polls;
+		syy = driftPolls.sumYY - driftPolls.sumY * driftPolls.sumY / driftPolls.polls;
+		if (sxx > 0) {
+			driftScatterUS = sqrt(max(0.0, syy - sxy * sxy / sxx) / (driftPolls.polls - 2));
+		}
+		if (sxx > 0 && fabs(sxy / sxx - 1.0) < 10 * kDriftFractionLimit) {
+			driftSxx = driftSxx * kDriftDecay + sxx;
+			driftSxy = driftSxy * kDriftDecay + sxy;
+		}
+	}
+	memset(&driftPolls, 0, sizeof(driftPolls));
+	if (driftSxx < kDriftMinSxx) {
+		return;
+	}
+	driftRatio = driftSxy / driftSxx;
+	drift = driftRatio - 1.0;
+	noise = driftScatterUS / sqrt(driftSxx);
+	trainUS = bufferLengthSamples * ticksPerInstruction * kITC18TickTimeUS;
+	setOptionalValue(clockDriftPPM, (float)(drift * 1e6));
+	if (fabs(drift) > kDriftFractionLimit || 
+				(fabs(drift) * trainUS > kDriftTimeLimitMS * 1000 && fabs(drift) > kDriftNoiseMargin * noise)) {
+		if (!driftWarned) {
+			mwarning(M_IODEVICE_MESSAGE_DOMAIN, 
+					 "ITC18StimDevice::fitDrift: ITC18 clock is %.0f ppm %s than the host clock, %.3f ms over a train "
+					 "(times from the ITC18 are corrected)", fabs(drift) * 1e6, (drift > 0) ? "slower" : "faster", 
+					 fabs(drift) * trainUS / 1000.0);
+			driftWarned = true;
+		}
+	}
+	else {
+		driftWarned = false;
+	}
+}
+
+// Get the number of entries ready to be read from the FIFO.  An overflow is only noted here, for readData to 
+// recover from (see recoverFromOverflow).
+
+int	ITC18StimDevice::getAvailable() {
+
+	int available, overflow;
+	
+	boost::mutex::scoped_lock lock(ITC18DeviceLock);
+	readCountUS = Clock::instance()->getCurrentTimeUS();		// before the call, whose length varies with the count
+	pITC18->GetFIFOReadAvailableOverflow(itc, &available, &overflow);
+	readHighWater = max(readHighWater, (long)available);
+	if (overflow != 0) {
+		readOverflowed = true;
+	}
+	return available;
+}
+
+// Fill in one PulseTrainData struct per active channel from the current values of the stimulus variables
+
+void ITC18StimDevice::getTrainData(PulseTrainData *pTrains) {
+	
+	long channel;
+	PulseTrainData *pTrain;
+	ChannelVariables *pVars;
+	
+	for (channel = 0; channel < options.channels; channel++) {
+		pTrain = &pTrains[channel];
+		pVars = &channelVariables[channel];
+		pTrain->currentPulses = pVars->currentPulses->getValue();		// true for current, false for voltage
+		pTrain->amplitude = pVars->pulseAmplitude->getValue();
+		pTrain->DAChannel = (options.waveformFile.empty()) ? channel : options.waveformDAChannels[channel];
+		pTrain->doPulseMarkers = true;
+		pTrain->doGate = true;
+		pTrain->durationMS = pVars->trainDurationMS->getValue();
+		pTrain->frequencyHZ = pVars->pulseFreqHz->getValue();
+		pTrain->fullRangeV = POSITIVEVOLT;
+		pTrain->gateBit = 0;
+		pTrain->gatePorchMS = 25;
+		pTrain->pulseBiphasic = pVars->biphasicPulses->getValue();
+		pTrain->pulseMarkerBit = 1;
+		pTrain->pulseWidthUS = pVars->pulseWidthUS->getValue();
+		pTrain->UAPerV = pVars->UAPerV->getValue();
+	}
+}
+
+// The live devices in this device's group, in the order they joined it.  The first one leads the group.
+
+void ITC18StimDevice::groupMembers(vector<shared_ptr<ITC18StimDevice> > *pMembers) {
+	
+	vector<weak_ptr<ITC18StimDevice> >::iterator member;
+	shared_ptr<ITC18StimDevice> device;
+	
+	pMembers->clear();
+	boost::mutex::scoped_lock lock(deviceGroupsLock);
+	vector<weak_ptr<ITC18StimDevice> > &group = deviceGroups[options.group];
+	for (member = group.begin(); member != group.end(); ) {
+		if ((device = member->lock()) == NULL) {
+			member = group.erase(member);
+			continue;
+		}
+		pMembers->push_back(device);
+		member++;
+	}
+}
+
+// The device leading this device's group, or NULL if it is not in a group
+
+shared_ptr<ITC18StimDevice> ITC18StimDevice::groupLeader(void) {
+	
+	vector<shared_ptr<ITC18StimDevice> > members;
+	
+	if (options.group.empty()) {
+		return shared_ptr<ITC18StimDevice>();
+	}
+	groupMembers(&members);
+	return (members.empty()) ? shared_ptr<ITC18StimDevice>() : members.front();
+}
+
+// Load ITC18 with instructions based on current stimulus parameters.  Trains queued for a batch take precedence, 
+// and are loaded together.  If the arming thread has already built the train from the current parameters, all 
+// that is left is the upload.  Nothing is loaded while a train is running,
+// because the device is primed again with the latest parameters as soon as the train finishes.
+
+void ITC18StimDevice::loadInstructions(void) {
+	
+	PulseTrainData trains[ITC18_NUMBEROFDACOUTPUTS];
+	CompiledTrain armed, batchTrain;
+	list<BatchEntry> batch;
+	bool useArmed, loaded;
+	long generation;
+	MWTime startUS = Clock::instance()->getCurrentTimeUS();
+	
+	boost::mutex::scoped_lock lock(primeLock);
+	generation = parameterGeneration;
+	if (deviceState == kDevicePrimed && primedGeneration == generation) {
+		boost::mutex::scoped_lock batchLock(batchQueueLock);
+		if (batchQueue.empty()) {
+			return;											// already primed with the latest parameters
+		}
+	}
+	if (!changeDeviceState(kDeviceIdle, kDevicePriming) && !changeDeviceState(kDevicePrimed, kDevicePriming)) {
+		return;
+	}
+	{
+		boost::mutex::scoped_lock armLock(armedTrainLock);
+		useArmed = armedTrainReady && (armedGeneration == generation);
+		if (useArmed) {
+			armed = armedTrain;
+		}
+		armedTrainReady = false;
+		armedTrain.samples.reset();
+	}
+	{
+		boost::mutex::scoped_lock batchLock(batchQueueLock);
+		batch.swap(batchQueue);
+	}
+	if (!batch.empty()) {
+		loaded = makeBatchTrain(batch, &batchTrain) && uploadTrain(batchTrain);
+	}
+	else if (useArmed) {
+		loaded = uploadTrain(armed);
+	}
+	else {
+		getTrainData(trains);
+		loaded = loadInstructionsFromTrainData(trains, options.channels);
+	}
+	if (loaded) {
+		primedGeneration = (batch.empty()) ? generation : kPrimedBatch;
+	}
+	changeDeviceState(kDevicePriming, (loaded) ? kDevicePrimed : kDeviceIdle);
+	recordLatency(kLoadLatency, startUS);
+}
+
+/* 
+ Make the instruction sequence for the ITC18 and load the ITC18 so it is ready to run
+ 
  activeChannels specifies how many of the ITC18 DACs will be used to output pulse trains. pTrain is an arrany of
- PulseTrainData structures that give the parameters for each channel.  However, channels are currently forced to the
- same values for: doGate, gateBit, gatePorchMS, doPulseMarkers, pulseMarkerBit, pulseBiphasic, durationMS, 
- pulseWidthUS, and frequencyHZ.  The only values that are independent by channel are: DACChanel, amplitude, 
- fullRangeV, currentPulses, and UAPerV.  The shared entries are taken from the first PulseTrainData struct in pTrain, 
- and ignored in subsequent structs.
+ PulseTrainData structures that give the parameters for each channel.  Channels share one gate and one pulse marker 
+ bit, so doGate, gateBit, gatePorchMS, doPulseMarkers and pulseMarkerBit are taken from the first PulseTrainData 
+ struct in pTrain and ignored in subsequent structs.  All other values are independent by channel, and the pulse 
+ marker bit is set while any channel is in a pulse.  The gate spans the longest channel.
+ 
+ Trains that have been made before are taken from the train cache, so that only the upload to the ITC18 is needed.
+ When a waveform file is configured, the channels play the file instead of pulses (see makeWaveformTrain).
  */
 
 bool ITC18StimDevice::loadInstructionsFromTrainData(PulseTrainData *pTrain, long activeChannels) {
 	
-	short values[kMaxChannels + 1], gateAndPulseBits, gateBits, *sPtr, *tPtr;
-	long index, sampleSetsInTrain, sampleSetsPerPhase, sampleSetIndex, sampleSetsPerPulse, ticksPerInstruction;
-	long gatePorchUS, sampleSetsInPorch, porchBufferLength;
-	long pulseCount, durationUS, instructionsPerSampleSet, valueIndex;
-	int writeAvailable, result;
-	float sampleSetPeriodUS, instructionPeriodUS, pulsePeriodUS, rangeFraction[kMaxChannels];
-	short *trainValues, *pulseValues, *porchValues;
-	int ITCInstructions[kMaxChannels + 1];
+	CompiledTrain compiled;
+	
 	if (itc == NULL && !kDebugITC18StimDevice) { 
 		return false; 
 	}
+	if (!compileTrain(pTrain, activeChannels, &compiled)) {
+		return false;
+	}
+	return uploadTrain(compiled);
+}
+
+/*
+ Make one train from the trains of a batch.  The trains share one sample period, chosen by planTiming over all of 
+ them, and each is made as runs (see makeTrainRuns), so the batch costs host memory in proportion to its pulses 
+ and is streamed if it is longer than the FIFO.  The sample set where each train starts is kept so that readData 
+ can report the onsets.  With options.batchCodes, the number of each train in the batch (from 1, modulo 256) is 
+ also put on the digital bits above kBatchCodeShift for as long as that train's gate is open.  Those bits are left 
+ alone if the trains' gate or pulse marker bit is among them.
+ */
+
+bool ITC18StimDevice::makeBatchTrain(const list<BatchEntry> &batch, CompiledTrain *pCompiled) {
+	
+	list<BatchEntry>::const_iterator entry;
+	vector<PulseTrainData> allTrains;
+	vector<TrainRun> batchRuns;
+	vector<long> starts[kMaxChannels];
+	PulseTrainData trains[ITC18_NUMBEROFDACOUTPUTS];
+	CompiledTrain part;
+	TimingPlan plan;
+	TrainRun gap;
+	long numChannels, instructionsPerSampleSet, index, run, firstSet, code, codeBits, channel, pulse, firstPulse;
+	float sampleSetPeriodUS;
+	
+	if (!options.waveformFile.empty()) {
+		mwarning(M_IODEVICE_MESSAGE_DOMAIN, "ITC18StimDevice: trains cannot be batched with a waveform file");
+		return false;
+	}
+	numChannels = min(options.channels, (long)ITC18_NUMBEROFDACOUTPUTS);
+	instructionsPerSampleSet = numChannels + 1;
+	for (entry = batch.begin(); entry != batch.end(); entry++) {
+		allTrains.insert(allTrains.end(), entry->trains, entry->trains + numChannels);
+	}
+	if (!planTiming(&allTrains[0], numChannels, &plan, batch.size())) {
+		return false;
+	}
+	sampleSetPeriodUS = plan.ticksPerInstruction * kITC18TickTimeUS * instructionsPerSampleSet;
+	codeBits = (options.batchCodes) ? kBatchCodeMask << kBatchCodeShift : 0;
+	for (entry = batch.begin(); entry != batch.end() && codeBits != 0; entry++) {
+		if (((entry->trains[0].doGate) ? (0x1 << entry->trains[0].gateBit) & codeBits : 0) != 0 ||
+				((entry->trains[0].doPulseMarkers) ? (0x1 << entry->trains[0].pulseMarkerBit) & codeBits : 0) != 0) {
+			mwarning(M_IODEVICE_MESSAGE_DOMAIN, "ITC18StimDevice: gate or pulse marker bit is used for batch codes, "
+					 "batch played without codes");
+			codeBits = 0;
+		}
+	}
+	memset(&gap, 0, sizeof(gap));
+	boost::shared_array<long> startSets(new long[batch.size()]);
+	for (index = 0, firstSet = 0, entry = batch.begin(); entry != batch.end(); index++, entry++) {
+		memcpy(trains, entry->trains, sizeof(trains));
+		if (!makeTrainSamples(trains, numChannels, &part, &plan)) {
+			return false;
+		}
+		startSets[index] = firstSet;
+		code = (((index + 1) & kBatchCodeMask) << kBatchCodeShift) & codeBits;
+		for (run = 0; run < part.numRuns; run++) {					// the last run is the set that closes the gate
+			batchRuns.push_back(part.runs[run]);
+			batchRuns.back().firstSet += firstSet;
+			if (run < part.numRuns - 1) {
+				batchRuns.back().values[numChannels] |= code;
+			}
+		}
+		for (channel = 0, firstPulse = 0; channel < numChannels; firstPulse += part.pulseCounts[channel++]) {
+			for (pulse = firstPulse; pulse < firstPulse + part.pulseCounts[channel]; pulse++) {
+				starts[channel].push_back(firstSet + part.pulseSets[pulse]);
+			}
+		}
+		firstSet += part.bufferLengthSamples / instructionsPerSampleSet;
+		if (index + 1 < (long)batch.size() && entry->intervalMS > 0) {
+			gap.firstSet = firstSet;
+			batchRuns.push_back(gap);
+			firstSet += (long)(entry->intervalMS * 1000.0 / sampleSetPeriodUS);
+		}
+	}
+	pCompiled->key = 0;
+	memcpy(pCompiled->trains, batch.front().trains, sizeof(pCompiled->trains));
+	pCompiled->activeChannels = numChannels;
+	pCompiled->FIFOSize = FIFOSize;
+	pCompiled->samples.reset();
+	pCompiled->sampleCapacity = 0;
+	pCompiled->runs = boost::shared_array<TrainRun>(new TrainRun[batchRuns.size()]);
+	memcpy(pCompiled->runs.get(), &batchRuns[0], batchRuns.size() * sizeof(TrainRun));
+	pCompiled->numRuns = batchRuns.size();
+	pCompiled->bufferLengthSamples = firstSet * instructionsPerSampleSet;
+	pCompiled->bufferLengthSets = firstSet;
+	pCompiled->channels = numChannels;
+	pCompiled->ticksPerInstruction = plan.ticksPerInstruction;
+	pCompiled->achievedWidthUS = plan.achievedWidthUS;
+	pCompiled->achievedFrequencyHZ = plan.achievedFrequencyHZ;
+	pCompiled->waveform = false;
+	pCompiled->batchStartSets = startSets;
+	pCompiled->batchTrains = batch.size();
+	setPulseStarts(pCompiled, starts, 0);
+	return true;
+}
+
+// Synthesize the instructions for a pulse train, along with its sample period and buffer lengths.  This touches no 
+// device state other than reading FIFOSize and options, so it can run on the arming thread while a train plays.
+// A train that is part of a batch takes the sample period of the batch, and is always made as runs so that it can
+// be joined to the others (see makeBatchTrain).
+
+bool ITC18StimDevice::makeTrainSamples(PulseTrainData *pTrain, long activeChannels, CompiledTrain *pCompiled, 
+									   const TimingPlan *pBatchPlan) {
 	
-	samplesReady = false;										// flag no samples are ready
+	short values[kMaxChannels + 1], pulseSet[kMaxChannels + 1], gateAndPulseBits, gateBits;
+	long index, sampleSetsInTrain, sampleSetsPerPhase, sampleSetIndex, sampleSetsPerPulse;
+	long gatePorchUS, sampleSetsInPorch, porchBufferLength, pulseLength, capacity;
+	long pulseCount, durationUS, instructionsPerSampleSet, valueIndex;
+	long numChannels, instructionTicks, lengthSamples, lengthSets;
+	TimingPlan plan;
+	TrainLayout layout;
+	float sampleSetPeriodUS, instructionPeriodUS, pulsePeriodUS, rangeFraction[kMaxChannels];
+	short *pSamples, *trainValues, *pulseValues = NULL;
+	boost::shared_array<short> samples;
+	vector<long> starts[kMaxChannels];
+	bool sharedTiming;
 	
-	// We take common values from the first entry, on the assumption that others have been checked and are the same
+	// We take the gate and pulse marker values from the first entry.  The train lasts as long as the longest channel.
 	
-	channels = min(activeChannels, ITC18_NUMBEROFDACOUTPUTS);
-	instructionsPerSampleSet = channels + 1;			// one per DAC, plus one for digital out
+	numChannels = min(activeChannels, ITC18_NUMBEROFDACOUTPUTS);
+	instructionsPerSampleSet = numChannels + 1;			// one per DAC, plus one for digital out
 	gatePorchUS = (pTrain->doGate) ? pTrain->gatePorchMS * 1000.0 : 0;
-	durationUS = pTrain->durationMS * 1000.0;
+	durationUS = 0;
+	sharedTiming = true;
+	for (index = 0; index < numChannels; index++) {
+		durationUS = max(durationUS, (long)(pTrain[index].durationMS * 1000.0));
+		sharedTiming = sharedTiming && pTrain[index].durationMS == pTrain->durationMS && 
+				pTrain[index].frequencyHZ == pTrain->frequencyHZ && pTrain[index].pulseWidthUS == pTrain->pulseWidthUS &&
+				pTrain[index].pulseBiphasic == pTrain->pulseBiphasic;
+		rangeFraction[index] = trainRangeFraction(&pTrain[index]);
+	}
 	
-	// First determine the DASample period.  The instructions specify the entire stimulus train, plus the front and
-	// back porches for the gate.  We require the entire stimulus instruction to fit within the ITC-18 FIFO.
-	// Starting with the fastest tick rate, we divide down to allow for enough DA (channels) and Digital (1) 
-	// samples, and a factor of safety (2x)
+	// First determine the DASample period (see planTiming).
 	
-    
-	ticksPerInstruction = ITC18_MINIMUM_TICKS;
-	while ((durationUS + 2 * gatePorchUS) / (kITC18TickTimeUS * ticksPerInstruction) > 
-		   FIFOSize / (instructionsPerSampleSet * 2)) {
-		ticksPerInstruction++;
+	if (pBatchPlan != NULL) {
+		plan = *pBatchPlan;
 	}
-	if (ticksPerInstruction > ITC18_MAXIMUM_TICKS) {
+	else if (!planTiming(pTrain, numChannels, &plan)) {
 		return false;
 	}
+	instructionTicks = plan.ticksPerInstruction;
 	
 	// Precompute values.  Every portion of the stimulus has an integer number of sample sets.
 	
-	instructionPeriodUS = ticksPerInstruction * kITC18TickTimeUS;
+	instructionPeriodUS = instructionTicks * kITC18TickTimeUS;
 	sampleSetPeriodUS = instructionPeriodUS * instructionsPerSampleSet;
 	sampleSetsPerPhase = round(pTrain->pulseWidthUS / sampleSetPeriodUS);
 	sampleSetsPerPulse = sampleSetsPerPhase * ((pTrain->pulseBiphasic) ? 2 : 1);
 	sampleSetsInPorch = gatePorchUS / sampleSetPeriodUS;		// DA samples in each gate porch
 	sampleSetsInTrain = durationUS / sampleSetPeriodUS;		// DA samples in train
-	bufferLengthSets = sampleSetsInTrain + 2 * sampleSetsInPorch;
+	lengthSets = sampleSetsInTrain + 2 * sampleSetsInPorch;
 	pulsePeriodUS = ((pTrain->frequencyHZ > 0) ? 1.0 / pTrain->frequencyHZ * 1000000.0 : 0);
 	gateBits = ((pTrain->doGate) ? (0x1 << pTrain->gateBit) : 0);
 	gateAndPulseBits = gateBits | ((pTrain->doPulseMarkers) ? (0x1 << pTrain->pulseMarkerBit) : 0);
 	
+	// Everything goes in one buffer from the train arena: the front porch, the train and the back porch, followed
+	// by room for a pulse template.  Every sample set outside the pulses holds the gate bits (if any), so the whole
+	// buffer starts as a tile of that set.  lengthSamples is always at least as long as instructionsPerSampleSet, 
+	// and a train with no sample sets gets one empty set.
+	
+	lengthSamples = max(sampleSetsInTrain * instructionsPerSampleSet, instructionsPerSampleSet);
+	porchBufferLength = sampleSetsInPorch * instructionsPerSampleSet;
+	sharedTiming = sharedTiming && sampleSetsPerPulse > 0;
+	pulseLength = (sharedTiming) ? sampleSetsPerPulse * instructionsPerSampleSet : 0;
+	pCompiled->key = hashTrainData(pTrain, activeChannels, FIFOSize);
+	memcpy(pCompiled->trains, pTrain, numChannels * sizeof(PulseTrainData));
+	pCompiled->activeChannels = activeChannels;
+	pCompiled->FIFOSize = FIFOSize;
+	pCompiled->waveform = false;
+	pCompiled->bufferLengthSamples = lengthSamples + 2 * porchBufferLength;
+	pCompiled->bufferLengthSets = lengthSets;
+	pCompiled->channels = numChannels;
+	pCompiled->ticksPerInstruction = instructionTicks;
+	pCompiled->achievedWidthUS = plan.achievedWidthUS;
+	pCompiled->achievedFrequencyHZ = plan.achievedFrequencyHZ;
+	pCompiled->batchStartSets.reset();
+	pCompiled->batchTrains = 0;
+	
+	// A train too long for the FIFO has to be streamed anyway, so rather than holding every sample it is kept as 
+	// runs of identical sample sets that are expanded as they are written to the FIFO (see makeTrainRuns).
+	
+	if (pCompiled->bufferLengthSamples > FIFOSize || pBatchPlan != NULL) {
+		layout.channels = numChannels;
+		layout.instructionsPerSampleSet = instructionsPerSampleSet;
+		layout.porchSets = sampleSetsInPorch;
+		layout.trainSets = sampleSetsInTrain;
+		layout.setsPerPhase = sampleSetsPerPhase;
+		layout.setsPerPulse = sampleSetsPerPulse;
+		layout.pulsePeriodUS = pulsePeriodUS;
+		layout.sampleSetPeriodUS = sampleSetPeriodUS;
+		layout.gateBits = gateBits;
+		layout.gateAndPulseBits = gateAndPulseBits;
+		layout.sharedTiming = sharedTiming;
+		memcpy(layout.rangeFraction, rangeFraction, numChannels * sizeof(float));
+		return makeTrainRuns(pTrain, &layout, pCompiled);
+	}
+	if ((samples = allocateSamples(2 * porchBufferLength + lengthSamples + pulseLength, &capacity)) == NULL) {
+		return false;
+	}
+	pSamples = samples.get();
+	trainValues = pSamples + porchBufferLength;
+	for (index = 0; index < numChannels; index++) {		// one sample set with the gate bits (if any)
+		values[index] = 0;
+	}
+	values[index] = gateBits;
+	tileShortsInRange(pSamples, values, 0, instructionsPerSampleSet, 2 * sampleSetsInPorch + sampleSetsInTrain);
+	if (sampleSetsInTrain == 0) {
+		memset(trainValues, 0, lengthSamples * sizeof(short));
+		tileShortsInRange(trainValues, values, lengthSamples, instructionsPerSampleSet, sampleSetsInPorch);
+	}
+	
+	// Add the pulses to the train instructions.  When every channel has the same pulse timing, we make one pulse 
+	// (DA and digital) and copy it into place, otherwise each channel's pulses are written separately.  If the 
+	// stimulation frequency is zero, or the train duration is less than one pulse, or the pulse width is zero, do 
+	// nothing.
+	
 	// Create and load an array with instructions that make up one pulse (DA and digital)
 	
-	if (sampleSetsPerPulse > 0) {
-		for (index = 0; index < channels; index++) {
-			rangeFraction[index] = (pTrain[index].amplitude / pTrain[index].fullRangeV) /
-			((pTrain[index].currentPulses) ? pTrain[index].UAPerV : 1000);
-		}
-		assert(pulseValues = (short *)calloc(sampleSetsPerPulse * instructionsPerSampleSet, sizeof(short)));
-		for (index = 0; index < channels; index++) {			// create first phase instruction set
-			values[index] = rangeFraction[index] * 0x7fff;		//	force fractions positive for first phase
-		}
-		values[index] = gateAndPulseBits;						//	digital output word
-		for (sampleSetIndex = 0; sampleSetIndex < sampleSetsPerPhase; sampleSetIndex++) {	// load first phase
-			replaceShortsInRange(pulseValues, values, sampleSetIndex * instructionsPerSampleSet, 
-								 instructionsPerSampleSet);
+	if (sharedTiming) {
+		pulseValues = trainValues + lengthSamples + porchBufferLength;
+		for (index = 0; index < numChannels; index++) {			// create first phase instruction set
+			pulseSet[index] = rangeFraction[index] * 0x7fff;		//	force fractions positive for first phase
 		}
+		pulseSet[index] = gateAndPulseBits;						//	digital output word
+		tileShortsInRange(pulseValues, pulseSet, 0, instructionsPerSampleSet, sampleSetsPerPhase);	// load first phase
 		if (pTrain->pulseBiphasic) {							// do second phase for biphasic pulses
-			for (index = 0; index < channels; index++) {
-				values[index] = -rangeFraction[index] * 0x7fff;		// invert amplitude
-			}
-			values[index] = gateAndPulseBits;						// digital output word
-			for (sampleSetIndex = 0; sampleSetIndex < sampleSetsPerPhase; sampleSetIndex++) {
-				replaceShortsInRange(pulseValues, values, 
-									 (sampleSetsPerPhase + sampleSetIndex) * instructionsPerSampleSet, 
-									 instructionsPerSampleSet);
+			for (index = 0; index < numChannels; index++) {
+				pulseSet[index] = -rangeFraction[index] * 0x7fff;		// invert amplitude
 			}
+			pulseSet[index] = gateAndPulseBits;						// digital output word
+			tileShortsInRange(pulseValues, pulseSet, sampleSetsPerPhase * instructionsPerSampleSet, 
+							  instructionsPerSampleSet, sampleSetsPerPhase);
 		}
 	}
 	/*
@@ -354,109 +1616,244 @@ bool ITC18StimDevice::loadInstructionsFromTrainData(PulseTrainData *pTrain, long
 	 mprintf("%4hx", pulseValues[index]);
 	 }
 	 */	
-	// Create an array with the entire output sequence.  If there is a gating signal,
-	// we add that to the digital output values.  bufferLengthSamples is always at least 
-	// as long as instructionsPerSampleSet.
-	
-	bufferLengthSamples = max(sampleSetsInTrain * instructionsPerSampleSet, instructionsPerSampleSet);
-	assert(trainValues = (short *)calloc(bufferLengthSamples, sizeof(short)));
-	if (gateBits > 0) {									// load digital output commands for the gate (if any)
-		for (sPtr = trainValues, index = 0; index < sampleSetsInTrain; index++) {
-			sPtr += channels;							// skip over analog values
-			*(sPtr)++ = gateBits;						// set the gate bits
-		}
-	}
-	
-	// Add the pulses to the train instructions.  If the stimulation frequency is zero, or the train duration
-	// is less than one pulse, or the pulse width is zero, do nothing.
-	
-	if ((pulsePeriodUS > 0) && (sampleSetsPerPhase > 0)) {
+	if (sharedTiming && (pulsePeriodUS > 0) && (sampleSetsPerPhase > 0)) {
 		for (pulseCount = 0; ; pulseCount++) {
 			sampleSetIndex = pulseCount * pulsePeriodUS / sampleSetPeriodUS;	// find offset in instructions
 			valueIndex = sampleSetIndex * instructionsPerSampleSet;
-			if ((valueIndex + sampleSetsPerPulse * ((pTrain->pulseBiphasic) ? 2 : 1) + 1) >= bufferLengthSamples) {
+			if ((valueIndex + sampleSetsPerPulse * ((pTrain->pulseBiphasic) ? 2 : 1) + 1) >= lengthSamples) {
 				break;										// no room for another pulse
 			}
-			replaceShortsInRange(trainValues, pulseValues, valueIndex,  sampleSetsPerPulse * instructionsPerSampleSet);
+			replaceShortsInRange(trainValues, pulseValues, valueIndex,		// clip a final pulse to the train
+								 min(sampleSetsPerPulse * instructionsPerSampleSet, lengthSamples - valueIndex));
+			for (index = 0; index < numChannels; index++) {
+				starts[index].push_back(sampleSetIndex);
+			}
 		}
 	}
+	if (!sharedTiming) {
+		for (index = 0; index < numChannels; index++) {
+			addChannelPulses(trainValues, &pTrain[index], index, instructionsPerSampleSet, sampleSetPeriodUS, 
+							 rangeFraction[index], gateAndPulseBits & ~gateBits, &starts[index]);
+		}
+	}
+	setPulseStarts(pCompiled, starts, sampleSetsInPorch);
+	
+	// Change the last digital output word in the back gate porch to close gate (in case it's open)
+	
+	pSamples[pCompiled->bufferLengthSamples - 1] = 0x00;
+	pCompiled->samples = samples;
+	pCompiled->sampleCapacity = capacity;
+	pCompiled->runs.reset();
+	pCompiled->numRuns = 0;
+	return true;
+}
+
+/*
+ Make a train as runs of identical sample sets rather than as samples.  Between the starts and ends of pulse phases 
+ on any channel, every sample set is the same, so a train needs only a few runs for each pulse, however long it 
+ lasts.  The pulses follow the same rules as in makeTrainSamples (shared timing) and addChannelPulses, with a later 
+ pulse on a channel replacing any part of an earlier one that it overlaps.  The runs are expanded into samples by 
+ expandRuns as the train is written to the FIFO.
+ */
+
+bool ITC18StimDevice::makeTrainRuns(PulseTrainData *pTrain, const TrainLayout *pLayout, CompiledTrain *pCompiled) {
+	
+	vector<long> starts[kMaxChannels], boundaries;
+	vector<long>::iterator pStart;
+	long channel, pulseCount, sampleSetIndex, sampleSetsInTrain, offset, boundary, trainSets, totalSets, numRuns;
+	long setsPerPhase[kMaxChannels], setsPerPulse[kMaxChannels];
+	long numChannels = pLayout->channels, instructionsPerSampleSet = pLayout->instructionsPerSampleSet;
+	short phaseValues[kMaxChannels][2], values[kMaxChannels + 1];
+	float pulsePeriodUS;
+	TrainRun *pRuns;
 	
-	free(pulseValues);
+	trainSets = max(pLayout->trainSets, 1L);				// a train with no sample sets gets one empty set
 	
-	// If there the gate has a front and back porch, add the porches to the instructions.  Make a buffer that is big
-	// enough for the stimulus train and the front and back porches, make the front porch, then copy the stimulus 
-	// train, then copy the front porch to the back porch.
+	// Find the sample set at which each pulse starts on each channel, and the sample sets at which anything changes
 	
-	if (sampleSetsInPorch > 0) {
-		porchBufferLength = sampleSetsInPorch * instructionsPerSampleSet;
-		assert(porchValues = (short *)calloc((2 * porchBufferLength + bufferLengthSamples), sizeof(short)));
-		sPtr = porchValues;
-		for (index = 0; index < sampleSetsInPorch; index++) {
-			sPtr += channels;							// skip over analog values
-			*(sPtr)++ = gateBits;						// set the gate bits
+	for (channel = 0; channel < numChannels; channel++) {
+		phaseValues[channel][0] = pLayout->rangeFraction[channel] * 0x7fff;
+		phaseValues[channel][1] = -pLayout->rangeFraction[channel] * 0x7fff;
+		if (pLayout->sharedTiming) {
+			setsPerPhase[channel] = pLayout->setsPerPhase;
+			setsPerPulse[channel] = pLayout->setsPerPulse;
+			if (channel > 0) {
+				starts[channel] = starts[0];
+				continue;
+			}
+			if ((pLayout->pulsePeriodUS <= 0) || (pLayout->setsPerPhase <= 0)) {
+				continue;
+			}
+			for (pulseCount = 0; ; pulseCount++) {
+				sampleSetIndex = pulseCount * pLayout->pulsePeriodUS / pLayout->sampleSetPeriodUS;
+				if ((sampleSetIndex * instructionsPerSampleSet + pLayout->setsPerPulse * 
+							((pTrain->pulseBiphasic) ? 2 : 1) + 1) >= trainSets * instructionsPerSampleSet) {
+					break;
+				}
+				starts[channel].push_back(sampleSetIndex);
+			}
 		}
-		for (tPtr = trainValues, index = 0; index < bufferLengthSamples; index++) {
-			*sPtr++ = *tPtr++;
+		else {
+			setsPerPhase[channel] = round(pTrain[channel].pulseWidthUS / pLayout->sampleSetPeriodUS);
+			setsPerPulse[channel] = setsPerPhase[channel] * ((pTrain[channel].pulseBiphasic) ? 2 : 1);
+			sampleSetsInTrain = pTrain[channel].durationMS * 1000.0 / pLayout->sampleSetPeriodUS;
+			pulsePeriodUS = ((pTrain[channel].frequencyHZ > 0) ? 1.0 / pTrain[channel].frequencyHZ * 1000000.0 : 0);
+			if ((pulsePeriodUS <= 0) || (setsPerPhase[channel] <= 0)) {
+				continue;
+			}
+			for (pulseCount = 0; ; pulseCount++) {
+				sampleSetIndex = pulseCount * pulsePeriodUS / pLayout->sampleSetPeriodUS;
+				if (sampleSetIndex + setsPerPulse[channel] > sampleSetsInTrain) {
+					break;
+				}
+				starts[channel].push_back(sampleSetIndex);
+			}
 		}
-		for (tPtr = porchValues, index = 0; index < porchBufferLength; index++) {
-			*sPtr++ = *tPtr++;
+		for (pStart = starts[channel].begin(); pStart != starts[channel].end(); pStart++) {
+			boundaries.push_back(*pStart);
+			boundaries.push_back(*pStart + setsPerPhase[channel]);
+			boundaries.push_back(*pStart + setsPerPulse[channel]);
 		}
-		free(trainValues);								// release unneeded data
-		trainValues = porchValues;						// make trainValues point to the whole set
-		bufferLengthSamples += 2 * porchBufferLength;		// tally the buffer length with both porches
 	}
+	boundaries.push_back(0);
+	sort(boundaries.begin(), boundaries.end());
+	boundaries.erase(unique(boundaries.begin(), boundaries.end()), boundaries.end());
 	
-	// Change the last digital output word in the back gate porch to close gate (in case it's open)
-	
-	trainValues[bufferLengthSamples - 1] = 0x00;
-	
-	// Set up the ITC for the stimulus train.  Do everything except the start
+	// Make one run for the front porch, one for each stretch between boundaries that differs from the one before, 
+	// one for the back porch, and one for the last sample set, which closes the gate.
 	
-	for (index = 0; index < channels; index++) {
-		ITCInstructions[index] = DAInstructions[pTrain[index].DAChannel] | ITC18_OUTPUT_UPDATE;
-		//		ADInstructions[pTrain[index].DAChannel] | DAInstructions[pTrain[index].DAChannel] | 
-		//		ITC18_INPUT_UPDATE | ITC18_OUTPUT_UPDATE;
-	} 
-	ITCInstructions[index] = ITC18_OUTPUT_DIGITAL1 | ITC18_INPUT_SKIP | ITC18_OUTPUT_UPDATE;
-	if (itc != NULL) {									// don't access ITC if we're debugging
-		boost::mutex::scoped_lock lock(ITC18DeviceLock);
-		ITC18_SetSequence(itc, channels + 1, ITCInstructions); 
-		ITC18_StopAndInitialize(itc, true, true);
-		ITC18_GetFIFOWriteAvailable(itc, &writeAvailable);
-		if (writeAvailable < sampleSetsInTrain) {
-			merror(M_IODEVICE_MESSAGE_DOMAIN, "LLITC18PulseTrainDevice: ITC18 write buffer was full.");
-			free(trainValues);
-			return false;
+	pRuns = new TrainRun[boundaries.size() + 3];
+	numRuns = 0;
+	for (channel = 0; channel < numChannels; channel++) {
+		values[channel] = 0;
+	}
+	values[numChannels] = pLayout->gateBits;
+	if (pLayout->porchSets > 0) {
+		pRuns[numRuns].firstSet = 0;
+		memcpy(pRuns[numRuns++].values, values, sizeof(values));
+	}
+	for (size_t index = 0; index < boundaries.size() && boundaries[index] < trainSets; index++) {
+		boundary = boundaries[index];
+		values[numChannels] = (pLayout->trainSets > 0) ? pLayout->gateBits : 0;
+		for (channel = 0; channel < numChannels; channel++) {
+			values[channel] = 0;
+			pStart = upper_bound(starts[channel].begin(), starts[channel].end(), boundary);
+			if (pStart == starts[channel].begin()) {
+				continue;
+			}
+			offset = boundary - *(pStart - 1);
+			if (offset < setsPerPulse[channel]) {
+				values[channel] = phaseValues[channel][(offset < setsPerPhase[channel]) ? 0 : 1];
+				values[numChannels] |= pLayout->gateAndPulseBits;
+			}
 		}
-		result = ITC18_WriteFIFO(itc, bufferLengthSamples, trainValues);
-		if (result != noErr) { 
-			mprintf("Error ITC18_WriteFIFO, result: %d", result);
-			free(trainValues);
-			return false;
+		if (numRuns == 0 || memcmp(pRuns[numRuns - 1].values, values, sizeof(values)) != 0) {
+			pRuns[numRuns].firstSet = pLayout->porchSets + boundary;
+			memcpy(pRuns[numRuns++].values, values, sizeof(values));
 		}
-		ITC18_SetSamplingInterval(itc, ticksPerInstruction, false);
-	}	
-	/*	
-	 for (index = 49000; index < bufferLengthSamples - 8; index += 8) {
-	 mprintf("%4hx %4hx %4hx %4hx %4hx %4hx %4hx %4hx", 
-	 trainValues[index + 0], trainValues[index + 1], trainValues[index + 2], trainValues[index + 3], 
-	 trainValues[index + 4], trainValues[index + 5], trainValues[index + 6], trainValues[index + 7]);
-	 }
-	 for ( ; index < bufferLengthSamples; index++) {
-	 mprintf("%4hx %4hx %4hx %4hx %4hx %4hx %4hx %4hx", trainValues[index]);
-	 }
-	 */
-	free(trainValues);
-	primed = true;
+	}
+	for (channel = 0; channel < numChannels; channel++) {
+		values[channel] = 0;
+	}
+	values[numChannels] = pLayout->gateBits;
+	if (pLayout->porchSets > 0 && memcmp(pRuns[numRuns - 1].values, values, sizeof(values)) != 0) {
+		pRuns[numRuns].firstSet = pLayout->porchSets + trainSets;
+		memcpy(pRuns[numRuns++].values, values, sizeof(values));
+	}
+	totalSets = trainSets + 2 * pLayout->porchSets;
+	if (pRuns[numRuns - 1].firstSet < totalSets - 1) {
+		pRuns[numRuns] = pRuns[numRuns - 1];
+		pRuns[numRuns++].firstSet = totalSets - 1;
+	}
+	pRuns[numRuns - 1].values[numChannels] = 0x00;
+	pCompiled->runs = boost::shared_array<TrainRun>(pRuns);
+	pCompiled->numRuns = numRuns;
+	pCompiled->samples.reset();
+	pCompiled->sampleCapacity = 0;
+	setPulseStarts(pCompiled, starts, pLayout->porchSets);
+	return true;
+}
+
+/*
+ Set up a train that plays the waveform file instead of pulses.  The file holds native-endian int16 frames, one 
+ sample per channel, with channel i going to DAC options.waveformDAChannels[i].  A full-scale sample (0x7fff) plays 
+ at the channel's pulse amplitude, scaled through fullRangeV and UAPerV in the same way as pulses.  Frames play at 
+ options.waveformRateHz, between the usual gate porches.
+ 
+ The file is memory mapped when the device is initialized, and samples are only expanded as they are written to 
+ the FIFO (expandWaveform), so the cost of a prime does not depend on the size of the file.
+ */
+
+bool ITC18StimDevice::makeWaveformTrain(PulseTrainData *pTrain, long activeChannels, CompiledTrain *pCompiled) {
+	
+	vector<long> starts[kMaxChannels];
+	long index, numChannels, instructionTicks;
+	float sampleSetPeriodUS, rateError;
+	
+	if (waveformData == NULL) {
+		return false;
+	}
+	numChannels = min(activeChannels, ITC18_NUMBEROFDACOUTPUTS);
+	instructionTicks = round(1000000.0 / (options.waveformRateHz * kITC18TickTimeUS * (numChannels + 1)));
+	if (instructionTicks < ITC18_MINIMUM_TICKS || instructionTicks > ITC18_MAXIMUM_TICKS) {
+		merror(M_IODEVICE_MESSAGE_DOMAIN, "ITC18StimDevice: waveform rate of %.0f Hz cannot be played on %ld channels",
+			   options.waveformRateHz, numChannels);
+		return false;
+	}
+	sampleSetPeriodUS = instructionTicks * kITC18TickTimeUS * (numChannels + 1);
+	rateError = fabs(1000000.0 / sampleSetPeriodUS - options.waveformRateHz) / options.waveformRateHz;
+	if (rateError > kDriftFractionLimit) {
+		mwarning(M_IODEVICE_MESSAGE_DOMAIN, "ITC18StimDevice: waveform will play at %.1f Hz rather than %.1f Hz", 
+				 1000000.0 / sampleSetPeriodUS, options.waveformRateHz);
+	}
+	for (index = 0; index < numChannels; index++) {
+		pCompiled->waveformScale[index] = trainRangeFraction(&pTrain[index]);
+	}
+	pCompiled->key = hashTrainData(pTrain, numChannels, FIFOSize);
+	memcpy(pCompiled->trains, pTrain, numChannels * sizeof(PulseTrainData));
+	pCompiled->activeChannels = activeChannels;
+	pCompiled->FIFOSize = FIFOSize;
+	pCompiled->samples.reset();
+	pCompiled->sampleCapacity = 0;
+	pCompiled->runs.reset();
+	pCompiled->numRuns = 0;
+	pCompiled->batchStartSets.reset();
+	pCompiled->batchTrains = 0;
+	pCompiled->waveform = true;
+	pCompiled->porchSets = (pTrain->doGate) ? pTrain->gatePorchMS * 1000.0 / sampleSetPeriodUS : 0;
+	pCompiled->gateBits = ((pTrain->doGate) ? (0x1 << pTrain->gateBit) : 0);
+	pCompiled->markerBits = ((pTrain->doPulseMarkers) ? (0x1 << pTrain->pulseMarkerBit) : 0);
+	pCompiled->bufferLengthSets = waveformFrames + 2 * pCompiled->porchSets;
+	pCompiled->bufferLengthSamples = pCompiled->bufferLengthSets * (numChannels + 1);
+	pCompiled->channels = numChannels;
+	pCompiled->ticksPerInstruction = instructionTicks;
+	pCompiled->achievedWidthUS = 0;
+	pCompiled->achievedFrequencyHZ = 0;
+	setPulseStarts(pCompiled, starts, 0);						// no pulses
 	return true;
 }
+	
+
+// Every parameter change moves the parameter generation on, so that trains built from older values are known to be
+// stale, and makes sure a re-prime is scheduled (see reprime).  A burst of changes schedules just one.
 
 void ITC18StimDevice::markParametersDirty(void) {
 	
-	parametersDirty = true;
+	{
+		boost::mutex::scoped_lock lock(deviceStateLock);
+		parameterGeneration++;
+	}
+	boost::mutex::scoped_lock lock(reprimeNodeLock);
+	lastParameterChangeUS = Clock::instance()->getCurrentTimeUS();
+	if (!reprimePending) {
+		reprimePending = true;
+		scheduleReprime(kReprimeQuietUS);
+	}
 }
 
-// Open and initialize the ITC18 -- success is indicated by a non-NULL value in itc.
+// Open and initialize the ITC18 -- success is indicated by a non-NULL value in itc.  With the simulate option, the 
+// software ITC18 in ITC18Simulator.cpp is opened instead, and it always succeeds.  The deviceIndex option picks
+// which ITC18 is opened when there is more than one.
 //  (PCI):  ITC18_Open(itc, 0)
 //  (USB):  ITC18_Open(itc, 0x10000)
 //			ITC18_Open(itc, 0x10001) for second device
@@ -469,103 +1866,826 @@ void ITC18StimDevice::openITC18(void) {
 	if (itc != NULL) {				// If open, close and re-open
 		pLocal = itc;				// save pointer to reuse memory for ITC structure
 		itc = NULL;
-		ITC18_Close(pLocal);		// direct call to ITC driver
+		pITC18->Close(pLocal);		// direct call to ITC driver
 	}
 	else {
-		pLocal = new char[ITC18_GetStructureSize()];
+		pLocal = new char[pITC18->GetStructureSize()];
 	}
 	// Now the ITC is closed, and we have a valid sized pointer  
 	
 	usingUSB = false;
-	if (ITC18_Open(pLocal, 0) != noErr) {	// try with PCI first, then USB
+	if (pITC18->Open(pLocal, options.deviceIndex) != noErr) {	// try with PCI first, then USB
 		usingUSB = true;
-		if (ITC18_Open(pLocal, 0x10000) != noErr) {     // try USB
-			mwarning(M_IODEVICE_MESSAGE_DOMAIN, "ITC18StimDevice::openITC18: Failed to open ITC18 using PCI or USB"); 
-			ITC18_Close(pLocal);
+		if (pITC18->Open(pLocal, 0x10000 + options.deviceIndex) != noErr) {     // try USB
+			mwarning(M_IODEVICE_MESSAGE_DOMAIN, 
+					 "ITC18StimDevice::openITC18: Failed to open ITC18 %ld using PCI or USB", options.deviceIndex); 
+			pITC18->Close(pLocal);
 			if (kDebugITC18StimDevice) {
 				FIFOSize = 0x1 << 20;								// set for debugging
 			}
 			return;
 		}
 	}
-	if (ITC18_Initialize(pLocal, ITC18_STANDARD) != noErr) {
+	if (pITC18->Initialize(pLocal, ITC18_STANDARD) != noErr) {
 		merror(M_IODEVICE_MESSAGE_DOMAIN, "ITC18StimDevice::openITC18: Failed to initialize ITC18"); 
-		ITC18_Close(pLocal);
+		pITC18->Close(pLocal);
 		return;
 	}
-	ITC18_SetDigitalInputMode(pLocal, true, false);				// latch and do not invert
-	ITC18_SetExternalTriggerMode(pLocal, false, false);			// no external trigger
-	FIFOSize = ITC18_GetFIFOSize(pLocal);
+	pITC18->SetDigitalInputMode(pLocal, true, false);				// latch and do not invert
+	pITC18->SetExternalTriggerMode(pLocal, options.externalTrigger, false);	// trigger on a transition, if used
+	FIFOSize = pITC18->GetFIFOSize(pLocal);
 	itc = pLocal;
 }
 
-// Collect AD values from the ITC18 as they become ready.  This method is schedule to occur periodically by 
-// startDeviceIO.
-
-// For now we have not included reading of AD samples.  This could be added in the future if MWorks is up to it.
+// Memory map the waveform file, if there is one.  This is done once, when the device is initialized.
 
-bool ITC18StimDevice::readData(void) {
-	
+bool ITC18StimDevice::openWaveform(void) {
 	
-	if (itc == NULL || !running->getValue()) {
-		return false;
-	}
-	
-	// When a sequence is started, the first three entries in the FIFO are garbage.  They should be thrown out.  
+	int fileDescriptor;
+	struct stat fileStatus;
+	void *pMap;
 	
-	if (getAvailable() > kGarbageLength + bufferLengthSamples + 1) {
-		stopDeviceIO();
+	if (options.waveformFile.empty()) {
 		return true;
 	}
-	else {
-//		mprintf("bufferLengthSamples %d; available %d", bufferLengthSamples, getAvailable());
+	fileDescriptor = open(options.waveformFile.c_str(), O_RDONLY);
+	if (fileDescriptor < 0) {
+		merror(M_IODEVICE_MESSAGE_DOMAIN, "ITC18StimDevice::openWaveform: cannot open %s", 
+			   options.waveformFile.c_str());
+		return false;
+	}
+	if (fstat(fileDescriptor, &fileStatus) != 0 || fileStatus.st_size < (off_t)(options.channels * sizeof(short))) {
+		merror(M_IODEVICE_MESSAGE_DOMAIN, "ITC18StimDevice::openWaveform: %s holds no samples", 
+			   options.waveformFile.c_str());
+		close(fileDescriptor);
+		return false;
+	}
+	pMap = mmap(NULL, fileStatus.st_size, PROT_READ, MAP_SHARED, fileDescriptor, 0);
+	close(fileDescriptor);
+	if (pMap == MAP_FAILED) {
+		merror(M_IODEVICE_MESSAGE_DOMAIN, "ITC18StimDevice::openWaveform: cannot map %s", 
+			   options.waveformFile.c_str());
 		return false;
 	}
+	madvise(pMap, fileStatus.st_size, MADV_SEQUENTIAL);
+	waveformData = (const short *)pMap;
+	waveformBytes = fileStatus.st_size;
+	waveformFrames = waveformBytes / (options.channels * sizeof(short));
+	return true;
 }
 
-// startDeviceIO doesn't do anything, because it is normally called at the start and end of every
-// trial.  To start the stimulus train, we monitor the variable "run", and respond to changes there
-// using the function changeRunState().
+/*
+ When only the pulse amplitude, UAPerV or currentPulses has changed since a train was built (an amplitude titration,
+ for example), the new train has the same samples as the old one apart from the DA values inside the pulses.  
+ Rather than build it again, we take the cached train and rewrite just those values, walking each pulse from its 
+ start in the train's pulse index up to the first zero DA value or the start of the channel's next pulse, which may
+ follow with no gap.  Every DA value in a pulse is the first or second phase value for its channel, so each maps 
+ straight to the new phase value.  If nothing but the cache holds the cached samples they are rewritten in place 
+ and the cache entry becomes the new train, otherwise the samples are copied first.  A channel whose pulses go to 
+ or from zero amplitude has no phase values to map, so that train is built from scratch.
+ */
 
-bool ITC18StimDevice::startDeviceIO(void) {
+bool ITC18StimDevice::patchCachedTrain(PulseTrainData *pTrain, long activeChannels, CompiledTrain *pCompiled) {
 	
-	if (VERBOSE_IO_DEVICE >= 1) {
-		mprintf("ITC18StimDevice: startDeviceIO");
+	list<CompiledTrain>::iterator entry;
+	short oldValues[kMaxChannels], newValues[kMaxChannels], *pValue, *pEnd, *pPulseEnd;
+	long channel, firstPulse, pulse, run, instructionsPerSampleSet, capacity;
+	bool inPlace;
+	
+	boost::mutex::scoped_lock lock(trainCacheLock);
+	for (entry = trainCache.begin(); entry != trainCache.end(); entry++) {
+		if (entry->activeChannels != activeChannels || entry->FIFOSize != FIFOSize) {
+			continue;
+		}
+		for (channel = 0; channel < entry->channels; channel++) {
+			oldValues[channel] = trainRangeFraction(&entry->trains[channel]) * 0x7fff;
+			newValues[channel] = trainRangeFraction(&pTrain[channel]) * 0x7fff;
+			if (!sameTrainTiming(&entry->trains[channel], &pTrain[channel]) || 
+					(oldValues[channel] == 0) != (newValues[channel] == 0)) {
+				break;
+			}
+		}
+		if (channel == entry->channels) {
+			break;
+		}
+	}
+	if (entry == trainCache.end()) {
+		return false;
 	}
+	inPlace = (entry->samples != NULL) ? entry->samples.unique() : entry->runs.unique();
+	*pCompiled = *entry;
+	if (!inPlace && pCompiled->samples != NULL) {
+		if ((pCompiled->samples = allocateSamples(entry->bufferLengthSamples, &capacity)) == NULL) {
+			return false;
+		}
+		memcpy(pCompiled->samples.get(), entry->samples.get(), entry->bufferLengthSamples * sizeof(short));
+		pCompiled->sampleCapacity = capacity;
+	}
+	else if (!inPlace) {
+		pCompiled->runs = boost::shared_array<TrainRun>(new TrainRun[entry->numRuns]);
+		memcpy(pCompiled->runs.get(), entry->runs.get(), entry->numRuns * sizeof(TrainRun));
+	}
+	
+	// Rewrite the DA values in the pulses on each channel whose phase values have changed
+	
+	instructionsPerSampleSet = pCompiled->channels + 1;
+	pEnd = (pCompiled->samples != NULL) ? pCompiled->samples.get() + pCompiled->bufferLengthSamples : NULL;
+	for (channel = 0, firstPulse = 0; channel < pCompiled->channels; channel++) {
+		if (oldValues[channel] != newValues[channel] && pCompiled->samples != NULL) {
+			for (pulse = firstPulse; pulse < firstPulse + pCompiled->pulseCounts[channel]; pulse++) {
+				pPulseEnd = (pulse + 1 < firstPulse + pCompiled->pulseCounts[channel]) ? 
+						&pCompiled->samples[pCompiled->pulseSets[pulse + 1] * instructionsPerSampleSet] : pEnd;
+				for (pValue = &pCompiled->samples[pCompiled->pulseSets[pulse] * instructionsPerSampleSet + channel];
+						pValue < pPulseEnd && *pValue != 0; pValue += instructionsPerSampleSet) {
+					*pValue = (*pValue == oldValues[channel]) ? newValues[channel] : -newValues[channel];
+				}
+			}
+		}
+		else if (oldValues[channel] != newValues[channel]) {
+			for (run = 0; run < pCompiled->numRuns; run++) {
+				pValue = &pCompiled->runs[run].values[channel];
+				if (*pValue != 0) {
+					*pValue = (*pValue == oldValues[channel]) ? newValues[channel] : -newValues[channel];
+				}
+			}
+		}
+		firstPulse += pCompiled->pulseCounts[channel];
+	}
+	pCompiled->key = hashTrainData(pTrain, activeChannels, FIFOSize);
+	memcpy(pCompiled->trains, pTrain, pCompiled->channels * sizeof(PulseTrainData));
+	if (inPlace) {
+		*entry = *pCompiled;
+		trainCache.splice(trainCache.begin(), trainCache, entry);
+		return true;
+	}
+	lock.unlock();
+	cacheTrain(*pCompiled);
 	return true;
 }
 
-bool ITC18StimDevice::startStimulus(void) {
+/*
+ Choose the sample period (ticks per instruction) for a train.  The instructions specify the entire stimulus train, 
+ plus the front and back porches for the gate.  Unless we are streaming, we require the entire stimulus instruction 
+ to fit within the ITC-18 FIFO, allowing for enough DA (channels) and Digital (1) samples, and a factor of safety 
+ (2x).  That gives the fastest usable tick count directly.  When streaming, the fastest tick rate is always usable.
+ 
+ Pulse widths are rounded to whole sample sets, and pulse onsets fall on sample sets, so the interval between
+ pulses is off by up to one sample set.  Starting at the fastest usable tick count, we score each candidate by its
+ worst fractional error in pulse width or pulse interval on any channel, and take the first one that is within 
+ kDriftFractionLimit.  If none is, we take the candidate with the smallest error.  Errors up to kPlanWarnFraction 
+ are normal for pulses near the sample period, so only a larger error is warned about, and only once for each set
+ of parameters, however many times a train is built from them.  The achieved values that are reported are for the 
+ first channel.
+ 
+ For a batch, pTrain holds numTrains sets of activeChannels trains, and the errors are taken over all of them.  
+ Batches are streamed when they are longer than the FIFO, so they can use the fastest tick rate.
+ */
+
+bool ITC18StimDevice::planTiming(PulseTrainData *pTrain, long activeChannels, TimingPlan *pPlan, long numTrains) {
 	
-	if (itc == NULL) {
+	long index, ticks, minTicks, maxTicks, setsPerFIFO, lastPulse;
+	double trainUS, sampleSetPeriodUS, pulsePeriodUS, error;
+	
+	trainUS = 0;
+	for (index = 0; index < activeChannels; index++) {
+		trainUS = max(trainUS, pTrain[index].durationMS * 1000.0);
+	}
+	trainUS += (pTrain->doGate) ? 2 * pTrain->gatePorchMS * 1000.0 : 0;
+	setsPerFIFO = FIFOSize / ((activeChannels + 1) * 2);
+	if (options.streaming || numTrains > 1) {
+		minTicks = ITC18_MINIMUM_TICKS;
+	}
+	else if (setsPerFIFO <= 0) {
 		return false;
 	}
-	if (ITC18Running) {
+	else {
+		minTicks = max((long)ITC18_MINIMUM_TICKS, (long)ceil(trainUS / (kITC18TickTimeUS * setsPerFIFO)));
+	}
+	if (minTicks > ITC18_MAXIMUM_TICKS) {
 		merror(M_IODEVICE_MESSAGE_DOMAIN, 
-			   "ITC18StimDevice startStimulus: request was made without first stopping IO, aborting");
+			   "ITC18StimDevice: train is too long to fit in the ITC18 FIFO, consider setting streaming");
 		return false;
 	}
-	if (!primed) {
+	maxTicks = min((long)ITC18_MAXIMUM_TICKS, minTicks + kPlanTicksSearched);
+	pPlan->timingError = -1;
+	for (ticks = minTicks; ticks <= maxTicks; ticks++) {
+		sampleSetPeriodUS = ticks * kITC18TickTimeUS * (activeChannels + 1);
+		for (error = 0, index = 0; index < activeChannels * numTrains; index++) {
+			error = max(error, pulseTimingError(&pTrain[index], sampleSetPeriodUS));
+		}
+		if (pPlan->timingError < 0 || error < pPlan->timingError) {
+			pPlan->ticksPerInstruction = ticks;
+			pPlan->timingError = error;
+		}
+		if (error <= kDriftFractionLimit) {
+			break;
+		}
+	}
+	if (pPlan->timingError > kPlanWarnFraction && timingWarnedGeneration != parameterGeneration) {
+		timingWarnedGeneration = parameterGeneration;
+		mwarning(M_IODEVICE_MESSAGE_DOMAIN, 
+				 "ITC18StimDevice: no sample period is within %.0f%% of the requested pulse timing, best is %.1f%%",
+				 kPlanWarnFraction * 100.0, pPlan->timingError * 100.0);
+	}
+	
+	// Report what the chosen plan will actually deliver.  The achieved frequency is the mean over the pulses of the 
+	// train, the last of which is the last that ends within it.
+	
+	sampleSetPeriodUS = pPlan->ticksPerInstruction * kITC18TickTimeUS * (activeChannels + 1);
+	pulsePeriodUS = ((pTrain->frequencyHZ > 0) ? 1000000.0 / pTrain->frequencyHZ : 0);
+	pPlan->achievedWidthUS = round(pTrain->pulseWidthUS / sampleSetPeriodUS) * sampleSetPeriodUS;
+	pPlan->achievedFrequencyHZ = 0;
+	if (pulsePeriodUS > 0) {
+		lastPulse = max(1L, (long)((pTrain->durationMS * 1000.0 - pTrain->pulseWidthUS * 
+						((pTrain->pulseBiphasic) ? 2 : 1)) / pulsePeriodUS));
+		pPlan->achievedFrequencyHZ = 1000000.0 / 
+						(floor(lastPulse * pulsePeriodUS / sampleSetPeriodUS) * sampleSetPeriodUS / lastPulse);
+	}
+	return true;
+}
+
+// Get ready to start: only a primed device can start.  If it is not primed, prime it now.  A prime that is under 
+// way on another thread is waited for (in loadInstructions) rather than failing the run.  A device primed before 
+// the latest parameter changes, which the re-prime has not caught up with yet, is primed again first.
+
+bool ITC18StimDevice::prepareStart(void) {
+	
+	if (deviceState == kDevicePrimed && primedGeneration != kPrimedBatch && primedGeneration != parameterGeneration) {
+		loadInstructions();
+	}
+	for (long attempt = 0; !changeDeviceState(kDevicePrimed, kDeviceRunning); attempt++) {
+		if (deviceState == kDeviceRunning) {
+			merror(M_IODEVICE_MESSAGE_DOMAIN, 
+				   "ITC18StimDevice startStimulus: request was made without first stopping IO, aborting");
+			return false;
+		}
+		if (attempt == kStartAttempts) {
+			merror(M_IODEVICE_MESSAGE_DOMAIN, "ITC18StimDevice startStimulus: could not prime the ITC18, aborting");
+			return false;
+		}
 		loadInstructions();
 	}
-	boost::mutex::scoped_lock lock(ITC18DeviceLock); 
-	ITC18Running = true;
 	running->setValue(true);
-	ITC18_Start(itc, false, true, false, false);				// Start ITC-18, no external trigger, output enabled
+	return true;
+}
+
+// Prime in response to the prime variable.  The leader of a group primes every device in the group that shares its
+// prime variable, each on its own thread, so that the uploads to the different ITC18s overlap.  Those devices leave
+// the priming to the leader.  Any other device primes only itself.
+
+void ITC18StimDevice::primeGroup(void) {
+	
+	shared_ptr<ITC18StimDevice> leader = groupLeader();
+	vector<shared_ptr<ITC18StimDevice> > members;
+	boost::thread_group primeThreads;
+	
+	if (leader != NULL && leader.get() != this && leader->prime == prime) {
+		return;
+	}
+	if (leader.get() != this) {
+		loadInstructions();
+		return;
+	}
+	groupMembers(&members);
+	for (size_t index = 1; index < members.size(); index++) {
+		if (members[index]->prime == prime) {
+			primeThreads.create_thread(boost::bind(&ITC18StimDevice::loadInstructions, members[index]));
+		}
+	}
+	loadInstructions();
+	primeThreads.join_all();
+}
+
+// Publish the AD samples of whole sample sets that have been drained into the AD ring since the last call.  They
+// go out as one event, a dictionary with the sample set number of the first set, the number of sets and channels, 
+// the sample set period, and the samples themselves, as int16 values interleaved by channel in a binary string.
+// The event is timestamped with when the first set was sampled.  The samples of a channel being verified are also 
+// kept for verifyTrain.
+
+void ITC18StimDevice::publishADData(void) {
+	
+	long head, tail, sets, firstSet, instructionsPerSampleSet = channels + 1, mask = ADSamples.capacity - 1;
+	float sampleSetPeriodUS = instructionsPerSampleSet * ticksPerInstruction * kITC18TickTimeUS * driftRatio;
+	string values;
+	short *pValue = NULL;
+	MWTime timeUS;
+	
+	boost::mutex::scoped_lock lock(ADPublishLock);
+	if (ADChannels == 0 || waitingForTrigger) {
+		return;
+	}
+	head = ADSamples.head;
+	__sync_synchronize();									// the entries are read only after head
+	tail = ADSamples.tail;
+	sets = (head - tail) / instructionsPerSampleSet;
+	if (sets == 0) {
+		return;
+	}
+	if (ADData != NULL) {
+		values.resize(sets * ADChannels * sizeof(short));
+		pValue = (short *)&values[0];
+	}
+	for (long set = 0; set < sets; set++, tail += instructionsPerSampleSet) {
+		if (pValue != NULL) {
+			for (long channel = 0; channel < ADChannels; channel++) {
+				*pValue++ = ADSamples.entries[(tail + channel) & mask];
+			}
+		}
+		if (verifyChannel >= 0) {
+			verifyCapture.push_back(ADSamples.entries[(tail + verifyChannel) & mask]);
+		}
+	}
+	__sync_synchronize();									// the entries are copied before the space is freed
+	ADSamples.tail = tail;
+	if (ADData == NULL) {
+		return;
+	}
+	
+	firstSet = tail / instructionsPerSampleSet - sets;
+	timeUS = ADStartUS + (MWTime)(firstSet * sampleSetPeriodUS);
+	Datum event(M_DICTIONARY, 5);
+	event.addElement("first_set", Datum(firstSet));
+	event.addElement("sets", Datum(sets));
+	event.addElement("channels", Datum(ADChannels));
+	event.addElement("set_period_us", Datum(sampleSetPeriodUS));
+	event.addElement("samples", Datum(values));
+	ADData->setValue(event, timeUS);
+}
+
+// Queue a train with the current stimulus parameters when the queue_train variable is set true.  The interval that 
+// follows it is taken from inter_train_interval_ms, if it is given.
+
+void ITC18StimDevice::queueCurrentTrain(void) {
+	
+	PulseTrainData trains[ITC18_NUMBEROFDACOUTPUTS];
+	
+	if (!(bool)queueTrain->getValue()) {
+		return;
+	}
+	getTrainData(trains);
+	enqueueTrain(trains, (interTrainIntervalMS != NULL) ? (long)interTrainIntervalMS->getValue() : 0);
+}
+
+// Collect AD values from the ITC18 as they become ready.  This method is scheduled by startStimulus, starting 
+// shortly before the train is expected to end.  A train armed for the external trigger is polled until it is seen
+// to start, and then the polling is scheduled again from its onset.
+
+// When a train is being streamed, this is also where the FIFO gets topped up.  The read FIFO fills at the same rate 
+// as the write FIFO empties, so it is drained to keep it from overflowing, and when AD channels are sampled it is 
+// drained into the AD ring.  Otherwise it is only counted.
+
+bool ITC18StimDevice::readData(void) {
+	
+	long samplesDone, samplesPastEnd;
+	MWTime nowUS, endUS, onsetUS, endInUS;
+	double trainStartUS, entryUS, nominalUS;
+	
+	if (itc == NULL || deviceState != kDeviceRunning) {
+		return false;
+	}
+	if (streamingTrain) {
+		feedFIFO();
+	}
+	if (streamingTrain || ADChannels > 0) {
+		samplesDone = drainReadFIFO();
+	}
+	else {
+		samplesDone = getAvailable();
+	}
+	nowUS = readCountUS;
+	if (readOverflowed) {
+		recoverFromOverflow(nowUS);
+		return true;
+	}
+	
+	// Every poll of a train that has started goes into the drift estimate (see fitDrift), and the times worked out
+	// from the count below are corrected for the drift estimated so far
+	
+	if (samplesDone > kGarbageLength) {
+		nominalUS = (samplesDone - kGarbageLength) * ticksPerInstruction * kITC18TickTimeUS;
+		if (driftPolls.polls++ == 0) {
+			driftPolls.firstPollUS = nowUS;
+		}
+		driftPolls.sumX += nominalUS;
+		driftPolls.sumY += nowUS - driftPolls.firstPollUS;
+		driftPolls.sumXX += nominalUS * nominalUS;
+		driftPolls.sumXY += nominalUS * (nowUS - driftPolls.firstPollUS);
+		driftPolls.sumYY += (double)(nowUS - driftPolls.firstPollUS) * (nowUS - driftPolls.firstPollUS);
+	}
+	entryUS = ticksPerInstruction * kITC18TickTimeUS * driftRatio;
+	
+	// Nothing enters the read FIFO until the trigger starts the sequence, and then one entry every instruction 
+	// period, so the onset is timed from the count like the end of the train below.
+	
+	if (waitingForTrigger && samplesDone > kGarbageLength) {
+		onsetUS = nowUS - (MWTime)((samplesDone - kGarbageLength) * entryUS);
+		ADStartUS = onsetUS;
+		waitingForTrigger = false;
+		if (stimulusOnsetTime != NULL) {
+			stimulusOnsetTime->setValue(Datum((long long)onsetUS), onsetUS);
+		}
+		if (!streamingTrain && batchTrains == 0 && ADChannels == 0) {
+			scheduleEndPolling(onsetUS + (MWTime)((kGarbageLength + bufferLengthSamples + 1) * entryUS) - nowUS);
+		}
+	}
+	
+	// A long train in the FIFO is polled slowly while it plays, until its end is near
+	
+	else if (pollingPeriodUS == kDriftPollPeriodUS && samplesDone > kGarbageLength) {
+		endInUS = (MWTime)((kGarbageLength + bufferLengthSamples + 1 - samplesDone) * entryUS);
+		if (endInUS - kITC18CompletionLeadUS <= kDriftPollPeriodUS) {
+			scheduleEndPolling(endInUS);
+		}
+	}
+	
+	// Each train of a batch starts when the sequence reaches its first sample set.  Its onset is reported as the 
+	// train's number in the batch (from 0), timestamped with the onset.
+	
+	if (batchTrainsReported < batchTrains) {
+		while (batchTrainsReported < batchTrains && 
+					samplesDone > kGarbageLength + batchStartSets[batchTrainsReported] * (channels + 1)) {
+			onsetUS = nowUS - (MWTime)((samplesDone - kGarbageLength - batchStartSets[batchTrainsReported] * 
+										(channels + 1)) * entryUS);
+			if (batchTrainOnset != NULL) {
+				batchTrainOnset->setValue(Datum(batchTrainsReported), onsetUS);
+			}
+			batchTrainsReported++;
+		}
+	}
+	
+	// When a sequence is started, the first three entries in the FIFO are garbage.  They should be thrown out.  
+	
+	if (samplesDone > kGarbageLength + bufferLengthSamples + 1) {
+		
+		// Every entry in the FIFO past the end of the train took one instruction period, so the end of the train 
+		// can be timed from the FIFO count rather than from when we happened to look
+		
+		samplesPastEnd = samplesDone - (kGarbageLength + bufferLengthSamples);
+		if (trainUnderruns > 0) {
+			mwarning(M_IODEVICE_MESSAGE_DOMAIN, "ITC18StimDevice::readData: FIFO ran dry %ld times during train", 
+					 trainUnderruns);
+		}
+		setOptionalValue(FIFOUnderruns, totalUnderruns);
+		fitDrift();
+		entryUS = ticksPerInstruction * kITC18TickTimeUS * driftRatio;
+		endUS = nowUS - (MWTime)(samplesPastEnd * entryUS);
+		trainStartUS = nowUS - (samplesDone - kGarbageLength) * entryUS;
+		recordLatency(kCompletionLatency, endUS);
+		reportFIFOHealth(false);							// out before running goes false
+		reportPulseOnsets(trainStartUS);
+		stopStimulusAt(endUS);
+		loadInstructions();									// upload the next train, usually already armed
+		if (++trainsSinceLatencyReport >= kLatencyReportTrains) {
+			reportLatency(false);
+			trainsSinceLatencyReport = 0;
+		}
+		return true;
+	}
+	else {
+//		mprintf("bufferLengthSamples %d; available %d", bufferLengthSamples, getAvailable());
+		return false;
+	}
+}
+
+// Add the time since startUS to the latency histogram for a stage.  This is called on the hot paths, so it does 
+// no more than bump a counter under a lock that is never held for long.
+
+void ITC18StimDevice::recordLatency(long stage, MWTime startUS) {
+	
+	MWTime latencyUS = max((MWTime)0, Clock::instance()->getCurrentTimeUS() - startUS);
+	LatencyHistogram *pHistogram = &latency[stage];
+	long bin;
+	
+	for (bin = 0; bin < kLatencyBins - 1 && (latencyUS >> bin) > 0; bin++) {
+	}
+	boost::mutex::scoped_lock lock(latencyLock);
+	pHistogram->counts[bin]++;
+	pHistogram->samples++;
+	pHistogram->maxUS = max(pHistogram->maxUS, latencyUS);
+}
+
+/*
+ The read FIFO has overflowed, so entries have been lost and the count can no longer say how far the train has got
+ or when it ended.  Rather than carry on blind (or take the whole server down), the train is stopped where it is, 
+ whatever AD samples can be saved are drained, and the ITC18 is reinitialized and primed with the next train.
+ */
+
+void ITC18StimDevice::recoverFromOverflow(MWTime nowUS) {
+	
+	merror(M_IODEVICE_MESSAGE_DOMAIN, 
+		   "ITC18StimDevice::readData: read FIFO overflow, train stopped and ITC18 reinitialized");
+	setOptionalValue(FIFOOverflows, ++totalOverflows);
+	setOptionalValue(FIFOUnderruns, totalUnderruns);
+	reportFIFOHealth(true);								// out before running goes false
+	stopStimulusAt(nowUS);
+	{
+		boost::mutex::scoped_lock lock(ITC18DeviceLock);
+		pITC18->StopAndInitialize(itc, true, true);
+	}
+	readOverflowed = false;
+	loadInstructions();
+}
+
+// Publish how close the train that has just ended came to the FIFO limits: the FIFO size and the time each entry 
+// takes, the most entries waiting in the read FIFO, the fewest entries left in the write FIFO while it was being 
+// topped up (-1 if the train was not streamed), and the underruns and overflows of the train and of the session.  
+// The read FIFO fills in fifo_size entry periods, which bounds the poll period of a long train.
+
+void ITC18StimDevice::reportFIFOHealth(bool overflowed) {
+	
+	Datum stats(M_DICTIONARY, 8);
+	
+	stats.addElement("fifo_size", Datum(FIFOSize));
+	stats.addElement("entry_period_us", Datum(ticksPerInstruction * kITC18TickTimeUS));
+	stats.addElement("read_high_water", Datum(readHighWater));
+	stats.addElement("write_low_water", Datum(writeLowWater));
+	stats.addElement("underruns", Datum(trainUnderruns));
+	stats.addElement("overflowed", Datum(overflowed));
+	stats.addElement("total_underruns", Datum(totalUnderruns));
+	stats.addElement("total_overflows", Datum(totalOverflows));
+	setOptionalValue(FIFOStats, stats);
+}
+
+// Publish the latency percentiles for each stage in the latency_stats variable, if there is one, as a dictionary 
+// with entries like "load_p90_us", along with the sample memory allocated for trains ("make_bytes") and the most
+// the train arena has held ("arena_high_water_bytes").  With toConsole, they are also printed.
+
+void ITC18StimDevice::reportLatency(bool toConsole) {
+	
+	Datum stats(M_DICTIONARY, kLatencyStages * 5 + 2);
+	MWTime p50, p90, p99;
+	char key[128];
+	
+	boost::mutex::scoped_lock lock(latencyLock);
+	for (long stage = 0; stage < kLatencyStages; stage++) {
+		const LatencyHistogram *pHistogram = &latency[stage];
+		
+		p50 = latencyPercentile(pHistogram, 0.50);
+		p90 = latencyPercentile(pHistogram, 0.90);
+		p99 = latencyPercentile(pHistogram, 0.99);
+		snprintf(key, sizeof(key), "%s_count", latencyStageNames[stage]);
+		stats.addElement(key, Datum(pHistogram->samples));
+		snprintf(key, sizeof(key), "%s_p50_us", latencyStageNames[stage]);
+		stats.addElement(key, Datum((long)p50));
+		snprintf(key, sizeof(key), "%s_p90_us", latencyStageNames[stage]);
+		stats.addElement(key, Datum((long)p90));
+		snprintf(key, sizeof(key), "%s_p99_us", latencyStageNames[stage]);
+		stats.addElement(key, Datum((long)p99));
+		snprintf(key, sizeof(key), "%s_max_us", latencyStageNames[stage]);
+		stats.addElement(key, Datum((long)pHistogram->maxUS));
+		if (toConsole && pHistogram->samples > 0) {
+			mprintf("ITC18StimDevice: %s latency (%ld): p50 %lld us, p90 %lld us, p99 %lld us, max %lld us", 
+					latencyStageNames[stage], pHistogram->samples, p50, p90, p99, pHistogram->maxUS);
+		}
+	}
+	stats.addElement("make_bytes", Datum(madeTrainBytes));
+	stats.addElement("arena_high_water_bytes", Datum(trainArena->highWaterBytes));
+	if (toConsole) {
+		mprintf("ITC18StimDevice: %lld bytes allocated for train samples, train arena peaked at %lld bytes", 
+				madeTrainBytes, trainArena->highWaterBytes);
+	}
+	lock.unlock();
+	setOptionalValue(latencyStats, stats);
+}
+
+// Publish when each pulse of the train that has just played went out, as one event: a dictionary with the time 
+// of the first instruction of the train in MWorks microseconds (start_us), the ITC18 tick period in host 
+// microseconds (tick_us, corrected for drift), and a list with a binary string for each channel, holding the int32 
+// tick count from the start to the instruction that began each of that channel's pulses (onset_ticks).  The ticks 
+// are exact relative to one another.  The start is mapped from the instruction count at the end of the train, so 
+// it is as good as the host clock reading it is taken from.
+
+void ITC18StimDevice::reportPulseOnsets(double trainStartUS) {
+	
+	Datum event(M_DICTIONARY, 3), onsets(M_LIST, channels);
+	long index = 0, instructionsPerSampleSet = channels + 1;
+	string ticks;
+	int *pTicks;
+	
+	if (pulseOnsets == NULL) {
+		return;
+	}
+	for (long channel = 0; channel < channels; channel++) {
+		ticks.resize(pulseCounts[channel] * sizeof(int));
+		pTicks = (pulseCounts[channel] > 0) ? (int *)&ticks[0] : NULL;
+		for (long pulse = 0; pulse < pulseCounts[channel]; pulse++) {
+			*pTicks++ = (pulseSets[index++] * instructionsPerSampleSet + channel) * ticksPerInstruction;
+		}
+		onsets.addElement(Datum(ticks));
+	}
+	event.addElement("start_us", Datum(trainStartUS));
+	event.addElement("tick_us", Datum(kITC18TickTimeUS * driftRatio));
+	event.addElement("onset_ticks", onsets);
+	pulseOnsets->setValue(event, (MWTime)trainStartUS);
+}
+
+/*
+ Prime the device again once the train parameters have stopped changing, so that the next run finds its train 
+ loaded.  markParametersDirty schedules this for kReprimeQuietUS after the first change of a burst, and it puts 
+ itself off until no parameter has changed for kReprimeQuietUS, so the burst is built once.  The train is built 
+ outside the prime lock by armNextTrain, which drops it if a parameter changes while the values are read or the 
+ train is built: the change that made it stale has scheduled another re-prime.  A fresh train is uploaded straight
+ away unless a train is running, in which case it stays armed for the end of that train.  A primed batch, or trains
+ queued for one, are left for the next prime.
+ */
+
+void ITC18StimDevice::reprime(void) {
+	
+	MWTime quietUS;
+	long generation;
+	
+	{
+		boost::mutex::scoped_lock lock(reprimeNodeLock);
+		quietUS = Clock::instance()->getCurrentTimeUS() - lastParameterChangeUS;
+		if (quietUS < kReprimeQuietUS) {
+			scheduleReprime(kReprimeQuietUS - quietUS);
+			return;
+		}
+		reprimePending = false;
+	}
+	generation = parameterGeneration;
+	if (itc == NULL || primedGeneration == generation || 
+			(deviceState == kDevicePrimed && primedGeneration == kPrimedBatch)) {
+		return;
+	}
+	{
+		boost::mutex::scoped_lock lock(batchQueueLock);
+		if (!batchQueue.empty()) {
+			return;
+		}
+	}
+	armNextTrain();
+	if (deviceState != kDeviceRunning && parameterGeneration == generation) {
+		loadInstructions();
+	}
+}
+
+// Schedule readData to poll the ITC18, replacing any polling already scheduled
+
+void ITC18StimDevice::schedulePolling(MWTime firstPollUS, MWTime pollPeriodUS) {
+	
 	shared_ptr<ITC18StimDevice> this_one = shared_from_this();
+	
+	boost::mutex::scoped_lock lock(pollScheduleNodeLock);
+	if (pollScheduleNode != NULL) {
+		pollScheduleNode->cancel();
+	}
 	pollScheduleNode = scheduler->scheduleUS(std::string(FILELINE ": ") + tag, 
-											 (MWTime)0, 
-											 kITC18ReadPeriodUS,
+											 firstPollUS, 
+											 pollPeriodUS,
 											 M_REPEAT_INDEFINITELY, 
 											 boost::bind(readLaunch, weak_ptr<ITC18StimDevice>(this_one)), 
 											 M_DEFAULT_IODEVICE_PRIORITY,
 											 kReadTaskWarnSlopUS, 
 											 kReadTaskFailSlopUS, 
 											 M_MISSED_EXECUTION_DROP);
-	primed = false;
+	pollingPeriodUS = pollPeriodUS;
+}
+
+// Schedule the polling of a train in the FIFO that is expected to end endInUS from now.  The FIFO is polled closely 
+// from just before the end.  Until then, a long train is polled every kDriftPollPeriodUS, which costs little but 
+// spreads the polls that go into the drift estimate (see fitDrift) across the train instead of bunching them at 
+// its end.
+
+void ITC18StimDevice::scheduleEndPolling(MWTime endInUS) {
+	
+	if (endInUS - kITC18CompletionLeadUS > kDriftPollPeriodUS) {
+		schedulePolling(kDriftPollPeriodUS, kDriftPollPeriodUS);
+	}
+	else {
+		schedulePolling(max((MWTime)0, endInUS - kITC18CompletionLeadUS), kITC18CompletionPollUS);
+	}
+}
+
+// Schedule a call to reprime.  The caller holds reprimeNodeLock.
+
+void ITC18StimDevice::scheduleReprime(MWTime delayUS) {
+	
+	reprimeNode = scheduler->scheduleUS(std::string(FILELINE ": ") + tag, delayUS, delayUS, 1, 
+										boost::bind(reprimeLaunch, weak_ptr<ITC18StimDevice>(shared_from_this())),
+										M_DEFAULT_IODEVICE_PRIORITY, kReadTaskWarnSlopUS, kReadTaskFailSlopUS, 
+										M_MISSED_EXECUTION_DROP);
+}
+
+// startDeviceIO doesn't do anything, because it is normally called at the start and end of every
+// trial.  To start the stimulus train, we monitor the variable "run", and respond to changes there
+// using the function changeRunState().
+
+bool ITC18StimDevice::startDeviceIO(void) {
+	
+	if (VERBOSE_IO_DEVICE >= 1) {
+		mprintf("ITC18StimDevice: startDeviceIO");
+	}
+	return true;
+}
+
+// Start every device in the group that shares the leader's run variable.  A device with a run variable of its own
+// starts when that is set (see startStimulus).  Everything that can be done ahead is done for all the devices first,
+// so that the ITC18s are started back to back.  The spread between the first and last start is reported as the 
+// start skew.
+
+bool ITC18StimDevice::startGroup(void) {
+	
+	vector<shared_ptr<ITC18StimDevice> > members, starting;
+	vector<shared_ptr<ITC18StimDevice> >::iterator member;
+	MWTime skewUS;
+	
+	groupMembers(&members);
+	for (member = members.begin(); member != members.end(); ) {
+		member = ((*member)->run == run) ? member + 1 : members.erase(member);
+	}
+	for (member = members.begin(); member != members.end(); member++) {
+		(*member)->runRequestTimeUS = runRequestTimeUS;
+		if ((*member)->itc != NULL && (*member)->prepareStart()) {
+			starting.push_back(*member);
+		}
+	}
+	if (starting.empty()) {
+		return false;
+	}
+	for (member = starting.begin(); member != starting.end(); member++) {
+		(*member)->startITC18();
+	}
+	skewUS = starting.back()->startedUS - starting.front()->startedUS;
+	if (startSkew != NULL) {
+		startSkew->setValue(Datum((long long)skewUS), starting.front()->startedUS);
+	}
+	for (member = starting.begin(); member != starting.end(); member++) {
+		(*member)->finishStart();
+	}
+	return starting.size() == members.size();
+}
+
+// Start the ITC18 with output enabled.  With the external trigger, the ITC18 is started waiting for the trigger, 
+// so that the train begins with hardware precision rather than whenever this thread gets to run.  The onset is 
+// found later by readData.
+
+void ITC18StimDevice::startITC18(void) {
+	
+	boost::mutex::scoped_lock lock(ITC18DeviceLock); 
+	pITC18->Start(itc, options.externalTrigger, true, false, false);
+	startedUS = Clock::instance()->getCurrentTimeUS();
+}
+
+// Start the train.  The leader of a group starts the whole group (see startGroup), and a device that shares its run 
+// variable with the leader of its group is started along with the group rather than on its own.
+
+bool ITC18StimDevice::startStimulus(void) {
+	
+	shared_ptr<ITC18StimDevice> leader;
+	
+	if (itc == NULL) {
+		return false;
+	}
+	leader = groupLeader();
+	if (leader.get() == this) {
+		return startGroup();
+	}
+	if (leader != NULL && leader->run == run) {
+		return false;
+	}
+	if (!prepareStart()) {
+		return false;
+	}
+	startITC18();
+	finishStart();
 	return true;
 }
 
+// Hand the train that has just finished to verifyTrain, on its own thread so that the next train is not held up.  
+// A train is only verified if it played to the end, and if the last verification is still going, this train is
+// not verified.
+
+void ITC18StimDevice::startVerification(void) {
+	
+	boost::shared_ptr<VerifyJob> pJob;
+	
+	if (verifyRunning) {
+		mwarning(M_IODEVICE_MESSAGE_DOMAIN, "ITC18StimDevice::startVerification: still verifying the last train");
+		return;
+	}
+	{
+		boost::mutex::scoped_lock lock(ADPublishLock);
+		if (bufferLengthSets <= 0 || (long)verifyCapture.size() < bufferLengthSets) {
+			return;
+		}
+		pJob = boost::shared_ptr<VerifyJob>(new VerifyJob);
+		pJob->samples = samples;
+		pJob->runs = runs;
+		pJob->numRuns = numRuns;
+		pJob->sets = bufferLengthSets;
+		pJob->instructionsPerSampleSet = channels + 1;
+		pJob->channel = verifyChannel;
+		pJob->sampleSetPeriodUS = (channels + 1) * ticksPerInstruction * kITC18TickTimeUS;
+		pJob->captured.swap(verifyCapture);
+	}
+	if (verifyThread.joinable()) {
+		verifyThread.join();								// already finished
+	}
+	verifyRunning = true;
+	verifyThread = boost::thread(boost::bind(verifyLaunch, weak_ptr<ITC18StimDevice>(shared_from_this()), pJob));
+}
+
 // Make sure that the stimulus is not running past a call to stopDeviceIO
 
 bool ITC18StimDevice::stopDeviceIO() {
@@ -580,30 +2700,302 @@ bool ITC18StimDevice::stopDeviceIO() {
 
 bool ITC18StimDevice::stopStimulus() {
 	
+	return stopStimulusAt(Clock::instance()->getCurrentTimeUS());
+}
+
+// Stop the stimulus, timestamping the changes to run and running with the time the stimulus stopped
+
+bool ITC18StimDevice::stopStimulusAt(MWTime stopTimeUS) {
 	
 	// stop all the scheduled DI checking (i.e. stop calls to "updateChannel")
 	
-	if (pollScheduleNode != NULL) {
-		boost::mutex::scoped_lock lock1(pollScheduleNodeLock);
-        pollScheduleNode->cancel();
-    }
-	boost::mutex::scoped_lock lock2(ITC18DeviceLock); 
+	{
+		boost::mutex::scoped_lock lock(pollScheduleNodeLock);
+		if (pollScheduleNode != NULL) {
+			pollScheduleNode->cancel();
+		}
+	}
 	if (itc != NULL) {
-		ITC18_Stop(itc);
+		boost::mutex::scoped_lock lock(ITC18DeviceLock); 
+		pITC18->Stop(itc);
 	}
-	run->setValue(false);
-	running->setValue(false);
-	ITC18Running = false;
+	
+	// Whatever is left of the AD samples is published now, rather than waiting for the next train
+	
+	{
+		boost::mutex::scoped_lock lock(ADPublishNodeLock);
+		if (ADPublishNode != NULL) {
+			ADPublishNode->cancel();
+			ADPublishNode.reset();
+		}
+	}
+	if (itc != NULL && ADChannels > 0 && deviceState == kDeviceRunning) {
+		publishADData();
+		drainReadFIFO();
+		publishADData();
+		if (verifyChannel >= 0) {
+			startVerification();
+		}
+	}
+	changeDeviceState(kDeviceRunning, kDeviceIdle);
+	run->setValue(Datum(false), stopTimeUS);
+	running->setValue(Datum(false), stopTimeUS);
 	return true;
 }
 
+// Copy a block of instructions into a buffer.  The ranges must not overlap.
+
 void ITC18StimDevice::replaceShortsInRange(short *buffer, short *replacement, long offset, long numShorts) {
 	
-	long index;
+	if (numShorts > 0) {
+		memcpy(buffer + offset, replacement, numShorts * sizeof(short));
+	}
+}
+
+// Fill a buffer with repeats of a short pattern (a sample set or a pulse).  After the first copy, each pass copies 
+// everything written so far, so the number of copies grows with log2(repeats) and each is a wide block move.
+
+void ITC18StimDevice::tileShortsInRange(short *buffer, short *pattern, long offset, long patternLength, 
+										long repeats) {
+	
+	long done, total, chunk;
 	
+	if (repeats <= 0 || patternLength <= 0) {
+		return;
+	}
 	buffer += offset;
-	for (index = 0; index < numShorts; index++) {
-		*buffer++ = *replacement++;
+	total = patternLength * repeats;
+	memcpy(buffer, pattern, patternLength * sizeof(short));
+	for (done = patternLength; done < total; done += chunk) {
+		chunk = min(done, total - done);
+		memcpy(buffer + done, buffer, chunk * sizeof(short));
+	}
+}
+
+// Make a compiled train the current train, and set up the ITC18 with its sequence and instructions, leaving it 
+// ready to start
+
+bool ITC18StimDevice::uploadTrain(const CompiledTrain &compiled) {
+	
+	long index;
+	int writeAvailable, result;
+	int ITCInstructions[kMaxChannels + 1];
+	MWTime startUS = Clock::instance()->getCurrentTimeUS();
+	
+	samples = compiled.samples;
+	runs = compiled.runs;
+	numRuns = compiled.numRuns;
+	batchStartSets = compiled.batchStartSets;
+	batchTrains = compiled.batchTrains;
+	batchTrainsReported = 0;
+	pulseSets = compiled.pulseSets;
+	memcpy(pulseCounts, compiled.pulseCounts, sizeof(pulseCounts));
+	memset(&driftPolls, 0, sizeof(driftPolls));
+	readHighWater = 0;
+	writeLowWater = -1;
+	readOverflowed = false;
+	bufferLengthSamples = compiled.bufferLengthSamples;
+	bufferLengthSets = compiled.bufferLengthSets;
+	channels = compiled.channels;
+	setKernels = kernelsForChannels(channels);
+	ticksPerInstruction = compiled.ticksPerInstruction;
+	waveformTrain = compiled.waveform;
+	if (waveformTrain) {
+		memcpy(waveformScale, compiled.waveformScale, sizeof(waveformScale));
+		porchSets = compiled.porchSets;
+		waveformGateBits = compiled.gateBits;
+		waveformMarkerBits = compiled.markerBits;
+	}
+	setOptionalValue(achievedPulseWidthUS, compiled.achievedWidthUS);
+	setOptionalValue(achievedPulseFreqHz, compiled.achievedFrequencyHZ);
+	
+	// Set up the ITC for the stimulus train.  Do everything except the start
+	
+	// AD channel n is sampled by instruction n, so the AD samples of each sample set are its first read entries, and
+	// there can be one more AD channel than there are DA channels.
+	
+	ADChannels = min(options.ADChannels, channels + 1);
+	for (index = 0; index < channels; index++) {
+		ITCInstructions[index] = DAInstructions[compiled.trains[index].DAChannel] | ITC18_OUTPUT_UPDATE;
+		if (index < ADChannels) {
+			ITCInstructions[index] |= ADInstructions[index] | ITC18_INPUT_UPDATE;
+		}
+	} 
+	ITCInstructions[index] = ITC18_OUTPUT_DIGITAL1 | ITC18_OUTPUT_UPDATE | 
+			((index < ADChannels) ? (ADInstructions[index] | ITC18_INPUT_UPDATE) : ITC18_INPUT_SKIP);
+	{
+		boost::mutex::scoped_lock lock(ADPublishLock);
+		ADSamples.head = ADSamples.tail = 0;
+		verifyChannel = (options.verifyChannel < min(ADChannels, channels) && !waveformTrain) ? 
+				options.verifyChannel : -1;
+		verifyCapture.clear();
+	}
+	
+	// The train stays on the host, so that it can be streamed into the FIFO if it is too long to be written at once.
+	// Trains that are not held as samples are always streamed.
+	
+	samplesWritten = samplesRead = 0;
+	trainUnderruns = 0;
+	streamingTrain = false;
+	if (itc != NULL) {									// don't access ITC if we're debugging
+		{
+			boost::mutex::scoped_lock lock(ITC18DeviceLock);
+			pITC18->SetSequence(itc, channels + 1, ITCInstructions); 
+			pITC18->StopAndInitialize(itc, true, true);
+			pITC18->GetFIFOWriteAvailable(itc, &writeAvailable);
+		}
+		emptyWriteAvailable = writeAvailable;
+		streamingTrain = (options.streaming || samples == NULL) && (bufferLengthSamples > writeAvailable);
+		if (!streamingTrain && writeAvailable < bufferLengthSamples) {
+			merror(M_IODEVICE_MESSAGE_DOMAIN, "LLITC18PulseTrainDevice: ITC18 write buffer was full.");
+			return false;
+		}
+		result = writeTrainToFIFO(writeAvailable);
+		if (result != noErr) { 
+			mprintf("Error ITC18_WriteFIFO, result: %d", result);
+			samplesWritten = 0;
+			return false;
+		}
+		boost::mutex::scoped_lock lock(ITC18DeviceLock);
+		pITC18->SetSamplingInterval(itc, ticksPerInstruction, false);
+	}	
+	/*	
+	 for (index = 49000; index < bufferLengthSamples - 8; index += 8) {
+	 mprintf("%4hx %4hx %4hx %4hx %4hx %4hx %4hx %4hx", 
+	 samples[index + 0], samples[index + 1], samples[index + 2], samples[index + 3], 
+	 samples[index + 4], samples[index + 5], samples[index + 6], samples[index + 7]);
+	 }
+	 for ( ; index < bufferLengthSamples; index++) {
+	 mprintf("%4hx %4hx %4hx %4hx %4hx %4hx %4hx %4hx", samples[index]);
+	 }
+	 */
+	recordLatency(kUploadLatency, startUS);
+	return true;
+}
+
+
+// Compare a train that has played with the AD samples looped back from one of its channels.  The two traces are 
+// aligned by the peak of their cross-correlation (interpolated between sample sets), and the offset is reported.  
+// With the traces aligned, the amplitude error is the least-squares gain of the captured trace relative to the 
+// train, less one.  The pulse count error is the number of pulses captured less the number in the train.
+
+void ITC18StimDevice::verifyTrain(boost::shared_ptr<VerifyJob> pJob) {
+	
+	long sets = pJob->sets, maxLag = min((long)kVerifyMaxLagSets, sets - 1), bestLag = -maxLag, pulseError, end;
+	vector<float> expected(sets), captured(sets);
+	vector<double> products(2 * maxLag + 1);
+	double expectedMean = 0, capturedMean = 0, peak = 0, lagSets, below, above, gain, expectedPower;
+	
+	if (pJob->samples != NULL) {
+		for (long set = 0; set < sets; set++) {
+			expected[set] = pJob->samples[set * pJob->instructionsPerSampleSet + pJob->channel];
+		}
+	}
+	else {
+		for (long run = 0; run < pJob->numRuns; run++) {
+			end = (run + 1 < pJob->numRuns) ? min(pJob->runs[run + 1].firstSet, sets) : sets;
+			for (long set = pJob->runs[run].firstSet; set < end; set++) {
+				expected[set] = pJob->runs[run].values[pJob->channel];
+			}
+		}
+	}
+	for (long set = 0; set < sets; set++) {
+		captured[set] = pJob->captured[set];
+		peak = max(peak, (double)fabs(expected[set]));
+	}
+	pulseError = countPulses(&captured[0], sets, peak / 2) - countPulses(&expected[0], sets, peak / 2);
+	
+	// The correlation is done on the traces less their means, so that an offset on the AD input does not favor 
+	// the lags with the most overlap
+	
+	for (long set = 0; set < sets; set++) {
+		expectedMean += expected[set];
+		capturedMean += captured[set];
+	}
+	expectedMean /= max(sets, 1L);
+	capturedMean /= max(sets, 1L);
+	for (long set = 0; set < sets; set++) {
+		expected[set] -= expectedMean;
+		captured[set] -= capturedMean;
+	}
+	for (long lag = -maxLag; lag <= maxLag; lag++) {
+		products[lag + maxLag] = laggedProduct(&captured[0], &expected[0], sets, lag);
+		if (products[lag + maxLag] > products[bestLag + maxLag]) {
+			bestLag = lag;
+		}
+	}
+	lagSets = bestLag;
+	if (bestLag > -maxLag && bestLag < maxLag) {
+		below = products[bestLag + maxLag - 1];
+		above = products[bestLag + maxLag + 1];
+		if (below - 2 * products[bestLag + maxLag] + above < 0) {
+			lagSets += 0.5 * (below - above) / (below - 2 * products[bestLag + maxLag] + above);
+		}
+	}
+	expectedPower = laggedProduct(&expected[max(-bestLag, 0L)], &expected[max(-bestLag, 0L)], sets - labs(bestLag), 0);
+	gain = (expectedPower > 0) ? products[bestLag + maxLag] / expectedPower : 0;
+	if (pulseError != 0) {
+		mwarning(M_IODEVICE_MESSAGE_DOMAIN, "ITC18StimDevice::verifyTrain: %ld pulses %s than the train", 
+				 labs(pulseError), (pulseError > 0) ? "more" : "fewer");
+	}
+	setOptionalValue(verifyAmplitudeError, (float)(gain - 1.0));
+	setOptionalValue(verifyPulseCountError, pulseError);
+	setOptionalValue(verifyOffsetUS, (float)(lagSets * pJob->sampleSetPeriodUS));
+	verifyRunning = false;
+}
+
+// Write up to maxSamples more of the current train into the FIFO.  Pulse trains are written straight from the host 
+// copy.  Trains made of runs and waveform trains are expanded kExpandChunkSets sample sets at a time, and only 
+// whole sample sets are written.  The device is locked only for each write, so other driver calls are not held up 
+// while a train is expanded.
+
+int ITC18StimDevice::writeTrainToFIFO(long maxSamples) {
+	
+	short chunkValues[kExpandChunkSets * (kMaxChannels + 1)];
+	long remaining, sets, instructionsPerSampleSet = channels + 1;
+	int result = noErr;
+	MWTime startUS;
+	
+	remaining = min(maxSamples, bufferLengthSamples - samplesWritten);
+	if (samples != NULL) {
+		if (remaining > 0) {
+			boost::mutex::scoped_lock lock(ITC18DeviceLock);
+			startUS = Clock::instance()->getCurrentTimeUS();
+			result = pITC18->WriteFIFO(itc, remaining, &samples[samplesWritten]);
+			recordLatency(kWriteFIFOLatency, startUS);
+			if (result == noErr) {
+				samplesWritten += remaining;
+			}
+		}
+		return result;
+	}
+	while (remaining >= instructionsPerSampleSet) {
+		sets = min(remaining / instructionsPerSampleSet, (long)kExpandChunkSets);
+		if (waveformTrain) {
+			expandWaveform(chunkValues, samplesWritten / instructionsPerSampleSet, sets);
+		}
+		else {
+			expandRuns(chunkValues, samplesWritten / instructionsPerSampleSet, sets);
+		}
+		{
+			boost::mutex::scoped_lock lock(ITC18DeviceLock);
+			startUS = Clock::instance()->getCurrentTimeUS();
+			result = pITC18->WriteFIFO(itc, sets * instructionsPerSampleSet, chunkValues);
+			recordLatency(kWriteFIFOLatency, startUS);
+		}
+		if (result != noErr) {
+			break;
+		}
+		samplesWritten += sets * instructionsPerSampleSet;
+		remaining -= sets * instructionsPerSampleSet;
+	}
+	return result;
+}
+
+void ITC18StimDevice::setOptionalValue(const boost::shared_ptr <Variable> &variable, const Datum &value) {
+	
+	if (variable != NULL) {
+		variable->setValue(value);
 	}
 }
 
@@ -618,6 +3010,7 @@ bool ITC18StimDevice::shutdown(){
 	if (VERBOSE_IO_DEVICE >= 2) {
 		mprintf("ITC18StimDevice: shutdown");
 	}
+	reportLatency(true);
 	return true;
 }
 
@@ -12,11 +12,21 @@
 #include "MWorksCore/IODevice.h"
 #include "ITC/ITC18.h"						// Instrutech header
 #include <ITC/Itcmm.h>
+#include "ITC18Simulator.h"
+#include <boost/shared_array.hpp>
+#include <boost/thread.hpp>
+#include <list>
+#include <vector>
 
 #undef VERBOSE_IO_DEVICE
 #define VERBOSE_IO_DEVICE 0					// verbosity level is 0-2, 2 is maximum
 
 #define noErr       0
+#define kArenaMinBlockShorts	(0x1 << 12)		// smallest block in the train arena
+#define kArenaSizes		16					// power of two block sizes in the train arena
+#define kLatencyBins	24					// power of two microsecond bins, the last one holds all above ~4 s
+
+using namespace std;
 
 typedef struct {
 	bool	currentPulses;					// true for current, false for voltage
@@ -35,51 +45,339 @@ typedef struct {
 	float   UAPerV;
 } PulseTrainData;
 
-using namespace std;
+typedef struct {
+	bool	streaming;						// keep the fastest tick rate and top up the FIFO during long trains
+	long	trainCacheMB;					// memory budget for compiled trains, 0 to disable the cache
+	long	channels;						// number of DACs driven, each with its own pulse train
+	string	waveformFile;					// int16 waveform to play instead of pulses, empty for pulses
+	long	waveformDAChannels[ITC18_NUMBEROFDACOUTPUTS];	// DAC for each channel of the waveform file
+	float	waveformRateHz;					// frames per second for the waveform file
+	bool	simulate;						// use the software ITC18 instead of the hardware
+	bool	externalTrigger;				// arm each train on run and start it on the ITC18 external trigger
+	long	deviceIndex;					// which ITC18 to open, 0 for the first
+	string	group;							// devices with the same group name prime and start together
+	long	ADChannels;						// AD inputs sampled during each train (AD0 first), 0 for none
+	long	verifyChannel;					// channel whose DA is looped back to the same AD input, -1 for none
+	bool	batchCodes;						// put the number of each train of a batch on the high digital bits
+} ITC18StimOptions;
+
+typedef struct {
+	long	ticksPerInstruction;
+	float	achievedWidthUS;
+	float	achievedFrequencyHZ;			// mean pulse frequency over the train
+	float	timingError;					// worst fractional error in pulse width or pulse interval
+} TimingPlan;
+
+typedef struct {
+	long	channels;
+	long	instructionsPerSampleSet;
+	long	porchSets;						// sample sets in each gate porch
+	long	trainSets;						// sample sets between the porches
+	long	setsPerPhase;					// pulse shape, when all channels share pulse timing
+	long	setsPerPulse;
+	float	pulsePeriodUS;
+	float	sampleSetPeriodUS;
+	short	gateBits;
+	short	gateAndPulseBits;
+	bool	sharedTiming;
+	float	rangeFraction[ITC18_NUMBEROFDACOUTPUTS];
+} TrainLayout;
+
+typedef struct {
+	long	firstSet;						// first sample set of the run
+	short	values[ITC18_NUMBEROFDACOUTPUTS + 1];	// DA values and digital word, the same for every set in the run
+} TrainRun;
+
+// Loops over sample sets, compiled once for each length of sample set so that the stride is a constant (see 
+// setKernelTable).  The kernels for a train are chosen once, when it is compiled or uploaded.
+
+typedef struct {
+	void	(*fillSets)(short *buffer, const short *values, long numSets);
+	void	(*scaleFrames)(short *buffer, const short *pFrames, const float *scale, short gateBits, short markerBits,
+						   long numFrames);
+} SetKernels;
+
+typedef struct {
+	PulseTrainData	trains[ITC18_NUMBEROFDACOUTPUTS];
+	long			intervalMS;						// gap before the next train in the batch
+} BatchEntry;
+
+typedef struct CompiledTrain {
+	unsigned long				key;						// hash of the train parameters and FIFO size
+	PulseTrainData				trains[ITC18_NUMBEROFDACOUTPUTS];
+	long						activeChannels;
+	long						FIFOSize;
+	boost::shared_array<short>	samples;
+	long						sampleCapacity;				// shorts allocated for samples
+	boost::shared_array<TrainRun>	runs;						// trains too long to hold as samples, else empty
+	long						numRuns;
+	long						bufferLengthSamples;
+	long						bufferLengthSets;
+	long						channels;
+	long						ticksPerInstruction;
+	float						achievedWidthUS;
+	float						achievedFrequencyHZ;
+	bool						waveform;					// played from the waveform file, samples is empty
+	float						waveformScale[ITC18_NUMBEROFDACOUTPUTS];
+	long						porchSets;
+	short						gateBits;
+	short						markerBits;
+	boost::shared_array<long>	batchStartSets;				// first sample set of each train in a batch
+	long						batchTrains;				// trains in a batch, 0 for a single train
+	boost::shared_array<long>	pulseSets;					// sample set where each pulse starts, by channel
+	long						pulseCounts[ITC18_NUMBEROFDACOUTPUTS];
+} CompiledTrain;
+
+typedef struct {
+	boost::mutex				lock;
+	list<short *>				freeBlocks[kArenaSizes];	// block n holds kArenaMinBlockShorts << n shorts
+	long long					bytesHeld;					// in blocks that are in use or free
+	long long					highWaterBytes;
+} TrainArena;
+
+// Requests to the arming thread, which lives as long as the device and builds the next train whenever one starts.  
+// The thread holds these rather than the device while it waits, so that it does not keep the device alive.
+
+typedef struct {
+	boost::mutex				lock;
+	boost::condition_variable	wake;
+	bool						armRequested;				// a train has started, build the next one
+	bool						stopping;					// the device is going away, end the thread
+} ArmRequests;
+
+// AD samples drained from the read FIFO, waiting to be published.  There is one writer (readData, draining the FIFO
+// under the device lock) and one reader (publishADData), so neither needs to lock the ring: each only advances its 
+// own index, after a memory barrier.  Indices count entries since the train was loaded, and wrap on capacity.
+
+typedef struct {
+	boost::shared_array<short>	entries;
+	long						capacity;					// a power of two
+	volatile long				head;						// entries written
+	volatile long				tail;						// entries published
+} ADRing;
+
+// What verifyTrain needs to check a train that has played: the train as it was built, and the AD samples captured
+// from the looped back channel, one per sample set
+
+typedef struct {
+	boost::shared_array<short>		samples;
+	boost::shared_array<TrainRun>	runs;
+	long							numRuns;
+	long							sets;
+	long							instructionsPerSampleSet;
+	long							channel;
+	float							sampleSetPeriodUS;
+	vector<short>					captured;
+} VerifyJob;
 
 namespace mw {
 
+typedef struct {
+	boost::shared_ptr <Variable>	biphasicPulses;
+	boost::shared_ptr <Variable>	currentPulses;
+	boost::shared_ptr <Variable>	pulseAmplitude;
+	boost::shared_ptr <Variable>	pulseFreqHz;
+	boost::shared_ptr <Variable>	pulseWidthUS;
+	boost::shared_ptr <Variable>	trainDurationMS;
+	boost::shared_ptr <Variable>	UAPerV;
+} ChannelVariables;
+
+enum {kDeviceIdle = 0, kDevicePriming, kDevicePrimed, kDeviceRunning};
+
+enum {kLoadLatency = 0, kMakeLatency, kUploadLatency, kWriteFIFOLatency, kStartLatency, kCompletionLatency, 
+	kLatencyStages};
+
+typedef struct {
+	long	counts[kLatencyBins];			// bin n counts latencies below 2^n us (and at least 2^(n-1) us)
+	long	samples;
+	MWTime	maxUS;
+} LatencyHistogram;
+
+// Read FIFO counts of one train against the host clock, for the drift estimate (see fitDrift).  x is the nominal 
+// ITC18 time since the first instruction, y the host time since the first poll, both in microseconds.
+
+typedef struct {
+	long	polls;
+	double	sumX, sumY, sumXX, sumXY, sumYY;
+	MWTime	firstPollUS;
+} DriftPolls;
+
 class ITC18StimDevice : public IODevice {
 
 protected:  	
+	boost::shared_ptr <Variable>	achievedPulseFreqHz;
+	boost::shared_ptr <Variable>	achievedPulseWidthUS;
 	boost::mutex					active_mutex;
+	long							ADChannels;					// AD inputs sampled in the current train
+	boost::shared_ptr <Variable>	ADData;
+	boost::mutex					ADPublishLock;
+	shared_ptr<ScheduleTask>		ADPublishNode;
+	boost::mutex					ADPublishNodeLock;
+	ADRing							ADSamples;					// every read FIFO entry of the current train
+	MWTime							ADStartUS;					// when the first sample set of the train was played
+	long							armedGeneration;			// parameter generation armedTrain was built from
+	boost::shared_ptr <ArmRequests>	armRequests;
+	boost::thread					armThread;					// builds the next train, see armLoop
+	CompiledTrain					armedTrain;					// next train, built while the current one plays
+	boost::mutex					armedTrainLock;
+	bool							armedTrainReady;
+	list<BatchEntry>				batchQueue;					// trains queued for the next prime
+	boost::mutex					batchQueueLock;
+	boost::shared_array<long>		batchStartSets;
+	boost::shared_ptr <Variable>	batchTrainOnset;
+	long							batchTrains;
+	long							batchTrainsReported;		// trains of the batch whose onsets were reported
 	boost::shared_ptr <Variable>	biphasicPulses;
 	long							bufferLengthSamples;		// number of stimulus instructions/samples
 	long							bufferLengthSets;			// number of stimulus sample sets
 	long							channels;					// number of active channels
+	ChannelVariables				channelVariables[ITC18_NUMBEROFDACOUTPUTS];
 	short							*channelSamples[ITC18_NUMBEROFDACOUTPUTS];
+	boost::shared_ptr <Variable>	clockDriftPPM;
 	boost::shared_ptr <Variable>	currentPulses;
+	volatile long					deviceState;				// kDeviceIdle, kDevicePriming, ... (see changeDeviceState)
+	boost::mutex					deviceStateLock;
+	DriftPolls						driftPolls;					// of the current train
+	double							driftRatio;					// host us per nominal ITC18 us, 1 until estimated
+	double							driftSxx, driftSxy;			// pooled over trains, fading with each train
+	double							driftScatterUS;				// RMS scatter of the last train's polls about their line
+	bool							driftWarned;
+	int								emptyWriteAvailable;		// FIFO write space with nothing queued
+	boost::shared_ptr <Variable>	FIFOOverflows;
+	boost::shared_ptr <Variable>	FIFOStats;
+	boost::shared_ptr <Variable>	FIFOUnderruns;
+	boost::shared_ptr <Variable>	interTrainIntervalMS;
 	MWTime							highTimeUS;					// Used to compute length of scheduled high/low pulses
 	long							FIFOSize;
 	void							*itc;
 	boost::mutex					ITC18DeviceLock;
 	bool							ITC18JustStarted;
-	bool							ITC18Running;
+	MWTime							lastParameterChangeUS;
+	LatencyHistogram				latency[kLatencyStages];	// hot path latencies, by stage
+	boost::mutex					latencyLock;
+	boost::shared_ptr <Variable>	latencyStats;
+	long long						madeTrainBytes;				// sample memory allocated by makeTrainSamples
 	bool							noAlternativeDevice;
-	bool							parametersDirty;
+	long							numRuns;
+	ITC18StimOptions				options;
+	volatile long					parameterGeneration;		// incremented on every parameter change
 	shared_ptr<ScheduleTask>		pollScheduleNode;
 	boost::mutex					pollScheduleNodeLock;
-	bool							primed;
+	MWTime							pollingPeriodUS;			// of the polling scheduled by schedulePolling
+	long							porchSets;					// gate porch length of a waveform train
+	long							primedGeneration;			// parameter generation of the loaded train
+	boost::mutex					primeLock;
+	const ITC18Functions			*pITC18;					// driver calls, to the hardware or the simulator
 	boost::shared_ptr <Variable>	pulseAmplitude;
+	long							pulseCounts[ITC18_NUMBEROFDACOUTPUTS];
 	boost::shared_ptr <Variable>	pulseDurationMS;
+	boost::shared_ptr <Variable>	pulseOnsets;
 	shared_ptr<ScheduleTask>		pulseScheduleNode;
 	boost::mutex					pulseScheduleNodeLock;				
+	boost::shared_array<long>		pulseSets;					// where each pulse of the current train starts
 	boost::shared_ptr <Variable>	pulseWidthUS;
 	boost::shared_ptr <Variable>	pulseFreqHz;
-	short							*samples; 
-	bool							samplesReady;
+	boost::shared_ptr <Variable>	queueTrain;
+	MWTime							readCountUS;				// when the read FIFO was last counted
+	long							readHighWater;				// most entries waiting in the read FIFO this train
+	volatile bool					readOverflowed;				// the read FIFO has overflowed since the last reset
+	shared_ptr<ScheduleTask>		reprimeNode;
+	boost::mutex					reprimeNodeLock;
+	bool							reprimePending;				// a call to reprime is scheduled
+	MWTime							runRequestTimeUS;			// when run was last set true
+	boost::shared_array<TrainRun>	runs;						// current train, if it is made of runs
+	boost::shared_array<short>		samples; 
+	long							samplesRead;				// entries drained from the read FIFO
+	long							samplesWritten;				// entries of samples written to the FIFO
 	boost::shared_ptr <Scheduler>	scheduler;
+	const SetKernels				*setKernels;				// sample set loops for the current train
+	MWTime							startedUS;					// when the ITC18 was last started
+	boost::shared_ptr <Variable>	startSkew;
+	boost::shared_ptr <Variable>	stimulusOnsetTime;
+	bool							streamingTrain;				// train is longer than the FIFO
+	long							ticksPerInstruction;
+	long							timingWarnedGeneration;		// parameter generation planTiming last warned for
+	long							totalOverflows;
+	long							totalUnderruns;
+	list<CompiledTrain>				trainCache;					// most recently used first
+	long							trainCacheBytes;
+	long							trainCacheHits;
+	boost::shared_ptr <Variable>	trainCacheHitCount;
+	boost::mutex					trainCacheLock;
+	long							trainCacheMisses;
+	boost::shared_ptr <Variable>	trainCacheMissCount;
 	boost::shared_ptr <Variable>	trainDurationMS;
+	boost::shared_ptr <TrainArena>	trainArena;					// reusable sample buffers for compiled trains
+	long							trainsSinceLatencyReport;
+	long							trainUnderruns;
+	boost::shared_ptr <Variable>	triggerArmedTime;
+	size_t							waveformBytes;
+	const short						*waveformData;				// memory mapped waveform file
+	long							waveformFrames;
+	short							waveformGateBits;
+	short							waveformMarkerBits;
+	float							waveformScale[ITC18_NUMBEROFDACOUTPUTS];
+	bool							waveformTrain;				// current train plays the waveform file
 	boost::shared_ptr <Variable>	UAPerV;
 	bool							usingUSB;
+	boost::shared_ptr <Variable>	verifyAmplitudeError;
+	vector<short>					verifyCapture;				// looped back AD samples of the current train
+	long							verifyChannel;				// channel verified in the current train, or -1
+	boost::shared_ptr <Variable>	verifyOffsetUS;
+	boost::shared_ptr <Variable>	verifyPulseCountError;
+	volatile bool					verifyRunning;
+	boost::thread					verifyThread;				// checks the last train while the next one plays
+	bool							waitingForTrigger;			// armed train has not been seen to start
+	long							writeLowWater;				// fewest entries queued while streaming, or -1
 	
 	// raw hardware functions
 	
 	void openITC18(void);
+	void addChannelPulses(short *trainValues, PulseTrainData *pTrain, long channel, long instructionsPerSampleSet,
+						  float sampleSetPeriodUS, float rangeFraction, short pulseBits, vector<long> *pStarts);
+	boost::shared_array<short> allocateSamples(long length, long *pCapacity);
+	bool planTiming(PulseTrainData *pTrain, long activeChannels, TimingPlan *pPlan, long numTrains = 1);
+	void cacheTrain(const CompiledTrain &compiled);
+	bool changeDeviceState(long fromState, long toState);
 	void closeITC18();
+	bool compileTrain(PulseTrainData *pTrain, long activeChannels, CompiledTrain *pCompiled);
+	long drainReadFIFO(void);
+	void expandRuns(short *buffer, long firstSet, long numSets);
+	void expandWaveform(short *buffer, long firstSet, long numSets);
+	void feedFIFO(void);
+	bool findCachedTrain(PulseTrainData *pTrain, long activeChannels, CompiledTrain *pCompiled);
+	void finishStart(void);
+	void fitDrift(void);
 	int	getAvailable();
+	void getTrainData(PulseTrainData *pTrain);
+	shared_ptr<ITC18StimDevice> groupLeader(void);
+	void groupMembers(vector<shared_ptr<ITC18StimDevice> > *pMembers);
+	static const SetKernels *kernelsForChannels(long numChannels);
 	bool loadInstructionsFromTrainData(PulseTrainData *, long);
+	bool makeBatchTrain(const list<BatchEntry> &batch, CompiledTrain *pCompiled);
+	bool makeTrainRuns(PulseTrainData *pTrain, const TrainLayout *pLayout, CompiledTrain *pCompiled);
+	bool makeTrainSamples(PulseTrainData *pTrain, long activeChannels, CompiledTrain *pCompiled, 
+						  const TimingPlan *pBatchPlan = NULL);
+	bool makeWaveformTrain(PulseTrainData *pTrain, long activeChannels, CompiledTrain *pCompiled);
+	bool openWaveform(void);
+	bool patchCachedTrain(PulseTrainData *pTrain, long activeChannels, CompiledTrain *pCompiled);
+	bool prepareStart(void);
+	void recordLatency(long stage, MWTime startUS);
+	void recoverFromOverflow(MWTime nowUS);
 	void replaceShortsInRange(short *buffer, short *replacement, long offset, long numShorts);
+	void reportFIFOHealth(bool overflowed);
+	void reportLatency(bool toConsole);
+	void reportPulseOnsets(double trainStartUS);
+	void scheduleEndPolling(MWTime endInUS);
+	void schedulePolling(MWTime firstPollUS, MWTime pollPeriodUS);
+	void scheduleReprime(MWTime delayUS);
+	void setOptionalValue(const boost::shared_ptr <Variable> &variable, const Datum &value);
+	bool startGroup(void);
+	void startVerification(void);
+	void startITC18(void);
+	void tileShortsInRange(short *buffer, short *pattern, long offset, long patternLength, long repeats);
+	bool uploadTrain(const CompiledTrain &compiled);
+	int writeTrainToFIFO(long maxSamples);
     
 public:
 	
@@ -98,7 +396,9 @@ public:
 					const boost::shared_ptr <Variable> _pulse_amplitude,
 					const boost::shared_ptr <Variable> _pulse_width_us,
 					const boost::shared_ptr <Variable> _pulse_freq_hz,
-					const boost::shared_ptr <Variable> _ua_per_v);
+					const boost::shared_ptr <Variable> _ua_per_v,
+					const ITC18StimOptions &_options,
+					const map<string, boost::shared_ptr <Variable> > &_optionalVariables);
 	ITC18StimDevice(const ITC18StimDevice& copy);
 	~ITC18StimDevice();
 	
@@ -109,12 +409,21 @@ public:
 	virtual bool startStimulus();
 	virtual bool stopDeviceIO();		
 	virtual bool stopStimulus();		
+	bool stopStimulusAt(MWTime stopTimeUS);
 	
+	void armNextTrain(void);
 	void changeRunState(void);
+	void clearTrainQueue(void);
+	void enqueueTrain(PulseTrainData *pTrains, long intervalMS);
 	void loadInstructions(void);
+	void primeGroup(void);
+	void publishADData(void);
+	void queueCurrentTrain(void);
 	bool readData(void);
 	void markParametersDirty(void);
+	void reprime(void);
 	void variableSetup();
+	void verifyTrain(boost::shared_ptr<VerifyJob> pJob);
 
 	shared_ptr<ITC18StimDevice> shared_from_this() { 
 		return static_pointer_cast<ITC18StimDevice>(IODevice::shared_from_this());
@@ -132,7 +441,7 @@ public:
 	}
 	virtual void notify(const Datum &data, MWTime timeUS){
 		shared_ptr<ITC18StimDevice> shared_daq(daq);
-		shared_daq->loadInstructions();
+		shared_daq->primeGroup();
 	}
 };
 
@@ -150,6 +459,20 @@ public:
 	}
 };
 
+class ITC18StimDeviceQueueNotification : public VariableNotification {
+	
+protected:
+	weak_ptr<ITC18StimDevice> daq;
+public:
+	ITC18StimDeviceQueueNotification(weak_ptr<ITC18StimDevice> _daq){
+		daq = _daq;
+	}
+	virtual void notify(const Datum &data, MWTime timeUS){
+		shared_ptr<ITC18StimDevice> shared_daq(daq);
+		shared_daq->queueCurrentTrain();
+	}
+};
+
 class ITC18StimDeviceVariableNotification : public VariableNotification {
 	
 protected:
@@ -9,9 +9,66 @@
 
 #include "ITC18StimDeviceFactory.h"
 #include "ITC18StimDevice.h"
+#include <stdio.h>
+
+#define kDefaultTrainCacheMB	16
+#define kDefaultWaveformRateHz	10000
 
 //using namespace mw;
 
+// Settings that are not variables are given as plain attributes.  A missing attribute leaves the setting off.
+
+static bool booleanAttribute(std::map<std::string, std::string> &parameters, const char *name) {
+	
+	std::map<std::string, std::string>::iterator entry = parameters.find(name);
+	
+	if (entry == parameters.end()) {
+		return false;
+	}
+	return (entry->second == "1" || entry->second == "true" || entry->second == "YES" || entry->second == "yes");
+}
+
+static long longAttribute(std::map<std::string, std::string> &parameters, const char *name, long defaultValue) {
+	
+	std::map<std::string, std::string>::iterator entry = parameters.find(name);
+	
+	return (entry == parameters.end() || entry->second.empty()) ? defaultValue : atol(entry->second.c_str());
+}
+
+// The DACs for the channels of a waveform file are given as a comma separated list (e.g. "2,0").  Channels that are 
+// not listed go to their own DAC.  Returns the number of channels listed.
+
+static long DAChannelsAttribute(std::map<std::string, std::string> &parameters, const char *name, long *DAChannels) {
+	
+	std::map<std::string, std::string>::iterator entry = parameters.find(name);
+	const char *pList;
+	char *pEnd;
+	long channel, count = 0;
+	
+	for (channel = 0; channel < ITC18_NUMBEROFDACOUTPUTS; channel++) {
+		DAChannels[channel] = channel;
+	}
+	if (entry == parameters.end()) {
+		return 0;
+	}
+	for (pList = entry->second.c_str(); *pList != '\0' && count < ITC18_NUMBEROFDACOUTPUTS; pList = pEnd) {
+		channel = strtol(pList, &pEnd, 10);
+		if (pEnd == pList) {
+			pEnd++;
+			continue;
+		}
+		DAChannels[count++] = max(0L, min(channel, (long)ITC18_NUMBEROFDACOUTPUTS - 1));
+	}
+	return count;
+}
+
+static float floatAttribute(std::map<std::string, std::string> &parameters, const char *name, float defaultValue) {
+	
+	std::map<std::string, std::string>::iterator entry = parameters.find(name);
+	
+	return (entry == parameters.end() || entry->second.empty()) ? defaultValue : atof(entry->second.c_str());
+}
+
 boost::shared_ptr<mw::Component> ITC18StimDeviceFactory::createObject(std::map<std::string, std::string> parameters,
 																	  mw::ComponentRegistry *reg) {
 	
@@ -21,6 +78,14 @@ boost::shared_ptr<mw::Component> ITC18StimDeviceFactory::createObject(std::map<s
 	mw::GenericDataType typeList[] = {M_BOOLEAN, M_BOOLEAN, M_BOOLEAN, M_INTEGER, M_BOOLEAN, M_BOOLEAN, M_INTEGER, 
 		M_INTEGER, M_INTEGER, M_INTEGER};
 	boost::shared_ptr<mw::Variable> variableList[sizeof(attributeList)/sizeof(const char *)];
+	const char *optionalAttributeList[] = {"fifo_underruns", "train_cache_hits", "train_cache_misses", 
+		"achieved_pulse_width_us", "achieved_pulse_freq_hz", "latency_stats", "trigger_armed_time_us", 
+		"stimulus_onset_time_us", "start_skew_us", "queue_train", "inter_train_interval_ms", "batch_train_onset", 
+		"ad_data", "verify_amplitude_error", "verify_pulse_count_error", "verify_offset_us", 
+		"pulse_onsets", "clock_drift_ppm", "fifo_overflows", "fifo_stats"};
+	std::map<std::string, boost::shared_ptr<mw::Variable> > optionalVariables;
+	ITC18StimOptions options;
+	long waveformChannels;
 	
 	for (long index = 0; index < sizeof(attributeList) / sizeof(const char *); index++) {
 		REQUIRE_ATTRIBUTES(parameters, attributeList[index]);
@@ -31,11 +96,54 @@ boost::shared_ptr<mw::Component> ITC18StimDeviceFactory::createObject(std::map<s
 						   attributeList[index], parameters.find(attributeList[index])->second);
 		}
 	}
+	std::vector<std::string> optionalAttributes(optionalAttributeList, 
+						optionalAttributeList + sizeof(optionalAttributeList) / sizeof(const char *));
+	
+	// Channels after the first can have their own train variables, named with the channel number as a suffix
+	
+	for (long channel = 1; channel < ITC18_NUMBEROFDACOUTPUTS; channel++) {
+		for (long index = 3; index < sizeof(attributeList) / sizeof(const char *); index++) {
+			char channelAttribute[128];
+			
+			snprintf(channelAttribute, sizeof(channelAttribute), "%s_%ld", attributeList[index], channel);
+			optionalAttributes.push_back(channelAttribute);
+		}
+	}
+	for (long index = 0; index < optionalAttributes.size(); index++) {
+		const char *attribute = optionalAttributes[index].c_str();
+		
+		if (parameters.find(attribute) != parameters.end()) {
+			optionalVariables[attribute] = reg->getVariable(parameters.find(attribute)->second);
+			checkAttribute(optionalVariables[attribute], parameters.find("reference_id")->second, 
+						   attribute, parameters.find(attribute)->second);
+		}
+	}
+	options.streaming = booleanAttribute(parameters, "streaming");
+	options.simulate = booleanAttribute(parameters, "simulate");
+	options.externalTrigger = booleanAttribute(parameters, "external_trigger");
+	options.batchCodes = booleanAttribute(parameters, "batch_codes");
+	options.deviceIndex = max(0L, longAttribute(parameters, "device_index", 0));
+	if (parameters.find("group") != parameters.end()) {
+		options.group = parameters.find("group")->second;
+	}
+	options.trainCacheMB = longAttribute(parameters, "train_cache_mb", kDefaultTrainCacheMB);
+	options.channels = max(1L, min(longAttribute(parameters, "channels", 1), (long)ITC18_NUMBEROFDACOUTPUTS));
+	options.ADChannels = max(0L, longAttribute(parameters, "ad_channels", 0));
+	options.verifyChannel = max(-1L, longAttribute(parameters, "verify_channel", -1));
+	if (parameters.find("waveform_file") != parameters.end()) {
+		options.waveformFile = parameters.find("waveform_file")->second;
+	}
+	waveformChannels = DAChannelsAttribute(parameters, "waveform_channels", options.waveformDAChannels);
+	if (!options.waveformFile.empty() && waveformChannels > 0) {
+		options.channels = waveformChannels;
+	}
+	options.waveformRateHz = floatAttribute(parameters, "waveform_rate_hz", kDefaultWaveformRateHz);
 	boost::shared_ptr <mw::Scheduler> scheduler = mw::Scheduler::instance(true);
 	noAlternativeDevice = (parameters.find("alt") == parameters.end());
 	
 	boost::shared_ptr <mw::Component> new_daq = boost::shared_ptr<mw::Component>(new ITC18StimDevice(
 				 noAlternativeDevice, scheduler, variableList[0], variableList[1], variableList[2], variableList[3], 
-				 variableList[4], variableList[5], variableList[6], variableList[7], variableList[8], variableList[9]));
+				 variableList[4], variableList[5], variableList[6], variableList[7], variableList[8], variableList[9],
+				 options, optionalVariables));
 	return new_daq;
 }	
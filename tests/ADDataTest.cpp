@@ -0,0 +1,112 @@
+/*
+ *  ADDataTest.cpp
+ *  ITC18StimPlugin tests
+ *
+ *  Checks the AD samples that a train publishes on ad_data.  The software ITC18 loops each DA value back to the AD
+ *  input sampled by the same instruction, so the published samples of each channel must be the channel's train,
+ *  every sample set once and in order, in events that come while the train plays.
+ *
+ */
+
+#include "TestSupport.h"
+#include <math.h>
+
+// Keeps every event published on a variable, with its time
+
+class EventRecorder : public VariableNotification {
+
+public:
+	boost::mutex			lock;
+	vector<Datum>			events;
+	vector<MWTime>			timesUS;
+
+	virtual void notify(const Datum &data, MWTime timeUS) {
+		boost::mutex::scoped_lock locker(lock);
+		events.push_back(data);
+		timesUS.push_back(timeUS);
+	}
+};
+
+// Play the train set by the variables and check the AD samples it publishes against it
+
+static void checkPublishedTrain(const boost::shared_ptr<TestDevice> &device, TestVariables *pVars,
+								const boost::shared_ptr<EventRecorder> &recorder, long ADChannels) {
+
+	PulseTrainData trains[ITC18_NUMBEROFDACOUTPUTS];
+	CompiledTrain compiled;
+	vector<short> expected;
+	long instructionsPerSampleSet, sets = 0;
+	double setPeriodUS;
+
+	device->getTrainData(trains);
+	CHECK(device->makeTrainSamples(trains, device->options.channels, &compiled));
+	expected = compiledSamples(compiled);
+	instructionsPerSampleSet = compiled.channels + 1;
+	setPeriodUS = instructionsPerSampleSet * compiled.ticksPerInstruction * 1.25;
+	{
+		boost::mutex::scoped_lock locker(recorder->lock);
+		recorder->events.clear();
+		recorder->timesUS.clear();
+	}
+	pVars->run->setValue(Datum(true));
+	CHECK(waitForTrainEnd(device, 5000));
+	CHECK(playedOutput(device) == expected);
+
+	boost::mutex::scoped_lock locker(recorder->lock);
+	CHECK(recorder->events.size() > 1);
+	for (size_t index = 0; index < recorder->events.size(); index++) {
+		const Datum &event = recorder->events[index];
+		long eventSets = (long)event.getElement("sets");
+		string samples = event.getElement("samples").getString();
+		const short *pSample = (const short *)samples.data();
+
+		CHECK((long)event.getElement("first_set") == sets);
+		CHECK((long)event.getElement("channels") == ADChannels);
+		CHECK(fabs((double)event.getElement("set_period_us") - setPeriodUS) < setPeriodUS * 0.01);
+		CHECK((long)samples.size() == eventSets * ADChannels * (long)sizeof(short));
+		CHECK(index == 0 || recorder->timesUS[index] > recorder->timesUS[index - 1]);
+		if ((long)samples.size() != eventSets * ADChannels * (long)sizeof(short)) {
+			break;
+		}
+		for (long set = sets; set < sets + eventSets; set++) {
+			for (long channel = 0; channel < ADChannels; channel++) {
+				if (*pSample++ != expected[set * instructionsPerSampleSet + channel]) {
+					CHECK(!"AD sample differs from the DA value played");
+					return;
+				}
+			}
+		}
+		sets += eventSets;
+	}
+	CHECK(sets * instructionsPerSampleSet == (long)expected.size());
+}
+
+int main(int argc, char *argv[]) {
+
+	boost::shared_ptr<EventRecorder> recorder(new EventRecorder);
+	boost::shared_ptr <Variable> ADData(new Variable);
+
+	ADData->addNotification(recorder);
+	for (long ADChannels = 1; ADChannels <= 3; ADChannels++) {
+		ITC18StimOptions options = testOptions(2);
+		TestVariables vars;
+		boost::shared_ptr<TestDevice> device;
+
+		options.ADChannels = ADChannels;
+		vars.optional["ad_data"] = ADData;
+		vars.optional["pulse_amplitude_1"] = boost::shared_ptr <Variable>(new Variable(Datum(-2.5)));
+		device = makeTestDevice(options, &vars);
+		CHECK(device->itc != NULL);
+		if (device->itc == NULL) {
+			break;
+		}
+
+		// Each train starts the published sets from 0 again
+
+		setTrainParameters(&vars, 300, 50.0, 400, true, 1.5);
+		checkPublishedTrain(device, &vars, recorder, ADChannels);
+		setTrainParameters(&vars, 200, 20.0, 1000, false, 3.0);
+		checkPublishedTrain(device, &vars, recorder, ADChannels);
+	}
+	return testResult("ADDataTest");
+}
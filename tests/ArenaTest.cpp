@@ -0,0 +1,90 @@
+/*
+ *  ArenaTest.cpp
+ *  ITC18StimPlugin tests
+ *
+ *  Checks the train arena: a train's buffer goes back to the arena when the train is dropped and is reused by the 
+ *  next train of its size, so that once the arena is warm priming allocates nothing, and the arena's high water mark
+ *  is reported.
+ *
+ */
+
+#include "TestSupport.h"
+
+// Build a one channel train of the given duration, without going through the train cache
+
+static bool makeDuration(const boost::shared_ptr<TestDevice> &device, long durationMS, CompiledTrain *pCompiled) {
+
+	PulseTrainData trains[ITC18_NUMBEROFDACOUTPUTS];
+
+	device->getTrainData(trains);
+	trains[0].durationMS = durationMS;
+	return device->makeTrainSamples(trains, 1, pCompiled);
+}
+
+static long long madeBytes(const boost::shared_ptr<TestDevice> &device) {
+
+	boost::mutex::scoped_lock lock(device->latencyLock);
+	return device->madeTrainBytes;
+}
+
+int main(int argc, char *argv[]) {
+
+	ITC18StimOptions options = testOptions(1);
+	TestVariables vars;
+	boost::shared_ptr<TestDevice> device;
+	CompiledTrain first, second, held[8];
+	long long bytes, heldBytes;
+	short *pBlock;
+	Datum stats;
+
+	options.trainCacheMB = 0;
+	vars.optional["latency_stats"] = boost::shared_ptr <Variable>(new Variable(Datum()));
+	device = makeTestDevice(options, &vars);
+
+	// A dropped train's block is reused by the next train of its size, with nothing allocated
+
+	CHECK(makeDuration(device, 200, &first));
+	pBlock = first.samples.get();
+	first = CompiledTrain();
+	bytes = madeBytes(device);
+	CHECK(makeDuration(device, 210, &second));
+	CHECK(second.samples.get() == pBlock);
+	CHECK(madeBytes(device) == bytes);
+	CHECK(second.sampleCapacity >= second.bufferLengthSamples);
+
+	// Trains that are all held need a block each.  When they are dropped the arena keeps only a few of them.
+
+	second = CompiledTrain();
+	for (long train = 0; train < 8; train++) {
+		CHECK(makeDuration(device, 200 + train, &held[train]));
+	}
+	heldBytes = device->trainArena->bytesHeld;
+	CHECK(device->trainArena->highWaterBytes >= heldBytes);
+	CHECK(madeBytes(device) > bytes);
+	for (long train = 0; train < 8; train++) {
+		held[train] = CompiledTrain();
+	}
+	CHECK(device->trainArena->bytesHeld < heldBytes);
+	CHECK(device->trainArena->highWaterBytes >= heldBytes);
+
+	// Priming back and forth between two trains allocates nothing once the arena is warm
+
+	for (long prime = 0; prime < 4; prime++) {
+		vars.trainDurationMS->setValue(Datum(300L + 50 * (prime % 2)));
+		device->loadInstructions();
+	}
+	bytes = madeBytes(device);
+	for (long prime = 0; prime < 20; prime++) {
+		vars.trainDurationMS->setValue(Datum(300L + 50 * (prime % 2)));
+		device->loadInstructions();
+	}
+	CHECK(madeBytes(device) == bytes);
+
+	// The high water mark and the bytes allocated are reported with the latency statistics
+
+	device->reportLatency(false);
+	stats = vars.optional["latency_stats"]->getValue();
+	CHECK((long long)stats.getElement("arena_high_water_bytes") == device->trainArena->highWaterBytes);
+	CHECK((long long)stats.getElement("make_bytes") == madeBytes(device));
+	return testResult("ArenaTest");
+}
@@ -0,0 +1,54 @@
+/*
+ *  ArmingTest.cpp
+ *  ITC18StimPlugin tests
+ *
+ *  Checks that one arming thread builds the next train for every train that starts, from the parameters as they are
+ *  while the current train plays, and that it ends with the device.
+ *
+ */
+
+#include "TestSupport.h"
+
+int main(int argc, char *argv[]) {
+
+	TestVariables vars;
+	boost::shared_ptr<TestDevice> device;
+	boost::thread::id armThreadID;
+	PulseTrainData trains[ITC18_NUMBEROFDACOUTPUTS];
+	CompiledTrain compiled;
+	long generation;
+
+	device = makeTestDevice(testOptions(1), &vars);
+	setTrainParameters(&vars, 150, 40.0, 300, true, 2.0);
+	for (long train = 0; train < 5; train++) {
+		vars.run->setValue(Datum(true));
+		boost::this_thread::sleep(boost::posix_time::milliseconds(50));
+		if (train == 0) {
+			armThreadID = device->armThread.get_id();
+		}
+		CHECK(device->armThread.get_id() == armThreadID);
+
+		// Change the parameters while the train plays.  The next train is armed with them and played next.
+
+		vars.trainDurationMS->setValue(Datum(100L + 10 * train));
+		boost::this_thread::sleep(boost::posix_time::milliseconds(50));
+		{
+			boost::mutex::scoped_lock lock(device->armedTrainLock);
+			generation = device->parameterGeneration;
+			CHECK(device->armedTrainReady && device->armedGeneration == generation);
+		}
+		CHECK(waitForTrainEnd(device, 5000));
+		CHECK(waitForPrime(device, 1000) && device->primedGeneration == generation);
+		device->getTrainData(trains);
+		CHECK(device->makeTrainSamples(trains, 1, &compiled));
+		vars.run->setValue(Datum(true));
+		CHECK(waitForTrainEnd(device, 5000));
+		CHECK(playedOutput(device) == compiledSamples(compiled));
+	}
+	CHECK(armThreadID != boost::thread::id());
+
+	// The arming thread is waiting for the next train.  Dropping the device must end it.
+
+	device.reset();
+	return testResult("ArmingTest");
+}
@@ -0,0 +1,178 @@
+/*
+ *  BatchTest.cpp
+ *  ITC18StimPlugin tests
+ *
+ *  Checks a batch of three trains queued with queue_train and played as one sequence on the software ITC18.  From
+ *  the looped back output: each train carries its number on the batch code bits while its gate is open, and is
+ *  followed by a gap of its inter_train_interval_ms.  The onsets of the trains (batchStartSets, batch_train_onset)
+ *  must be where the trains are.  Without batch_codes, or when the trains use the code bits, no code is played.
+ *
+ */
+
+#include "TestSupport.h"
+#include <math.h>
+
+#define kBatchTrains			3
+#define kCodeShift				8					// kBatchCodeShift
+#define kCodeBits				0xff00
+#define kGatePorchMS			25					// as set by getTrainData
+#define kTickUS					1.25				// ITC18 clock tick
+#define kOnsetToleranceUS		200.0
+
+// Keeps every event published on a variable, with its time
+
+class EventRecorder : public VariableNotification {
+
+public:
+	boost::mutex			lock;
+	vector<Datum>			events;
+	vector<MWTime>			timesUS;
+
+	virtual void notify(const Datum &data, MWTime timeUS) {
+		boost::mutex::scoped_lock locker(lock);
+		events.push_back(data);
+		timesUS.push_back(timeUS);
+	}
+};
+
+typedef struct {
+	long	durationMS;
+	double	frequencyHZ;
+	long	widthUS;
+	long	intervalMS;
+} BatchTrain;
+
+static const BatchTrain batchTrains[kBatchTrains] = {{100, 50.0, 200, 30}, {150, 40.0, 300, 50}, {80, 100.0, 100, 0}};
+
+// Queue the trains of the batch and play it.  The trains queued are put in pBatch.
+
+static vector<short> playBatch(const boost::shared_ptr<TestDevice> &device, TestVariables *pVars,
+							   const boost::shared_ptr<EventRecorder> &onsets, list<BatchEntry> *pBatch) {
+
+	BatchEntry entry;
+
+	{
+		boost::mutex::scoped_lock locker(onsets->lock);
+		onsets->events.clear();
+		onsets->timesUS.clear();
+	}
+	for (long train = 0; train < kBatchTrains; train++) {
+		setTrainParameters(pVars, batchTrains[train].durationMS, batchTrains[train].frequencyHZ,
+						   batchTrains[train].widthUS, true, 1000.0);
+		pVars->optional["inter_train_interval_ms"]->setValue(Datum(batchTrains[train].intervalMS));
+		pVars->optional["queue_train"]->setValue(Datum(true));
+		device->getTrainData(entry.trains);
+		entry.intervalMS = batchTrains[train].intervalMS;
+		pBatch->push_back(entry);
+	}
+	pVars->prime->setValue(Datum(true));
+	pVars->run->setValue(Datum(true));
+	CHECK(waitForTrainEnd(device, 5000));
+	return playedOutput(device);
+}
+
+// Check the layout of a batch that has played, with or without batch codes
+
+static void checkBatch(const boost::shared_ptr<TestDevice> &device, const vector<short> &played,
+					   const list<BatchEntry> &batch, const boost::shared_ptr<EventRecorder> &onsets, bool codes) {
+
+	CompiledTrain compiled;
+	long instructionsPerSampleSet = 2, starts[kBatchTrains], sets[kBatchTrains], firstSet = 0, set, code;
+	double setPeriodUS = device->ticksPerInstruction * kTickUS * instructionsPerSampleSet;
+	long porchSets = kGatePorchMS * 1000.0 / setPeriodUS;
+	short word;
+
+	for (long train = 0; train < kBatchTrains; train++) {
+		starts[train] = firstSet;
+		sets[train] = (long)(batchTrains[train].durationMS * 1000.0 / setPeriodUS) + 2 * porchSets;
+		firstSet += sets[train];
+		if (train + 1 < kBatchTrains) {
+			firstSet += (long)(batchTrains[train].intervalMS * 1000.0 / setPeriodUS);
+		}
+	}
+	CHECK(device->makeBatchTrain(batch, &compiled));
+	CHECK(compiled.batchTrains == kBatchTrains && compiledSamples(compiled) == played);
+	for (long train = 0; train < kBatchTrains && compiled.batchTrains == kBatchTrains; train++) {
+		CHECK(compiled.batchStartSets[train] == starts[train]);
+	}
+	CHECK((long)played.size() == firstSet * instructionsPerSampleSet);
+	if ((long)played.size() != firstSet * instructionsPerSampleSet) {
+		return;
+	}
+
+	// Each train carries its code until the set that closes its gate, and each gap is silent
+
+	for (long train = 0; train < kBatchTrains; train++) {
+		for (set = starts[train]; set < starts[train] + sets[train]; set++) {
+			word = played[set * instructionsPerSampleSet + 1];
+			code = (set < starts[train] + sets[train] - 1 && codes) ? train + 1 : 0;
+			if (((word & kCodeBits) >> kCodeShift) != code) {
+				CHECK(!"batch code differs from the train's number");
+				break;
+			}
+		}
+		for (set = starts[train] + sets[train]; set < ((train + 1 < kBatchTrains) ? starts[train + 1] : 0); set++) {
+			if (played[set * instructionsPerSampleSet] != 0 || played[set * instructionsPerSampleSet + 1] != 0) {
+				CHECK(!"gap between trains is not silent");
+				break;
+			}
+		}
+	}
+
+	// The onset of each train is reported as its number, at its first sample set
+
+	boost::mutex::scoped_lock locker(onsets->lock);
+	CHECK(onsets->events.size() == kBatchTrains);
+	for (size_t train = 0; train < onsets->events.size() && train < kBatchTrains; train++) {
+		CHECK((long)onsets->events[train] == (long)train);
+		CHECK(fabs((onsets->timesUS[train] - onsets->timesUS[0]) - (starts[train] - starts[0]) * setPeriodUS) <
+			  kOnsetToleranceUS);
+	}
+}
+
+int main(int argc, char *argv[]) {
+
+	ITC18StimOptions options = testOptions(1);
+	TestVariables vars;
+	boost::shared_ptr<TestDevice> device;
+	boost::shared_ptr<EventRecorder> onsets(new EventRecorder);
+	list<BatchEntry> batch;
+	BatchEntry entry;
+	CompiledTrain compiled;
+	vector<short> played;
+	long warnings;
+
+	options.batchCodes = true;
+	vars.optional["queue_train"] = boost::shared_ptr <Variable>(new Variable(Datum(false)));
+	vars.optional["inter_train_interval_ms"] = boost::shared_ptr <Variable>(new Variable(Datum(0L)));
+	vars.optional["batch_train_onset"] = boost::shared_ptr <Variable>(new Variable(Datum(-1L)));
+	vars.optional["batch_train_onset"]->addNotification(onsets);
+	device = makeTestDevice(options, &vars);
+	CHECK(device->itc != NULL);
+	if (device->itc == NULL) {
+		return testResult("BatchTest");
+	}
+	played = playBatch(device, &vars, onsets, &batch);
+	checkBatch(device, played, batch, onsets, true);
+	device->options.batchCodes = false;
+	batch.clear();
+	played = playBatch(device, &vars, onsets, &batch);
+	checkBatch(device, played, batch, onsets, false);
+
+	// Trains whose pulse marker is on a code bit are batched without codes
+
+	device->options.batchCodes = true;
+	batch.clear();
+	device->getTrainData(entry.trains);
+	entry.trains[0].pulseMarkerBit = kCodeShift + 1;
+	entry.intervalMS = 10;
+	batch.assign(kBatchTrains, entry);
+	compiled = CompiledTrain();
+	warnings = messageCount(M_MESSAGE_COUNT_WARNING);
+	CHECK(device->makeBatchTrain(batch, &compiled));
+	CHECK(messageCount(M_MESSAGE_COUNT_WARNING) == warnings + 1);
+	for (long run = 0; run < compiled.numRuns; run++) {
+		CHECK((compiled.runs[run].values[1] & ~((0x1 << (kCodeShift + 1)) | 0x1)) == 0);
+	}
+	return testResult("BatchTest");
+}
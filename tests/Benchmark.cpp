@@ -0,0 +1,238 @@
+/*
+ *  Benchmark.cpp
+ *  ITC18StimPlugin tests
+ *
+ *  Times train synthesis and upload on the software ITC18 over a sweep of train parameters.  Each train is loaded
+ *  through loadInstructionsFromTrainData with the train cache off, so every load builds the train.  One JSON object
+ *  is printed per train:
+ *
+ *    build_us		best time to build the train (compileTrain)
+ *    upload_us		best time to write it to the FIFO (uploadTrain)
+ *    load_us		best time for the whole of loadInstructionsFromTrainData
+ *    first_bytes	sample memory allocated by the first build, with the train arena cold
+ *    steady_bytes	sample memory allocated by all the later builds together, 0 once the arena is warm
+ *
+ *  Then, for each number of channels, one object per sample set kernel (see kernelsForChannels), with the best time
+ *  for kKernelSets sample sets of the kernel compiled for the channel count (kernel_us) and of the same loop written
+ *  for any length of sample set (generic_us).
+ *
+ *  Last, for each number of AD channels (with as many DA channels), the AD path: the software ITC18 plays a train
+ *  at the fastest tick rate with nothing reading it for kADBacklogMS, then the backlog is read into the AD ring
+ *  (drainReadFIFO, drain_us) and published on ad_data in one event (publishADData, publish_us).  The fastest repeat
+ *  is printed with its sample sets per second (sets_per_s), next to the target (target_sets_per_s): kADTargetFactor
+ *  times the rate at which the ITC18 makes sample sets, so that keeping up with AD data takes a small part of a core.
+ *
+ *  Usage: Benchmark [repeats]
+ *
+ */
+
+#include "TestSupport.h"
+#include <stdlib.h>
+
+#define kDefaultRepeats		5
+#define kKernelSets			(0x1 << 20)			// about 5 s of a train at the fastest tick rate
+#define kADBacklogMS		1000				// time the read FIFO fills before the AD path is timed
+#define kADTargetFactor		20					// AD throughput target, as a multiple of the fastest set rate
+#define kTickUS				1.25				// ITC18 clock tick
+
+static MWTime nowUS(void) {
+
+	return Clock::instance()->getCurrentTimeUS();
+}
+
+static long long madeBytes(const boost::shared_ptr<TestDevice> &device) {
+
+	boost::mutex::scoped_lock lock(device->latencyLock);
+	return device->madeTrainBytes;
+}
+
+static void benchmarkTrain(const boost::shared_ptr<TestDevice> &device, long channels, long durationMS,
+						   float frequencyHZ, long widthUS, bool biphasic, long repeats) {
+
+	PulseTrainData trains[ITC18_NUMBEROFDACOUTPUTS];
+	CompiledTrain compiled;
+	MWTime startUS, buildUS = -1, uploadUS = -1, loadUS = -1;
+	long long startBytes, firstBytes = 0, steadyBytes = 0;
+	bool loaded = true;
+
+	device->getTrainData(trains);
+	for (long channel = 0; channel < ITC18_NUMBEROFDACOUTPUTS; channel++) {
+		trains[channel].durationMS = durationMS;
+		trains[channel].frequencyHZ = frequencyHZ;
+		trains[channel].pulseWidthUS = widthUS;
+		trains[channel].pulseBiphasic = biphasic;
+		trains[channel].amplitude = 50.0;
+		trains[channel].currentPulses = true;
+	}
+	for (long repeat = 0; repeat < repeats && loaded; repeat++) {
+		startBytes = madeBytes(device);
+		startUS = nowUS();
+		loaded = device->compileTrain(trains, channels, &compiled);
+		buildUS = (buildUS < 0) ? nowUS() - startUS : min(buildUS, nowUS() - startUS);
+		if (repeat == 0) {
+			firstBytes = madeBytes(device) - startBytes;
+		}
+		else {
+			steadyBytes += madeBytes(device) - startBytes;
+		}
+		startUS = nowUS();
+		loaded = loaded && device->uploadTrain(compiled);
+		uploadUS = (uploadUS < 0) ? nowUS() - startUS : min(uploadUS, nowUS() - startUS);
+		compiled = CompiledTrain();
+		startBytes = madeBytes(device);
+		startUS = nowUS();
+		loaded = loaded && device->loadInstructionsFromTrainData(trains, channels);
+		loadUS = (loadUS < 0) ? nowUS() - startUS : min(loadUS, nowUS() - startUS);
+		steadyBytes += madeBytes(device) - startBytes;
+	}
+	printf("{\"channels\": %ld, \"duration_ms\": %ld, \"frequency_hz\": %g, \"width_us\": %ld, \"biphasic\": %s, "
+		   "\"loaded\": %s, \"samples\": %ld, \"ticks_per_instruction\": %ld, \"build_us\": %lld, \"upload_us\": %lld, "
+		   "\"load_us\": %lld, \"first_bytes\": %lld, \"steady_bytes\": %lld}\n", channels, durationMS, frequencyHZ,
+		   widthUS, (biphasic) ? "true" : "false", (loaded) ? "true" : "false", device->bufferLengthSamples,
+		   device->ticksPerInstruction, (long long)buildUS, (long long)uploadUS, (long long)loadUS, firstBytes,
+		   steadyBytes);
+	fflush(stdout);
+}
+
+// Time the sample set kernels for a number of channels against the generic loops
+
+static void benchmarkKernels(long channels, long repeats) {
+
+	const SetKernels *pKernels = TestDevice::kernelsForChannels(channels);
+	long setLength = channels + 1;
+	vector<short> buffer(kKernelSets * setLength), frames(kKernelSets * channels), values(setLength, 0x1234);
+	float scale[ITC18_NUMBEROFDACOUTPUTS] = {0.5, -0.25, 1.0, 0.75};
+	const char *names[] = {"fill_sets", "scale_frames"};
+	MWTime startUS, kernelUS[2], genericUS[2];
+
+	for (long frame = 0; frame < kKernelSets * channels; frame++) {
+		frames[frame] = ((frame / (channels * 100)) % 4 == 0) ? 1000 : 0;		// 100 set pulses every 400 sets
+	}
+	for (long kernel = 0; kernel < 2; kernel++) {
+		kernelUS[kernel] = genericUS[kernel] = -1;
+	}
+	for (long repeat = 0; repeat < repeats; repeat++) {
+		startUS = nowUS();
+		pKernels->fillSets(&buffer[0], &values[0], kKernelSets);
+		kernelUS[0] = (kernelUS[0] < 0) ? nowUS() - startUS : min(kernelUS[0], nowUS() - startUS);
+		startUS = nowUS();
+		genericFillSets(&buffer[0], &values[0], setLength, kKernelSets);
+		genericUS[0] = (genericUS[0] < 0) ? nowUS() - startUS : min(genericUS[0], nowUS() - startUS);
+		startUS = nowUS();
+		pKernels->scaleFrames(&buffer[0], &frames[0], scale, 0x1, 0x2, kKernelSets);
+		kernelUS[1] = (kernelUS[1] < 0) ? nowUS() - startUS : min(kernelUS[1], nowUS() - startUS);
+		startUS = nowUS();
+		genericScaleFrames(&buffer[0], &frames[0], scale, 0x1, 0x2, setLength, kKernelSets);
+		genericUS[1] = (genericUS[1] < 0) ? nowUS() - startUS : min(genericUS[1], nowUS() - startUS);
+	}
+	for (long kernel = 0; kernel < 2; kernel++) {
+		printf("{\"kernel\": \"%s\", \"channels\": %ld, \"sets\": %ld, \"kernel_us\": %lld, \"generic_us\": %lld}\n",
+			   names[kernel], channels, (long)kKernelSets, (long long)kernelUS[kernel], (long long)genericUS[kernel]);
+	}
+	fflush(stdout);
+}
+
+// Counts the sample sets published on ad_data
+
+class SetCounter : public VariableNotification {
+
+public:
+	long	sets;
+
+	SetCounter() : sets(0) {}
+	virtual void notify(const Datum &data, MWTime timeUS) {
+		sets += (long)data.getElement("sets");
+	}
+};
+
+// Time the AD path for a number of AD channels, with as many DA channels.  The repeat with the most sample sets per 
+// second is printed.
+
+static void benchmarkAD(long ADChannels, long repeats) {
+
+	ITC18StimOptions options = testOptions(ADChannels);
+	TestVariables vars;
+	boost::shared_ptr<TestDevice> device;
+	boost::shared_ptr<SetCounter> counter(new SetCounter);
+	PulseTrainData trains[ITC18_NUMBEROFDACOUTPUTS];
+	CompiledTrain compiled;
+	MWTime startUS, drainUS, publishUS, bestDrainUS = 0, bestPublishUS = 0;
+	long bestSets = 0, instructionsPerSampleSet = options.channels + 1;
+	double setsPerS, bestSetsPerS = 0.0, targetSetsPerS;
+
+	options.ADChannels = ADChannels;
+	options.streaming = true;									// the fastest tick rate
+	vars.optional["ad_data"] = boost::shared_ptr <Variable>(new Variable(Datum(0L)));
+	vars.optional["ad_data"]->addNotification(counter);
+	device = makeTestDevice(options, &vars);
+	setTrainParameters(&vars, 2 * kADBacklogMS, 50.0, 300, true, 1000.0);	// whole sets at the fastest rate
+	device->getTrainData(trains);
+	if (device->itc == NULL || !device->compileTrain(trains, options.channels, &compiled) ||
+				!waitForPrime(device, 5000)) {							// no reprime after the parameters changed
+		return;
+	}
+	for (long repeat = 0; repeat < repeats; repeat++) {
+		counter->sets = 0;
+		device->uploadTrain(compiled);
+		device->startITC18();
+		boost::this_thread::sleep(boost::posix_time::milliseconds(kADBacklogMS));
+		startUS = nowUS();
+		device->drainReadFIFO();
+		drainUS = nowUS() - startUS;
+		startUS = nowUS();
+		device->publishADData();
+		publishUS = nowUS() - startUS;
+		setsPerS = counter->sets * 1000000.0 / max((MWTime)1, drainUS + publishUS);
+		if (setsPerS > bestSetsPerS) {
+			bestSetsPerS = setsPerS;
+			bestSets = counter->sets;
+			bestDrainUS = drainUS;
+			bestPublishUS = publishUS;
+		}
+		boost::mutex::scoped_lock lock(device->ITC18DeviceLock);
+		simulatedITC18.StopAndInitialize(device->itc, true, true);
+	}
+	targetSetsPerS = kADTargetFactor * 1000000.0 / (ITC18_MINIMUM_TICKS * kTickUS * instructionsPerSampleSet);
+	printf("{\"ad_channels\": %ld, \"channels\": %ld, \"sets\": %ld, \"drain_us\": %lld, \"publish_us\": %lld, "
+		   "\"sets_per_s\": %.0f, \"target_sets_per_s\": %.0f}\n", ADChannels, options.channels, bestSets,
+		   (long long)bestDrainUS, (long long)bestPublishUS, bestSetsPerS, targetSetsPerS);
+	fflush(stdout);
+}
+
+int main(int argc, char *argv[]) {
+
+	long durationsMS[] = {10, 100, 1000, 5000};
+	float frequenciesHZ[] = {10.0, 100.0, 500.0};
+	long widthsUS[] = {50, 200, 1000};
+	long repeats = (argc > 1) ? atol(argv[1]) : kDefaultRepeats;
+	ITC18StimOptions options = testOptions(ITC18_NUMBEROFDACOUTPUTS);
+	TestVariables vars;
+	boost::shared_ptr<TestDevice> device;
+
+	setMessagesQuiet(true);
+	options.trainCacheMB = 0;
+	device = makeTestDevice(options, &vars);
+	if (device->itc == NULL) {
+		fprintf(stderr, "Benchmark: could not open the software ITC18\n");
+		return 1;
+	}
+	for (long channels = 1; channels <= ITC18_NUMBEROFDACOUTPUTS; channels *= 2) {
+		for (size_t duration = 0; duration < sizeof(durationsMS) / sizeof(durationsMS[0]); duration++) {
+			for (size_t frequency = 0; frequency < sizeof(frequenciesHZ) / sizeof(frequenciesHZ[0]); frequency++) {
+				for (size_t width = 0; width < sizeof(widthsUS) / sizeof(widthsUS[0]); width++) {
+					for (long biphasic = 0; biphasic < 2; biphasic++) {
+						benchmarkTrain(device, channels, durationsMS[duration], frequenciesHZ[frequency],
+									   widthsUS[width], biphasic != 0, repeats);
+					}
+				}
+			}
+		}
+	}
+	for (long channels = 1; channels <= ITC18_NUMBEROFDACOUTPUTS; channels++) {
+		benchmarkKernels(channels, repeats);
+	}
+	for (long ADChannels = 1; ADChannels <= ITC18_NUMBEROFDACOUTPUTS; ADChannels++) {
+		benchmarkAD(ADChannels, repeats);
+	}
+	return 0;
+}
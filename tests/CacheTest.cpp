@@ -0,0 +1,107 @@
+/*
+ *  CacheTest.cpp
+ *  ITC18StimPlugin tests
+ *
+ *  Checks the compiled train cache: repeated trains are hits that share the cached samples, the least recently 
+ *  used trains are evicted to keep within the memory budget, and the hit and miss counts reach their variables.
+ *
+ */
+
+#include "TestSupport.h"
+
+#define kTestCacheMB		1
+
+// Compile a one channel train of the given duration.  Trains of 500-600 ms each take a 256 KB block of the arena.
+
+static bool compileDuration(const boost::shared_ptr<TestDevice> &device, long durationMS, CompiledTrain *pCompiled) {
+
+	PulseTrainData trains[ITC18_NUMBEROFDACOUTPUTS];
+
+	device->getTrainData(trains);
+	trains[0].durationMS = durationMS;
+	return device->compileTrain(trains, 1, pCompiled);
+}
+
+static bool isCached(const boost::shared_ptr<TestDevice> &device, long durationMS) {
+
+	list<CompiledTrain>::iterator entry;
+
+	boost::mutex::scoped_lock lock(device->trainCacheLock);
+	for (entry = device->trainCache.begin(); entry != device->trainCache.end(); entry++) {
+		if (entry->trains[0].durationMS == durationMS) {
+			return true;
+		}
+	}
+	return false;
+}
+
+int main(int argc, char *argv[]) {
+
+	ITC18StimOptions options = testOptions(1);
+	TestVariables vars;
+	boost::shared_ptr<TestDevice> device;
+	CompiledTrain first, second, evicting;
+	long hits, misses, durationMS, oldestMS, nextOldestMS, cachedTrains;
+
+	options.trainCacheMB = kTestCacheMB;
+	vars.optional["train_cache_hits"] = boost::shared_ptr <Variable>(new Variable(Datum(0L)));
+	vars.optional["train_cache_misses"] = boost::shared_ptr <Variable>(new Variable(Datum(0L)));
+	device = makeTestDevice(options, &vars);
+	hits = device->trainCacheHits;
+	misses = device->trainCacheMisses;
+
+	// A repeated train is a hit, and shares the samples of the cached train
+
+	CHECK(compileDuration(device, 500, &first));
+	CHECK(device->trainCacheMisses == misses + 1);
+	CHECK(compileDuration(device, 500, &second));
+	CHECK(device->trainCacheHits == hits + 1);
+	CHECK(second.samples.get() == first.samples.get());
+	CHECK(compiledSamples(second) == compiledSamples(first));
+
+	// Fill the cache until it starts to evict.  It must stay within its budget throughout.
+
+	for (durationMS = 510, cachedTrains = 0; device->trainCache.size() > (size_t)cachedTrains; durationMS += 10) {
+		cachedTrains = device->trainCache.size();
+		CHECK(compileDuration(device, durationMS, &evicting));
+		CHECK(device->trainCacheBytes <= kTestCacheMB * 1024L * 1024L);
+	}
+	CHECK(cachedTrains >= 2);
+
+	// Using the oldest train saves it from eviction, so the next oldest goes instead
+
+	oldestMS = device->trainCache.back().trains[0].durationMS;
+	nextOldestMS = (++device->trainCache.rbegin())->trains[0].durationMS;
+	hits = device->trainCacheHits;
+	CHECK(compileDuration(device, oldestMS, &evicting));
+	CHECK(device->trainCacheHits == hits + 1);
+	CHECK(compileDuration(device, durationMS, &evicting));
+	CHECK(isCached(device, oldestMS));
+	CHECK(!isCached(device, nextOldestMS));
+	CHECK(isCached(device, durationMS));
+	CHECK(device->trainCacheBytes <= kTestCacheMB * 1024L * 1024L);
+
+	// Priming parameters that were primed before goes through the cache
+
+	vars.trainDurationMS->setValue(Datum(585L));
+	device->loadInstructions();
+	vars.trainDurationMS->setValue(Datum(595L));
+	device->loadInstructions();
+	hits = device->trainCacheHits;
+	vars.trainDurationMS->setValue(Datum(585L));
+	device->loadInstructions();
+	CHECK(device->trainCacheHits == hits + 1);
+	CHECK((long)vars.optional["train_cache_hits"]->getValue() == device->trainCacheHits);
+	CHECK((long)vars.optional["train_cache_misses"]->getValue() == device->trainCacheMisses);
+
+	// With no budget nothing is cached
+
+	options.trainCacheMB = 0;
+	vars = TestVariables();
+	device = makeTestDevice(options, &vars);
+	CHECK(compileDuration(device, 500, &first));
+	CHECK(compileDuration(device, 500, &second));
+	CHECK(device->trainCacheHits == 0);
+	CHECK(device->trainCache.empty());
+	return testResult("CacheTest");
+}
@@ -0,0 +1,104 @@
+/*
+ *  DriftTest.cpp
+ *  ITC18StimPlugin tests
+ *
+ *  Checks that the estimate of how far the ITC18 clock drifts from the host clock converges, on a software ITC18
+ *  whose clock is set to drift, after a few trains of ordinary length, and that the drift is warned about once.  On
+ *  one that does not drift, the scatter of the polls is measured.  It must be small enough that the drift noise
+ *  alone gives over a train is well short of the drift that is warned about (kDriftTimeLimitMS), and nothing may be 
+ *  warned about.
+ *
+ */
+
+#include "TestSupport.h"
+#include <math.h>
+
+#define kTrainMS				1000				// trains long enough to be polled as they play
+#define kMaxTrains				10					// by which the estimate must have been used
+#define kTolerancePPM			20.0				// how close the estimate must come
+#define kPollScatterUS			50.0				// poll timing noise that kDriftMinSxx allows for (see fitDrift)
+#define kDriftMinSxx			6e12
+#define kDriftTimeLimitMS		0.010
+#define kNoiseMargin			5.0					// kDriftNoiseMargin
+
+// Play trains on a device whose software ITC18 drifts by driftPPM until the device reports its estimate of the
+// drift, and check the estimate
+
+static void checkDrift(double driftPPM) {
+
+	TestVariables vars;
+	boost::shared_ptr<TestDevice> device;
+	boost::shared_ptr <Variable> clockDriftPPM(new Variable(Datum(1.0e6)));
+	long trains, warnings;
+
+	vars.optional["clock_drift_ppm"] = clockDriftPPM;
+	device = makeTestDevice(testOptions(1), &vars);
+	CHECK(device->itc != NULL);
+	if (device->itc == NULL) {
+		return;
+	}
+	{
+		boost::mutex::scoped_lock lock(device->ITC18DeviceLock);
+		ITC18Sim_SetClockDrift(device->itc, driftPPM);
+	}
+	setTrainParameters(&vars, kTrainMS, 20.0, 200, true, 1000.0);
+	warnings = messageCount(M_MESSAGE_COUNT_WARNING);
+	for (trains = 0; trains < kMaxTrains && (double)clockDriftPPM->getValue() == 1.0e6; trains++) {
+		vars.run->setValue(Datum(true));
+		CHECK(waitForTrainEnd(device, 2 * kTrainMS + 1000));
+	}
+	CHECK(trains > 1);
+	CHECK(fabs((double)clockDriftPPM->getValue() - driftPPM) < kTolerancePPM);
+	CHECK(messageCount(M_MESSAGE_COUNT_WARNING) == warnings + 1);
+	CHECK(ITC18Sim_GetUnderflows(device->itc) == 0);
+}
+
+// Play trains on a device whose software ITC18 does not drift, and check the scatter of the polls of each train
+// about their line against what the drift limits allow for
+
+static void checkScatter(void) {
+
+	TestVariables vars;
+	boost::shared_ptr<TestDevice> device;
+	boost::shared_ptr <Variable> clockDriftPPM(new Variable(Datum(1.0e6)));
+	vector<double> scattersUS;
+	double medianScatterUS, noisePPM;
+	long warnings;
+
+	vars.optional["clock_drift_ppm"] = clockDriftPPM;
+	device = makeTestDevice(testOptions(1), &vars);
+	CHECK(device->itc != NULL);
+	if (device->itc == NULL) {
+		return;
+	}
+	setTrainParameters(&vars, kTrainMS, 20.0, 200, true, 1000.0);
+	warnings = messageCount(M_MESSAGE_COUNT_WARNING);
+	for (long train = 0; train < kMaxTrains; train++) {
+		vars.run->setValue(Datum(true));
+		CHECK(waitForTrainEnd(device, 2 * kTrainMS + 1000));
+		scattersUS.push_back(device->driftScatterUS);				// fitDrift runs before the train ends
+	}
+	sort(scattersUS.begin(), scattersUS.end());
+
+	// The slope of the polls is off by about the scatter over the square root of their spread, which is at least 
+	// kDriftMinSxx once the estimate is used.  Over a train, that is the drift that noise alone gives.  A train now 
+	// and then has a poll held up by the host, so the typical (median) train is compared with the limits.
+
+	medianScatterUS = scattersUS[scattersUS.size() / 2];
+	noisePPM = medianScatterUS / sqrt(kDriftMinSxx) * 1e6;
+	printf("DriftTest: poll scatter %.1f us (%.1f us at most), %.2f ppm, %.4f ms over a %d ms train\n", 
+		   medianScatterUS, scattersUS.back(), noisePPM, noisePPM * kTrainMS / 1e6, kTrainMS);
+	CHECK(medianScatterUS > 0 && scattersUS.back() < kPollScatterUS);
+	CHECK(kNoiseMargin * noisePPM * kTrainMS / 1e6 < kDriftTimeLimitMS);
+	CHECK(fabs((double)clockDriftPPM->getValue()) < kTolerancePPM);
+	CHECK(messageCount(M_MESSAGE_COUNT_WARNING) == warnings);
+}
+
+int main(int argc, char *argv[]) {
+
+	checkDrift(200.0);
+	checkDrift(-150.0);
+	checkDrift(30.0);									// 0.03 ms over a train
+	checkScatter();
+	return testResult("DriftTest");
+}
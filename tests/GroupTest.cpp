@@ -0,0 +1,80 @@
+/*
+ *  GroupTest.cpp
+ *  ITC18StimPlugin tests
+ *
+ *  Checks the start of a group of devices on two software ITC18s.  The two devices that share a run variable must
+ *  both be started by the one start of the group's leader, with the start skew published once, and each must play
+ *  its own train.  A third device in the group, with a run variable of its own, must be left alone until that is set.
+ *
+ */
+
+#include "TestSupport.h"
+
+#define kMaxSkewUS				2000
+
+// Keeps count of the events published on a variable, with the last value
+
+class EventCounter : public VariableNotification {
+
+public:
+	long		events;
+	long long	lastValue;
+
+	EventCounter() : events(0), lastValue(-1) {}
+	virtual void notify(const Datum &data, MWTime timeUS) {
+		events++;
+		lastValue = (long long)data;
+	}
+};
+
+int main(int argc, char *argv[]) {
+
+	ITC18StimOptions options = testOptions(1);
+	TestVariables leaderVars, followerVars, soloVars;
+	boost::shared_ptr<TestDevice> leader, follower, solo;
+	boost::shared_ptr<EventCounter> skews(new EventCounter);
+	PulseTrainData trains[ITC18_NUMBEROFDACOUTPUTS];
+	CompiledTrain leaderTrain, followerTrain;
+
+	options.group = "pair";
+	leaderVars.optional["start_skew_us"] = boost::shared_ptr <Variable>(new Variable(Datum(0L)));
+	leaderVars.optional["start_skew_us"]->addNotification(skews);
+	leader = makeTestDevice(options, &leaderVars);
+	options.deviceIndex = 1;
+	followerVars.run = leaderVars.run;
+	follower = makeTestDevice(options, &followerVars);
+	options.deviceIndex = 2;
+	solo = makeTestDevice(options, &soloVars);
+	CHECK(leader->itc != NULL && follower->itc != NULL && solo->itc != NULL);
+	if (leader->itc == NULL || follower->itc == NULL || solo->itc == NULL) {
+		return testResult("GroupTest");
+	}
+	setTrainParameters(&leaderVars, 100, 50.0, 200, true, 1000.0);
+	setTrainParameters(&followerVars, 150, 100.0, 400, false, -2000.0);
+	CHECK(waitForPrime(leader, 1000) && waitForPrime(follower, 1000) && waitForPrime(solo, 1000));
+	leader->getTrainData(trains);
+	CHECK(leader->makeTrainSamples(trains, 1, &leaderTrain));
+	follower->getTrainData(trains);
+	CHECK(follower->makeTrainSamples(trains, 1, &followerTrain));
+
+	// Both devices on the shared run variable are running once it is set, started within one start of the group
+
+	leaderVars.run->setValue(Datum(true));
+	CHECK(leader->deviceState == kDeviceRunning && follower->deviceState == kDeviceRunning);
+	CHECK(solo->deviceState == kDevicePrimed);
+	CHECK(skews->events == 1);
+	CHECK(skews->lastValue >= 0 && skews->lastValue < kMaxSkewUS);
+	CHECK(follower->startedUS - leader->startedUS == skews->lastValue);
+	CHECK(waitForTrainEnd(leader, 5000) && waitForTrainEnd(follower, 5000));
+	CHECK(playedOutput(leader) == compiledSamples(leaderTrain));
+	CHECK(playedOutput(follower) == compiledSamples(followerTrain));
+
+	// The device with its own run variable starts on its own, without a group start
+
+	CHECK(solo->deviceState == kDevicePrimed);
+	soloVars.run->setValue(Datum(true));
+	CHECK(solo->deviceState == kDeviceRunning);
+	CHECK(skews->events == 1);
+	CHECK(waitForTrainEnd(solo, 5000));
+	return testResult("GroupTest");
+}
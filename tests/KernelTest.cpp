@@ -0,0 +1,57 @@
+/*
+ *  KernelTest.cpp
+ *  ITC18StimPlugin tests
+ *
+ *  Checks the sample set kernels compiled for each number of DA channels (see kernelsForChannels) against the same
+ *  loops written for any length of sample set, on fills and waveform frames of many lengths.
+ *
+ */
+
+#include "TestSupport.h"
+#include <stdlib.h>
+
+#define kMaxSets				5000
+
+static void checkKernels(long numChannels, long numSets) {
+
+	const SetKernels *pKernels = TestDevice::kernelsForChannels(numChannels);
+	long setLength = numChannels + 1;
+	vector<short> values(setLength), frames(numSets * numChannels + 1);
+	vector<short> buffer(numSets * setLength + 1, 0x5555), expected(numSets * setLength + 1, 0x5555);
+	float scale[ITC18_NUMBEROFDACOUTPUTS];
+
+	for (long entry = 0; entry < setLength; entry++) {
+		values[entry] = rand() % 0xffff - 0x7fff;
+	}
+	pKernels->fillSets(&buffer[0], &values[0], numSets);
+	genericFillSets(&expected[0], &values[0], setLength, numSets);
+	CHECK(buffer == expected);								// including the guard past the end
+
+	for (long channel = 0; channel < numChannels; channel++) {
+		scale[channel] = (rand() % 2001 - 1000) / 1000.0;
+	}
+	for (long frame = 0; frame < numSets * numChannels; frame++) {
+		frames[frame] = (rand() % 4 == 0) ? 0 : rand() % 0xffff - 0x7fff;
+	}
+	if (numSets > 2) {
+		for (long channel = 0; channel < numChannels; channel++) {
+			frames[numChannels + channel] = 0;				// a frame that is zero on every channel
+		}
+	}
+	pKernels->scaleFrames(&buffer[0], &frames[0], scale, 0x3, 0x4, numSets);
+	genericScaleFrames(&expected[0], &frames[0], scale, 0x3, 0x4, setLength, numSets);
+	CHECK(buffer == expected);
+}
+
+int main(int argc, char *argv[]) {
+
+	long numSets[] = {0, 1, 2, 31, 32, 33, 64, 1000, 1023, 1024, 1025, kMaxSets};
+
+	srand(18);
+	for (long numChannels = 1; numChannels <= ITC18_NUMBEROFDACOUTPUTS; numChannels++) {
+		for (size_t sets = 0; sets < sizeof(numSets) / sizeof(numSets[0]); sets++) {
+			checkKernels(numChannels, numSets[sets]);
+		}
+	}
+	return testResult("KernelTest");
+}
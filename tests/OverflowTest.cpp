@@ -0,0 +1,64 @@
+/*
+ *  OverflowTest.cpp
+ *  ITC18StimPlugin tests
+ *
+ *  Checks recovery from a read FIFO overflow (see recoverFromOverflow).  The device's reads are stalled by holding
+ *  the driver lock while a train plays, until the software ITC18 has put more entries in its read FIFO than it
+ *  holds.  The device must report the overflow once, prime again, and play the next train.
+ *
+ */
+
+#include "TestSupport.h"
+
+#define kReadFIFOEntries		(0x1 << 20)			// the software ITC18's read FIFO
+#define kTickUS					1.25				// ITC18 clock tick
+
+int main(int argc, char *argv[]) {
+
+	ITC18StimOptions options = testOptions(1);
+	TestVariables vars;
+	boost::shared_ptr<TestDevice> device;
+	boost::shared_ptr <Variable> overflows, stats;
+	PulseTrainData trains[ITC18_NUMBEROFDACOUTPUTS];
+	CompiledTrain compiled;
+	long errors, stallMS;
+
+	options.streaming = true;							// the fastest tick rate, so that the read FIFO fills soonest
+	overflows = vars.optional["fifo_overflows"] = boost::shared_ptr <Variable>(new Variable(Datum(0L)));
+	stats = vars.optional["fifo_stats"] = boost::shared_ptr <Variable>(new Variable(Datum(0L)));
+	device = makeTestDevice(options, &vars);
+	CHECK(device->itc != NULL);
+	if (device->itc == NULL) {
+		return testResult("OverflowTest");
+	}
+	setTrainParameters(&vars, 500, 50.0, 200, true, 1000.0);
+	CHECK(waitForPrime(device, 1000));
+
+	// Stall every read until the read FIFO has overflowed, with some time to spare
+
+	errors = messageCount(M_MESSAGE_COUNT_ERROR);
+	stallMS = kReadFIFOEntries * device->ticksPerInstruction * kTickUS / 1000 + 500;
+	vars.run->setValue(Datum(true));
+	{
+		boost::mutex::scoped_lock lock(device->ITC18DeviceLock);
+		boost::this_thread::sleep(boost::posix_time::milliseconds(stallMS));
+	}
+	CHECK(waitForTrainEnd(device, 1000));
+	CHECK((long)overflows->getValue() == 1);
+	CHECK((bool)stats->getValue().getElement("overflowed"));
+	CHECK(messageCount(M_MESSAGE_COUNT_ERROR) == errors + 1);
+
+	// The device primes again, and plays the next train in full, with no further overflow
+
+	CHECK(waitForPrime(device, 1000));
+	CHECK(device->deviceState == kDevicePrimed);
+	device->getTrainData(trains);
+	CHECK(device->makeTrainSamples(trains, 1, &compiled));
+	vars.run->setValue(Datum(true));
+	CHECK(waitForTrainEnd(device, 5000));
+	CHECK(playedOutput(device) == compiledSamples(compiled));
+	CHECK((long)overflows->getValue() == 1);
+	CHECK(!(bool)stats->getValue().getElement("overflowed"));
+	CHECK(messageCount(M_MESSAGE_COUNT_ERROR) == errors + 1);
+	return testResult("OverflowTest");
+}
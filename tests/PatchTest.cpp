@@ -0,0 +1,105 @@
+/*
+ *  PatchTest.cpp
+ *  ITC18StimPlugin tests
+ *
+ *  Checks that a cached train patched for new amplitudes (see patchCachedTrain) is the train that makeTrainSamples
+ *  builds from scratch for the same parameters, for trains held as samples and as runs, whether the cached train
+ *  is patched in place or copied first, and for pulses that follow one another with no gap.
+ *
+ */
+
+#include "TestSupport.h"
+
+#define kRunsFIFOSize			4096				// small enough that a 1 s train is made as runs
+
+// One change of the scaling parameters of each channel, as amplitude, UAPerV and current or voltage pulses.  A
+// change that leaves the channels with pulses the same can patch the last train.
+
+typedef struct {
+	double	amplitudes[2];
+	double	UAPerV[2];
+	bool	currentPulses[2];
+	bool	patchesLast;
+} Scaling;
+
+// Compile a train with the given scaling through the cache and check it against a train built from scratch
+
+static CompiledTrain checkScaling(const boost::shared_ptr<TestDevice> &device, PulseTrainData *pTrains,
+								  const Scaling &scaling) {
+
+	CompiledTrain compiled, rebuilt;
+
+	for (long channel = 0; channel < 2; channel++) {
+		pTrains[channel].amplitude = scaling.amplitudes[channel];
+		pTrains[channel].UAPerV = scaling.UAPerV[channel];
+		pTrains[channel].currentPulses = scaling.currentPulses[channel];
+	}
+	CHECK(device->compileTrain(pTrains, 2, &compiled));
+	CHECK(device->makeTrainSamples(pTrains, 2, &rebuilt));
+	CHECK(compiledSamples(compiled) == compiledSamples(rebuilt));
+	return compiled;
+}
+
+// Step a train through a series of scalings, first letting each patch go in place, then holding on to each train
+// so that the next patch has to copy it
+
+static void checkPatches(const boost::shared_ptr<TestDevice> &device, long durationMS, long widthUS, bool biphasic,
+						 bool asRuns) {
+
+	Scaling scalings[] = {
+		{{1000.0, 2000.0}, {100.0, 100.0}, {false, false}, false},
+		{{1500.0, 2000.0}, {100.0, 100.0}, {false, false}, true},		// one channel
+		{{-700.0, 2500.0}, {100.0, 100.0}, {false, false}, true},		// sign flip
+		{{40.0, 2500.0}, {50.0, 100.0}, {true, false}, true},			// to current pulses
+		{{40.0, 60.0}, {25.0, 80.0}, {true, true}, true},				// UAPerV only
+		{{40.0, 0.0}, {25.0, 80.0}, {true, true}, false},				// to zero
+		{{0.0, 1.0}, {25.0, 80.0}, {true, false}, false},				// from zero
+		{{3000.0, 1.0}, {25.0, 80.0}, {false, false}, false}
+	};
+	PulseTrainData trains[ITC18_NUMBEROFDACOUTPUTS];
+	CompiledTrain compiled, held;
+	vector<short> heldSamples;
+	const void *pLast;
+
+	device->getTrainData(trains);
+	for (long channel = 0; channel < 2; channel++) {
+		trains[channel].durationMS = durationMS;
+		trains[channel].frequencyHZ = 40.0;
+		trains[channel].pulseWidthUS = widthUS;
+		trains[channel].pulseBiphasic = biphasic;
+		trains[channel].doGate = trains[channel].doPulseMarkers = true;
+	}
+	for (size_t scaling = 0; scaling < sizeof(scalings) / sizeof(scalings[0]); scaling++) {
+		pLast = (compiled.samples != NULL) ? (const void *)compiled.samples.get() : compiled.runs.get();
+		compiled = CompiledTrain();
+		compiled = checkScaling(device, trains, scalings[scaling]);
+		CHECK(compiled.pulseCounts[0] + compiled.pulseCounts[1] > 0 && (compiled.runs != NULL) == asRuns);
+		if (scalings[scaling].patchesLast) {
+			CHECK(((compiled.samples != NULL) ? (const void *)compiled.samples.get() : compiled.runs.get()) == pLast);
+		}
+	}
+	for (size_t scaling = 0; scaling < sizeof(scalings) / sizeof(scalings[0]); scaling++) {
+		held = compiled;
+		heldSamples = compiledSamples(held);
+		compiled = checkScaling(device, trains, scalings[scaling]);
+		CHECK(compiledSamples(held) == heldSamples);
+	}
+}
+
+int main(int argc, char *argv[]) {
+
+	ITC18StimOptions options = testOptions(2);
+	TestVariables vars;
+	boost::shared_ptr<TestDevice> device;
+
+	options.streaming = true;							// the same tick rate whatever the FIFO size
+	device = makeTestDevice(options, &vars);
+	checkPatches(device, 100, 300, true, false);
+	checkPatches(device, 100, 300, false, false);
+	checkPatches(device, 101, 12500, true, false);				// pulses that abut
+	device->FIFOSize = kRunsFIFOSize;
+	checkPatches(device, 1000, 300, true, true);
+	checkPatches(device, 1000, 300, false, true);
+	checkPatches(device, 1001, 12500, true, true);
+	return testResult("PatchTest");
+}
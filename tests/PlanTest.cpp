@@ -0,0 +1,118 @@
+/*
+ *  PlanTest.cpp
+ *  ITC18StimPlugin tests
+ *
+ *  Checks the sample period that planTiming chooses, and the pulse width and frequency it reports, for pulse timing
+ *  that whole sample sets give exactly and for timing that they cannot, with and without streaming.  The reported
+ *  values must be what the train built with the plan plays.  A plan with a large error is warned about once for
+ *  each change of the parameters, and a plan with a small one not at all.
+ *
+ */
+
+#include "TestSupport.h"
+#include <math.h>
+
+#define kTickUS					1.25				// ITC18 clock tick
+#define kWarnFraction			0.01				// kPlanWarnFraction
+
+typedef struct {
+	long	channels;
+	long	durationMS;
+	double	frequencyHZ;
+	long	widthUS;
+	bool	exact;
+} PlanCase;
+
+// Plan a train, build it, and check the plan against the train
+
+static void checkPlan(const PlanCase &test, bool streaming) {
+
+	ITC18StimOptions options = testOptions(test.channels);
+	TestVariables vars;
+	boost::shared_ptr<TestDevice> device;
+	PulseTrainData trains[ITC18_NUMBEROFDACOUTPUTS];
+	CompiledTrain compiled;
+	TimingPlan plan;
+	long warnings, minTicks, setsPerFIFO, instructionsPerSampleSet = test.channels + 1, pulses, widthSets;
+	double sampleSetPeriodUS, trainUS, meanIntervalUS;
+
+	options.streaming = streaming;
+	device = makeTestDevice(options, &vars);
+	CHECK(device->itc != NULL);
+	if (device->itc == NULL) {
+		return;
+	}
+	CHECK(waitForPrime(device, 1000));
+	warnings = messageCount(M_MESSAGE_COUNT_WARNING);
+	setTrainParameters(&vars, test.durationMS, test.frequencyHZ, test.widthUS, false, 1000.0);
+	CHECK(waitForPrime(device, 5000));
+	device->getTrainData(trains);
+	for (long repeat = 0; repeat < 3; repeat++) {
+		CHECK(device->planTiming(trains, test.channels, &plan));
+	}
+	CHECK(device->makeTrainSamples(trains, test.channels, &compiled));
+	CHECK(compiled.samples != NULL && compiled.ticksPerInstruction == plan.ticksPerInstruction);
+	if (compiled.samples == NULL || compiled.ticksPerInstruction != plan.ticksPerInstruction) {
+		return;
+	}
+
+	// Streaming plans start from the fastest tick rate, others from the fastest at which the train fits the FIFO
+
+	trainUS = (test.durationMS + 2 * trains[0].gatePorchMS) * 1000.0;
+	setsPerFIFO = device->FIFOSize / (instructionsPerSampleSet * 2);
+	minTicks = (streaming) ? ITC18_MINIMUM_TICKS :
+			max((long)ITC18_MINIMUM_TICKS, (long)ceil(trainUS / (kTickUS * setsPerFIFO)));
+	CHECK(plan.ticksPerInstruction >= minTicks);
+	sampleSetPeriodUS = plan.ticksPerInstruction * kTickUS * instructionsPerSampleSet;
+	if (test.exact) {
+		CHECK(plan.ticksPerInstruction == minTicks);
+		CHECK(plan.timingError == 0);
+		CHECK(plan.achievedWidthUS == test.widthUS);
+		CHECK(fabs(plan.achievedFrequencyHZ - test.frequencyHZ) < test.frequencyHZ * 1e-6);
+	}
+	else {
+		CHECK(plan.timingError > 0.001);
+		CHECK(fabs(plan.achievedWidthUS - test.widthUS) <= test.widthUS * plan.timingError * 1.0001);
+	}
+
+	// The first pulse lasts the achieved width, and the pulses come at the achieved frequency on average
+
+	pulses = compiled.pulseCounts[0];
+	CHECK(pulses == (long)((test.durationMS * 1000.0 - test.widthUS) * test.frequencyHZ / 1000000.0) + 1);
+	if (pulses < 2) {
+		return;
+	}
+	for (widthSets = 0; compiled.samples[(compiled.pulseSets[0] + widthSets) * instructionsPerSampleSet] != 0;
+			widthSets++) {}
+	CHECK(fabs(widthSets * sampleSetPeriodUS - plan.achievedWidthUS) < 0.01);
+	meanIntervalUS = (compiled.pulseSets[pulses - 1] - compiled.pulseSets[0]) * sampleSetPeriodUS / (pulses - 1);
+	CHECK(fabs(1000000.0 / meanIntervalUS - plan.achievedFrequencyHZ) < plan.achievedFrequencyHZ * 1e-5);
+	CHECK(fabs(plan.achievedFrequencyHZ - test.frequencyHZ) <= test.frequencyHZ * plan.timingError * 1.0001);
+
+	// However many times the train is planned, a large error is warned about once
+
+	CHECK(messageCount(M_MESSAGE_COUNT_WARNING) - warnings == ((plan.timingError > kWarnFraction) ? 1 : 0));
+	vars.pulseAmplitude->setValue(Datum(500.0));
+	CHECK(waitForPrime(device, 5000));
+	CHECK(device->planTiming(trains, test.channels, &plan));
+	CHECK(messageCount(M_MESSAGE_COUNT_WARNING) - warnings == ((plan.timingError > kWarnFraction) ? 2 : 0));
+}
+
+int main(int argc, char *argv[]) {
+
+	PlanCase tests[] = {
+		{1, 105, 100.0, 200, true},
+		{1, 5005, 100.0, 200, true},									// coarser ticks unless streaming
+		{3, 105, 100.0, 300, true},
+		{1, 105, 300.0, 100, false},									// no whole number of sets per period
+		{1, 105, 100.0, 13, false},										// width much shorter than any sample set
+		{2, 5005, 300.0, 333, false},
+		{4, 505, 70.0, 410, false}
+	};
+
+	for (size_t test = 0; test < sizeof(tests) / sizeof(tests[0]); test++) {
+		checkPlan(tests[test], false);
+		checkPlan(tests[test], true);
+	}
+	return testResult("PlanTest");
+}
@@ -0,0 +1,86 @@
+/*
+ *  PulseOnsetTest.cpp
+ *  ITC18StimPlugin tests
+ *
+ *  Checks the pulse onsets reported after a train (pulse_onsets) against the train parameters, for trains whose
+ *  pulses cannot be told apart by their DA values: a catch train of zero amplitude, and biphasic pulses that fill
+ *  the whole pulse period so that each follows the last with no gap.  The same pulses must be found in a train made
+ *  as runs.
+ *
+ */
+
+#include "TestSupport.h"
+#include <math.h>
+
+#define kRunsFIFOSize			4096				// small enough that the trains are made as runs
+#define kPulseMarkerBit			1					// as set by getTrainData
+#define kGatePorchMS			25
+#define kTickUS					1.25				// ITC18 clock tick
+
+// Play a train and check the onset of each of its pulses against where the parameters put it.  The onsets are on
+// sample sets, so each is up to one sample set after its ideal time.  A train with shared pulse timing needs a 
+// sample set to spare after its last pulse, so the trains are long enough that every pulse in durationMS fits.
+
+static void checkOnsets(const boost::shared_ptr<TestDevice> &device, TestVariables *pVars, long durationMS,
+						double frequencyHZ, long widthUS, bool biphasic, double amplitude) {
+
+	PulseTrainData trains[ITC18_NUMBEROFDACOUTPUTS];
+	CompiledTrain compiled, runs;
+	Datum onsets;
+	string ticks;
+	vector<short> played;
+	long expectedPulses = durationMS * frequencyHZ / 1000.0, instructionsPerSampleSet = 2, set, FIFOSize;
+	double sampleSetPeriodUS, onsetUS, idealUS;
+	const int *pTicks;
+
+	setTrainParameters(pVars, durationMS, frequencyHZ, widthUS, biphasic, amplitude);
+	pVars->run->setValue(Datum(true));
+	CHECK(waitForTrainEnd(device, 5000));
+	played = playedOutput(device);
+	onsets = pVars->optional["pulse_onsets"]->getValue().getElement("onset_ticks");
+	ticks = onsets.getElement(0).getString();
+	CHECK((long)(ticks.size() / sizeof(int)) == expectedPulses);
+	pTicks = (const int *)ticks.data();
+	sampleSetPeriodUS = device->ticksPerInstruction * kTickUS * instructionsPerSampleSet;
+	for (long pulse = 0; pulse < (long)(ticks.size() / sizeof(int)); pulse++) {
+		onsetUS = pTicks[pulse] * kTickUS;
+		idealUS = kGatePorchMS * 1000.0 + pulse * 1000000.0 / frequencyHZ;
+		CHECK(onsetUS >= idealUS - 0.01 && onsetUS < idealUS + sampleSetPeriodUS);
+		set = pTicks[pulse] / (device->ticksPerInstruction * instructionsPerSampleSet);
+		CHECK(set * instructionsPerSampleSet + 1 < (long)played.size() &&
+			  (played[set * instructionsPerSampleSet + 1] & (0x1 << kPulseMarkerBit)) != 0);
+	}
+
+	// The same train made as runs has its pulses at the same sample sets
+
+	device->getTrainData(trains);
+	CHECK(device->makeTrainSamples(trains, 1, &compiled));
+	FIFOSize = device->FIFOSize;
+	device->FIFOSize = kRunsFIFOSize;
+	CHECK(device->makeTrainSamples(trains, 1, &runs));
+	device->FIFOSize = FIFOSize;
+	CHECK(compiled.samples != NULL && runs.runs != NULL);
+	CHECK(runs.pulseCounts[0] == expectedPulses && compiled.pulseCounts[0] == expectedPulses);
+	CHECK(runs.pulseCounts[0] != expectedPulses ||
+		  equal(runs.pulseSets.get(), runs.pulseSets.get() + expectedPulses, compiled.pulseSets.get()));
+}
+
+int main(int argc, char *argv[]) {
+
+	ITC18StimOptions options = testOptions(1);
+	TestVariables vars;
+	boost::shared_ptr<TestDevice> device;
+
+	options.streaming = true;							// the same tick rate whatever the FIFO size
+	vars.optional["pulse_onsets"] = boost::shared_ptr <Variable>(new Variable(Datum(0L)));
+	device = makeTestDevice(options, &vars);
+	CHECK(device->itc != NULL);
+	if (device->itc == NULL) {
+		return testResult("PulseOnsetTest");
+	}
+	checkOnsets(device, &vars, 100, 200.0, 200, false, 0.0);			// catch train
+	checkOnsets(device, &vars, 101, 200.0, 2500, true, 1000.0);		// pulses that abut
+	checkOnsets(device, &vars, 101, 200.0, 2500, true, 0.0);
+	checkOnsets(device, &vars, 200, 40.0, 300, true, 1500.0);
+	return testResult("PulseOnsetTest");
+}
@@ -0,0 +1,54 @@
+/*
+ *  ReprimeTest.cpp
+ *  ITC18StimPlugin tests
+ *
+ *  Checks that an idle device primes itself again once the train parameters stop changing, building the train once
+ *  for a burst of changes, and that the next run plays the train for the latest values.
+ *
+ */
+
+#include "TestSupport.h"
+
+// Trains the device has had to build since it was made
+
+static long cacheMisses(const boost::shared_ptr<TestDevice> &device) {
+
+	boost::mutex::scoped_lock lock(device->trainCacheLock);
+	return device->trainCacheMisses;
+}
+
+int main(int argc, char *argv[]) {
+
+	TestVariables vars;
+	boost::shared_ptr<TestDevice> device;
+	PulseTrainData trains[ITC18_NUMBEROFDACOUTPUTS];
+	CompiledTrain compiled;
+	long misses;
+
+	device = makeTestDevice(testOptions(1), &vars);
+	CHECK(device->itc != NULL);
+	if (device->itc == NULL) {
+		return testResult("ReprimeTest");
+	}
+	CHECK(waitForPrime(device, 1000));
+
+	// A burst of changes, each to a train not built before, is built once, for its last values
+
+	for (long round = 0; round < 3; round++) {
+		misses = cacheMisses(device);
+		for (long change = 0; change < 20; change++) {
+			vars.trainDurationMS->setValue(Datum(50L + 20 * round + change));
+			vars.pulseAmplitude->setValue(Datum(500.0 + 100 * round + change));
+		}
+		CHECK(device->primedGeneration != device->parameterGeneration);
+		CHECK(waitForPrime(device, 1000));
+		CHECK(cacheMisses(device) - misses == 1);
+		device->getTrainData(trains);
+		CHECK(trains[0].durationMS == 50 + 20 * round + 19);
+		CHECK(device->makeTrainSamples(trains, 1, &compiled));
+		vars.run->setValue(Datum(true));
+		CHECK(waitForTrainEnd(device, 5000));
+		CHECK(playedOutput(device) == compiledSamples(compiled));
+	}
+	return testResult("ReprimeTest");
+}
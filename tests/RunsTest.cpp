@@ -0,0 +1,131 @@
+/*
+ *  RunsTest.cpp
+ *  ITC18StimPlugin tests
+ *
+ *  Checks that a train too long for the FIFO, which is kept as runs of identical sample sets, expands to exactly
+ *  the samples the same train gets when it fits, over a grid of train parameters, and that it plays out the same 
+ *  on the software ITC18.
+ *
+ */
+
+#include "TestSupport.h"
+
+#define kSamplesFIFOSize	(0x1 << 26)			// every train fits, so it is built as samples
+#define kRunsFIFOSize		4096				// nearly every train is too long, so it is built as runs
+#define kPlayFIFOSize		(0x1 << 14)
+#define kChunkSets			1000
+
+// Set up trains on every channel.  With separate timing, each channel has its own duration, frequency and width.
+
+static void setTrains(PulseTrainData *pTrains, long durationMS, float frequencyHZ, long widthUS, bool biphasic, 
+					  bool gated, bool separateTiming) {
+
+	for (long channel = 0; channel < ITC18_NUMBEROFDACOUTPUTS; channel++) {
+		PulseTrainData *pTrain = &pTrains[channel];
+		long scale = (separateTiming) ? channel + 1 : 1;
+
+		pTrain->currentPulses = (channel % 2) == 1;
+		pTrain->amplitude = (pTrain->currentPulses) ? 30.0 + channel : -2000.0 + 500.0 * channel;
+		pTrain->doGate = pTrain->doPulseMarkers = gated;
+		pTrain->durationMS = durationMS / scale;
+		pTrain->frequencyHZ = frequencyHZ * scale;
+		pTrain->pulseWidthUS = widthUS * ((separateTiming) ? 1 + channel % 2 : 1);
+		pTrain->pulseBiphasic = biphasic;
+	}
+}
+
+// Build the trains both ways and compare them.  The runs are expanded by the device, as they would be written to 
+// the FIFO, and by the tests' own expansion.  Returns true if the train was built as runs.
+
+static bool checkRuns(const boost::shared_ptr<TestDevice> &device, PulseTrainData *pTrains, long channels) {
+
+	CompiledTrain samples, runs;
+	vector<short> expanded;
+	bool madeSamples, madeRuns;
+	long sets, instructionsPerSampleSet;
+
+	device->FIFOSize = kSamplesFIFOSize;
+	madeSamples = device->makeTrainSamples(pTrains, channels, &samples);
+	device->FIFOSize = kRunsFIFOSize;
+	madeRuns = device->makeTrainSamples(pTrains, channels, &runs);
+	CHECK(madeSamples == madeRuns);
+	if (!madeSamples || !madeRuns || runs.runs == NULL) {
+		return false;
+	}
+	CHECK(samples.samples != NULL);
+	CHECK(runs.bufferLengthSamples == samples.bufferLengthSamples);
+	CHECK(compiledSamples(runs) == compiledSamples(samples));
+	CHECK(device->uploadTrain(runs));
+	instructionsPerSampleSet = runs.channels + 1;
+	sets = runs.bufferLengthSamples / instructionsPerSampleSet;
+	expanded.resize(runs.bufferLengthSamples);
+	for (long set = 0; set < sets; set += kChunkSets) {
+		device->expandRuns(&expanded[set * instructionsPerSampleSet], set, min((long)kChunkSets, sets - set));
+	}
+	CHECK(expanded == compiledSamples(samples));
+	return true;
+}
+
+int main(int argc, char *argv[]) {
+
+	long durationsMS[] = {0, 1, 7, 100, 1000};
+	float frequenciesHZ[] = {0.0, 1.0, 33.3, 100.0, 1000.0};
+	long widthsUS[] = {20, 200, 1000};
+	ITC18StimOptions options = testOptions(ITC18_NUMBEROFDACOUTPUTS);
+	PulseTrainData trains[ITC18_NUMBEROFDACOUTPUTS];
+	TestVariables vars;
+	boost::shared_ptr<TestDevice> device;
+	CompiledTrain samples, runs;
+	long runTrains = 0;
+
+	options.streaming = true;							// the same tick rate whatever the FIFO size
+	options.trainCacheMB = 0;
+	device = makeTestDevice(options, &vars);
+	device->getTrainData(trains);
+	for (long channels = 1; channels <= ITC18_NUMBEROFDACOUTPUTS; channels++) {
+		for (size_t duration = 0; duration < sizeof(durationsMS) / sizeof(durationsMS[0]); duration++) {
+			for (size_t frequency = 0; frequency < sizeof(frequenciesHZ) / sizeof(frequenciesHZ[0]); frequency++) {
+				for (size_t width = 0; width < sizeof(widthsUS) / sizeof(widthsUS[0]); width++) {
+					for (long variant = 0; variant < 8; variant++) {
+						setTrains(trains, durationsMS[duration], frequenciesHZ[frequency], widthsUS[width], 
+								  (variant & 0x1) != 0, (variant & 0x2) != 0, (variant & 0x4) != 0);
+						runTrains += checkRuns(device, trains, channels);
+					}
+				}
+			}
+		}
+	}
+	CHECK(runTrains > 500);
+
+	// Host memory for a long train goes with the number of pulses, not the number of samples
+
+	setTrains(trains, 1000, 20.0, 200, true, true, false);
+	device->FIFOSize = kSamplesFIFOSize;
+	CHECK(device->makeTrainSamples(trains, 2, &samples));
+	device->FIFOSize = kRunsFIFOSize;
+	CHECK(device->makeTrainSamples(trains, 2, &runs));
+	CHECK(runs.numRuns <= 4 * 20 + 4);
+	CHECK(runs.numRuns * sizeof(TrainRun) * 10 < samples.bufferLengthSamples * sizeof(short));
+
+	// A train made of runs plays out on the software ITC18 as the same samples
+
+	options = testOptions(2);
+	options.streaming = true;
+	vars = TestVariables();
+	device = makeTestDevice(options, &vars);
+	{
+		boost::mutex::scoped_lock lock(device->ITC18DeviceLock);
+		simulatedITC18.StopAndInitialize(device->itc, true, true);
+		CHECK(ITC18Sim_SetWriteFIFOSize(device->itc, kPlayFIFOSize) == 0);
+		device->FIFOSize = kPlayFIFOSize;
+	}
+	setTrainParameters(&vars, 1000, 20.0, 200, true, 1500.0);
+	device->getTrainData(trains);
+	CHECK(device->makeTrainSamples(trains, 2, &runs));
+	CHECK(runs.runs != NULL);
+	vars.run->setValue(Datum(true));
+	CHECK(waitForTrainEnd(device, 5000));
+	CHECK(playedOutput(device) == compiledSamples(runs));
+	CHECK(ITC18Sim_GetUnderflows(device->itc) == 0);
+	return testResult("RunsTest");
+}
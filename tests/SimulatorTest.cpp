@@ -0,0 +1,60 @@
+/*
+ *  SimulatorTest.cpp
+ *  ITC18StimPlugin tests
+ *
+ *  Runs trains through the software ITC18 and checks that what it played is the train that makeTrainSamples
+ *  builds for the same parameters, entry for entry.
+ *
+ */
+
+#include "TestSupport.h"
+
+// Run the train set by the device's variables and check what the software ITC18 played
+
+static void checkPlayedTrain(const boost::shared_ptr<TestDevice> &device, TestVariables *pVars) {
+
+	PulseTrainData trains[ITC18_NUMBEROFDACOUTPUTS];
+	CompiledTrain compiled;
+	vector<short> played, expected;
+
+	device->getTrainData(trains);
+	CHECK(device->makeTrainSamples(trains, device->options.channels, &compiled));
+	expected = compiledSamples(compiled);
+	pVars->run->setValue(Datum(true));
+	CHECK(waitForTrainEnd(device, 5000));
+	played = playedOutput(device);
+	CHECK(played.size() == expected.size());
+	CHECK(played == expected);
+	CHECK(ITC18Sim_GetUnderflows(device->itc) == 0);
+}
+
+int main(int argc, char *argv[]) {
+
+	long durationsMS[] = {10, 100};
+	double frequenciesHZ[] = {25.0, 200.0};
+	bool biphasic[] = {false, true};
+
+	for (long channels = 1; channels <= 2; channels++) {
+		TestVariables vars;
+		boost::shared_ptr<TestDevice> device;
+
+		if (channels > 1) {
+			vars.optional["pulse_amplitude_1"] = boost::shared_ptr <Variable>(new Variable(Datum(-2.5)));
+		}
+		device = makeTestDevice(testOptions(channels), &vars);
+		CHECK(device->itc != NULL);
+		if (device->itc == NULL) {
+			break;
+		}
+		for (size_t duration = 0; duration < sizeof(durationsMS) / sizeof(durationsMS[0]); duration++) {
+			for (size_t frequency = 0; frequency < sizeof(frequenciesHZ) / sizeof(frequenciesHZ[0]); frequency++) {
+				for (size_t shape = 0; shape < sizeof(biphasic) / sizeof(biphasic[0]); shape++) {
+					setTrainParameters(&vars, durationsMS[duration], frequenciesHZ[frequency], 300,
+									   biphasic[shape], 1.5);
+					checkPlayedTrain(device, &vars);
+				}
+			}
+		}
+	}
+	return testResult("SimulatorTest");
+}
@@ -0,0 +1,84 @@
+/*
+ *  StreamingTest.cpp
+ *  ITC18StimPlugin tests
+ *
+ *  Streams trains several times longer than the FIFO through the software ITC18, with the FIFO made small so
+ *  that the trains stay short, and checks that they keep the fastest tick rate, play out whole and never run dry.
+ *
+ */
+
+#include "TestSupport.h"
+
+#define kTestFIFOSize		(0x1 << 15)			// 164 ms of one channel at the fastest tick rate
+
+// Shrink the software ITC18's write FIFO.  The next train is compiled for the new size when it is primed.
+
+static void setFIFOSize(const boost::shared_ptr<TestDevice> &device, long entries) {
+
+	boost::mutex::scoped_lock lock(device->ITC18DeviceLock);
+	simulatedITC18.StopAndInitialize(device->itc, true, true);
+	CHECK(ITC18Sim_SetWriteFIFOSize(device->itc, entries) == 0);
+	device->FIFOSize = entries;
+}
+
+int main(int argc, char *argv[]) {
+
+	ITC18StimOptions options = testOptions(1);
+	long durationsMS[] = {400, 1000};
+	TestVariables vars;
+	boost::shared_ptr<TestDevice> device;
+
+	options.streaming = true;
+	vars.optional["fifo_underruns"] = boost::shared_ptr <Variable>(new Variable(Datum(0L)));
+	device = makeTestDevice(options, &vars);
+	CHECK(device->itc != NULL);
+	if (device->itc == NULL) {
+		return testResult("StreamingTest");
+	}
+	setFIFOSize(device, kTestFIFOSize);
+	for (long channels = 1; channels <= 2; channels++) {
+		for (size_t duration = 0; duration < sizeof(durationsMS) / sizeof(durationsMS[0]); duration++) {
+			PulseTrainData trains[ITC18_NUMBEROFDACOUTPUTS];
+			CompiledTrain compiled;
+			vector<short> played, expected;
+
+			setTrainParameters(&vars, durationsMS[duration], 50.0, 300, true, 2.0);
+			device->getTrainData(trains);
+			CHECK(device->makeTrainSamples(trains, device->options.channels, &compiled));
+			CHECK(compiled.ticksPerInstruction == ITC18_MINIMUM_TICKS);
+			CHECK(compiled.bufferLengthSamples > 2 * kTestFIFOSize);
+			expected = compiledSamples(compiled);
+			vars.run->setValue(Datum(true));
+			CHECK(waitForTrainEnd(device, 10000));
+			played = playedOutput(device);
+			CHECK(played == expected);
+			CHECK(ITC18Sim_GetUnderflows(device->itc) == 0);
+			CHECK(device->totalUnderruns == 0);
+		}
+		if (channels == 1) {
+			device.reset();
+			vars = TestVariables();
+			vars.optional["fifo_underruns"] = boost::shared_ptr <Variable>(new Variable(Datum(0L)));
+			options.channels = 2;
+			device = makeTestDevice(options, &vars);
+			setFIFOSize(device, kTestFIFOSize);
+		}
+	}
+	CHECK((long)vars.optional["fifo_underruns"]->getValue() == 0);
+
+	// Starving the feeder must show up in the underrun counters: hold the device lock, which the feeder needs to
+	// write, until the FIFO has had time to drain.
+
+	setTrainParameters(&vars, 1000, 50.0, 300, true, 2.0);
+	vars.run->setValue(Datum(true));
+	boost::this_thread::sleep(boost::posix_time::milliseconds(50));
+	{
+		boost::mutex::scoped_lock lock(device->ITC18DeviceLock);
+		boost::this_thread::sleep(boost::posix_time::milliseconds(200));
+	}
+	CHECK(waitForTrainEnd(device, 10000));
+	CHECK(ITC18Sim_GetUnderflows(device->itc) > 0);
+	CHECK(device->totalUnderruns > 0);
+	CHECK((long)vars.optional["fifo_underruns"]->getValue() > 0);
+	return testResult("StreamingTest");
+}
@@ -0,0 +1,113 @@
+/*
+ *  StressTest.cpp
+ *  ITC18StimPlugin tests
+ *
+ *  Hammers a device from several threads at once, as MWorks notifications and the scheduler would: parameters 
+ *  change, primes are requested and trains are run, all concurrently.  Every train played must be one whole train
+ *  of one parameter set, the device must always be in one of its states, and nothing may deadlock.
+ *
+ */
+
+#include "TestSupport.h"
+#include <algorithm>
+#include <stdlib.h>
+
+#define kStressSeconds		3
+#define kDurations			2
+#define kAmplitudes			2
+
+static const long durationsMS[kDurations] = {20, 45};
+static const double amplitudes[kAmplitudes] = {40.0, 70.0};
+static volatile bool stopping = false;
+
+static void changeParameters(TestVariables *pVars, unsigned int seed) {
+
+	while (!stopping) {
+		if (rand_r(&seed) % 2 == 0) {
+			pVars->trainDurationMS->setValue(Datum(durationsMS[rand_r(&seed) % kDurations]));
+		}
+		else {
+			pVars->pulseAmplitude->setValue(Datum(amplitudes[rand_r(&seed) % kAmplitudes]));
+		}
+		boost::this_thread::sleep(boost::posix_time::microseconds(rand_r(&seed) % 8000));
+	}
+}
+
+static void requestPrimes(TestVariables *pVars, unsigned int seed) {
+
+	while (!stopping) {
+		pVars->prime->setValue(Datum(true));
+		boost::this_thread::sleep(boost::posix_time::microseconds(rand_r(&seed) % 5000));
+	}
+}
+
+static void watchState(const boost::shared_ptr<TestDevice> &device, long *pBadStates) {
+
+	long state;
+
+	while (!stopping) {
+		state = device->deviceState;
+		if (state != kDeviceIdle && state != kDevicePriming && state != kDevicePrimed && state != kDeviceRunning) {
+			(*pBadStates)++;
+		}
+		boost::this_thread::sleep(boost::posix_time::microseconds(100));
+	}
+}
+
+int main(int argc, char *argv[]) {
+
+	TestVariables vars;
+	boost::shared_ptr<TestDevice> device;
+	vector<vector<short> > validTrains;
+	PulseTrainData trains[ITC18_NUMBEROFDACOUTPUTS];
+	CompiledTrain compiled;
+	vector<short> played;
+	long trainsRun = 0, tornTrains = 0, badStates = 0;
+	MWTime endUS;
+
+	device = makeTestDevice(testOptions(2), &vars);
+	vars.currentPulses->setValue(Datum(true));
+	for (long duration = 0; duration < kDurations; duration++) {
+		for (long amplitude = 0; amplitude < kAmplitudes; amplitude++) {
+			vars.trainDurationMS->setValue(Datum(durationsMS[duration]));
+			vars.pulseAmplitude->setValue(Datum(amplitudes[amplitude]));
+			device->getTrainData(trains);
+			CHECK(device->makeTrainSamples(trains, 2, &compiled));
+			validTrains.push_back(compiledSamples(compiled));
+		}
+	}
+
+	boost::thread parameters1(boost::bind(changeParameters, &vars, 1));
+	boost::thread parameters2(boost::bind(changeParameters, &vars, 2));
+	boost::thread primes(boost::bind(requestPrimes, &vars, 3));
+	boost::thread states(boost::bind(watchState, device, &badStates));
+	endUS = Clock::instance()->getCurrentTimeUS() + kStressSeconds * 1000000LL;
+	while (Clock::instance()->getCurrentTimeUS() < endUS) {
+		vars.run->setValue(Datum(true));
+		CHECK(waitForTrainEnd(device, 2000));
+		played = playedOutput(device);
+		if (!played.empty()) {
+			trainsRun++;
+			if (find(validTrains.begin(), validTrains.end(), played) == validTrains.end()) {
+				tornTrains++;
+			}
+		}
+	}
+	stopping = true;
+	parameters1.join();
+	parameters2.join();
+	primes.join();
+	states.join();
+
+	// Once things are quiet the device settles, primed with the latest parameters
+
+	CHECK(waitForTrainEnd(device, 2000));
+	boost::this_thread::sleep(boost::posix_time::milliseconds(100));
+	CHECK(device->deviceState == kDevicePrimed);
+	CHECK(device->primedGeneration == device->parameterGeneration);
+	CHECK(trainsRun > 10);
+	CHECK(tornTrains == 0);
+	CHECK(badStates == 0);
+	printf("StressTest: %ld trains run\n", trainsRun);
+	return testResult("StressTest");
+}
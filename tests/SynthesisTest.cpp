@@ -0,0 +1,151 @@
+/*
+ *  SynthesisTest.cpp
+ *  ITC18StimPlugin tests
+ *
+ *  Checks that the trains makeTrainSamples builds with whole sample set copies are identical to the trains built one
+ *  short at a time, as loadInstructionsFromTrainData used to, across a grid of PulseTrainData parameters.
+ *
+ */
+
+#include "TestSupport.h"
+#include <math.h>
+
+// The train built one short at a time, as loadInstructionsFromTrainData used to, at the given tick rate.  The
+// channels share pulse timing.  The last pulse is clipped to the end of the train, which the old code overran.
+
+static vector<short> referenceTrain(const PulseTrainData *pTrain, long channels, long ticksPerInstruction) {
+
+	short values[ITC18_NUMBEROFDACOUTPUTS + 1], gateAndPulseBits, gateBits;
+	long index, sampleSetsInTrain, sampleSetsPerPhase, sampleSetIndex, sampleSetsPerPulse;
+	long gatePorchUS, sampleSetsInPorch, porchBufferLength, bufferLengthSamples;
+	long pulseCount, durationUS, instructionsPerSampleSet, valueIndex, pulseLength;
+	float sampleSetPeriodUS, instructionPeriodUS, pulsePeriodUS, rangeFraction[ITC18_NUMBEROFDACOUTPUTS];
+	vector<short> pulseValues, trainValues, porchValues;
+
+	instructionsPerSampleSet = channels + 1;
+	gatePorchUS = (pTrain->doGate) ? pTrain->gatePorchMS * 1000.0 : 0;
+	durationUS = pTrain->durationMS * 1000.0;
+	instructionPeriodUS = ticksPerInstruction * 1.25;
+	sampleSetPeriodUS = instructionPeriodUS * instructionsPerSampleSet;
+	sampleSetsPerPhase = round(pTrain->pulseWidthUS / sampleSetPeriodUS);
+	sampleSetsPerPulse = sampleSetsPerPhase * ((pTrain->pulseBiphasic) ? 2 : 1);
+	sampleSetsInPorch = gatePorchUS / sampleSetPeriodUS;
+	sampleSetsInTrain = durationUS / sampleSetPeriodUS;
+	pulsePeriodUS = ((pTrain->frequencyHZ > 0) ? 1.0 / pTrain->frequencyHZ * 1000000.0 : 0);
+	gateBits = ((pTrain->doGate) ? (0x1 << pTrain->gateBit) : 0);
+	gateAndPulseBits = gateBits | ((pTrain->doPulseMarkers) ? (0x1 << pTrain->pulseMarkerBit) : 0);
+
+	if (sampleSetsPerPulse > 0) {
+		for (index = 0; index < channels; index++) {
+			rangeFraction[index] = (pTrain[index].amplitude / pTrain[index].fullRangeV) /
+					((pTrain[index].currentPulses) ? pTrain[index].UAPerV : 1000);
+		}
+		pulseValues.resize(sampleSetsPerPulse * instructionsPerSampleSet);
+		for (index = 0; index < channels; index++) {
+			values[index] = rangeFraction[index] * 0x7fff;
+		}
+		values[index] = gateAndPulseBits;
+		for (sampleSetIndex = 0; sampleSetIndex < sampleSetsPerPhase; sampleSetIndex++) {
+			for (index = 0; index < instructionsPerSampleSet; index++) {
+				pulseValues[sampleSetIndex * instructionsPerSampleSet + index] = values[index];
+			}
+		}
+		if (pTrain->pulseBiphasic) {
+			for (index = 0; index < channels; index++) {
+				values[index] = -rangeFraction[index] * 0x7fff;
+			}
+			values[index] = gateAndPulseBits;
+			for (sampleSetIndex = 0; sampleSetIndex < sampleSetsPerPhase; sampleSetIndex++) {
+				for (index = 0; index < instructionsPerSampleSet; index++) {
+					pulseValues[(sampleSetsPerPhase + sampleSetIndex) * instructionsPerSampleSet + index] =
+							values[index];
+				}
+			}
+		}
+	}
+	bufferLengthSamples = max(sampleSetsInTrain * instructionsPerSampleSet, instructionsPerSampleSet);
+	trainValues.resize(bufferLengthSamples);
+	if (gateBits > 0) {
+		for (index = 0; index < sampleSetsInTrain; index++) {
+			trainValues[index * instructionsPerSampleSet + channels] = gateBits;
+		}
+	}
+	if ((pulsePeriodUS > 0) && (sampleSetsPerPhase > 0)) {
+		for (pulseCount = 0; ; pulseCount++) {
+			sampleSetIndex = pulseCount * pulsePeriodUS / sampleSetPeriodUS;
+			valueIndex = sampleSetIndex * instructionsPerSampleSet;
+			if ((valueIndex + sampleSetsPerPulse * ((pTrain->pulseBiphasic) ? 2 : 1) + 1) >= bufferLengthSamples) {
+				break;
+			}
+			pulseLength = min(sampleSetsPerPulse * instructionsPerSampleSet, bufferLengthSamples - valueIndex);
+			for (index = 0; index < pulseLength; index++) {
+				trainValues[valueIndex + index] = pulseValues[index];
+			}
+		}
+	}
+	if (sampleSetsInPorch > 0) {
+		porchBufferLength = sampleSetsInPorch * instructionsPerSampleSet;
+		porchValues.resize(porchBufferLength);
+		for (index = 0; index < sampleSetsInPorch; index++) {
+			porchValues[index * instructionsPerSampleSet + channels] = gateBits;
+		}
+		trainValues.insert(trainValues.begin(), porchValues.begin(), porchValues.end());
+		trainValues.insert(trainValues.end(), porchValues.begin(), porchValues.end());
+	}
+	trainValues[trainValues.size() - 1] = 0x00;
+	return trainValues;
+}
+
+// Build a train on every channel with the same timing and check it against the reference.  Channels alternate
+// between current and voltage pulses.  Returns false if the device cannot make the train at all.
+
+static bool checkTrain(const boost::shared_ptr<TestDevice> &device, long channels, long durationMS, float frequencyHZ,
+					   long widthUS, bool biphasic, bool gated) {
+
+	PulseTrainData trains[ITC18_NUMBEROFDACOUTPUTS];
+	CompiledTrain compiled;
+
+	device->getTrainData(trains);
+	for (long channel = 0; channel < ITC18_NUMBEROFDACOUTPUTS; channel++) {
+		PulseTrainData *pTrain = &trains[channel];
+
+		pTrain->durationMS = durationMS;
+		pTrain->frequencyHZ = frequencyHZ;
+		pTrain->pulseWidthUS = widthUS;
+		pTrain->pulseBiphasic = biphasic;
+		pTrain->doGate = pTrain->doPulseMarkers = gated;
+		pTrain->currentPulses = (channel % 2) == 0;
+		pTrain->amplitude = (pTrain->currentPulses) ? 40.0 * (channel + 1) : -3000.0 + 1000.0 * channel;
+	}
+	if (!device->makeTrainSamples(trains, channels, &compiled)) {
+		return false;
+	}
+	CHECK(compiledSamples(compiled) == referenceTrain(trains, channels, compiled.ticksPerInstruction));
+	return true;
+}
+
+int main(int argc, char *argv[]) {
+
+	long durationsMS[] = {0, 1, 37, 250, 3000};
+	float frequenciesHZ[] = {0.0, 7.5, 100.0, 333.0};
+	long widthsUS[] = {0, 30, 200, 1000};
+	TestVariables vars;
+	boost::shared_ptr<TestDevice> device;
+	long trains = 0;
+
+	device = makeTestDevice(testOptions(ITC18_NUMBEROFDACOUTPUTS), &vars);
+	for (long channels = 1; channels <= ITC18_NUMBEROFDACOUTPUTS; channels++) {
+		for (size_t duration = 0; duration < sizeof(durationsMS) / sizeof(durationsMS[0]); duration++) {
+			for (size_t frequency = 0; frequency < sizeof(frequenciesHZ) / sizeof(frequenciesHZ[0]); frequency++) {
+				for (size_t width = 0; width < sizeof(widthsUS) / sizeof(widthsUS[0]); width++) {
+					for (long variant = 0; variant < 4; variant++) {
+						trains += checkTrain(device, channels, durationsMS[duration], frequenciesHZ[frequency],
+											 widthsUS[width], (variant & 0x1) != 0, (variant & 0x2) != 0);
+					}
+				}
+			}
+		}
+	}
+	CHECK(trains > 1000);
+	return testResult("SynthesisTest");
+}
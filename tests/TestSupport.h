@@ -0,0 +1,257 @@
+/*
+ *  TestSupport.h
+ *  ITC18StimPlugin tests
+ *
+ *  What the tests share: an ITC18StimDevice running on the software ITC18, with its stimulus variables, and a few
+ *  checks.  Each test is its own program, which prints its failures and exits non-zero if there were any.
+ *
+ */
+
+#pragma once
+
+#include "ITC18StimDevice.h"
+#include <boost/thread.hpp>
+#include <stdio.h>
+#include <string.h>
+
+using namespace mw;
+
+static long testFailures = 0;
+
+#define CHECK(condition)																	\
+	do {																					\
+		if (!(condition)) {																	\
+			testFailures++;																	\
+			fprintf(stderr, "%s:%d: check failed: %s\n", __FILE__, __LINE__, #condition);	\
+		}																					\
+	} while (0)
+
+// Print how a test went, and return its exit status
+
+inline int testResult(const char *testName) {
+
+	if (testFailures == 0) {
+		printf("%s: passed\n", testName);
+		return 0;
+	}
+	printf("%s: %ld checks failed\n", testName, testFailures);
+	return 1;
+}
+
+// The device with its protected members opened up to the tests
+
+class TestDevice : public ITC18StimDevice {
+
+public:
+	TestDevice(const boost::shared_ptr <Scheduler> &a_scheduler, const boost::shared_ptr <Variable> _prime,
+			   const boost::shared_ptr <Variable> _run, const boost::shared_ptr <Variable> _running,
+			   const boost::shared_ptr <Variable> _train_duration_ms, const boost::shared_ptr <Variable> _current_pulses,
+			   const boost::shared_ptr <Variable> _biphasic_pulses, const boost::shared_ptr <Variable> _pulse_amplitude,
+			   const boost::shared_ptr <Variable> _pulse_width_us, const boost::shared_ptr <Variable> _pulse_freq_hz,
+			   const boost::shared_ptr <Variable> _ua_per_v, const ITC18StimOptions &_options,
+			   const map<string, boost::shared_ptr <Variable> > &_optionalVariables) :
+		ITC18StimDevice(true, a_scheduler, _prime, _run, _running, _train_duration_ms, _current_pulses,
+						_biphasic_pulses, _pulse_amplitude, _pulse_width_us, _pulse_freq_hz, _ua_per_v, _options,
+						_optionalVariables) {}
+
+	using ITC18StimDevice::armedGeneration;
+	using ITC18StimDevice::armedTrainLock;
+	using ITC18StimDevice::armedTrainReady;
+	using ITC18StimDevice::armThread;
+	using ITC18StimDevice::bufferLengthSamples;
+	using ITC18StimDevice::bufferLengthSets;
+	using ITC18StimDevice::channels;
+	using ITC18StimDevice::compileTrain;
+	using ITC18StimDevice::deviceState;
+	using ITC18StimDevice::drainReadFIFO;
+	using ITC18StimDevice::driftScatterUS;
+	using ITC18StimDevice::expandRuns;
+	using ITC18StimDevice::FIFOSize;
+	using ITC18StimDevice::getTrainData;
+	using ITC18StimDevice::kernelsForChannels;
+	using ITC18StimDevice::itc;
+	using ITC18StimDevice::ITC18DeviceLock;
+	using ITC18StimDevice::latencyLock;
+	using ITC18StimDevice::loadInstructionsFromTrainData;
+	using ITC18StimDevice::madeTrainBytes;
+	using ITC18StimDevice::makeBatchTrain;
+	using ITC18StimDevice::makeTrainSamples;
+	using ITC18StimDevice::options;
+	using ITC18StimDevice::parameterGeneration;
+	using ITC18StimDevice::planTiming;
+	using ITC18StimDevice::primedGeneration;
+	using ITC18StimDevice::publishADData;
+	using ITC18StimDevice::reportLatency;
+	using ITC18StimDevice::startITC18;
+	using ITC18StimDevice::startedUS;
+	using ITC18StimDevice::ticksPerInstruction;
+	using ITC18StimDevice::totalUnderruns;
+	using ITC18StimDevice::trainArena;
+	using ITC18StimDevice::trainCache;
+	using ITC18StimDevice::trainCacheBytes;
+	using ITC18StimDevice::trainCacheHits;
+	using ITC18StimDevice::trainCacheLock;
+	using ITC18StimDevice::trainCacheMisses;
+	using ITC18StimDevice::uploadTrain;
+	using ITC18StimDevice::verifyRunning;
+	using ITC18StimDevice::verifyTrain;
+};
+
+// The stimulus variables of a test device.  Channels other than channel 0 share channel 0's variables unless one
+// is given in optional, under the plugin's name for it (e.g. "pulse_amplitude_1").
+
+typedef struct {
+	boost::shared_ptr <Variable>				prime;
+	boost::shared_ptr <Variable>				run;
+	boost::shared_ptr <Variable>				running;
+	boost::shared_ptr <Variable>				trainDurationMS;
+	boost::shared_ptr <Variable>				currentPulses;
+	boost::shared_ptr <Variable>				biphasicPulses;
+	boost::shared_ptr <Variable>				pulseAmplitude;
+	boost::shared_ptr <Variable>				pulseWidthUS;
+	boost::shared_ptr <Variable>				pulseFreqHz;
+	boost::shared_ptr <Variable>				UAPerV;
+	map<string, boost::shared_ptr <Variable> >	optional;
+} TestVariables;
+
+// Options for a device on the software ITC18, driving the given number of channels
+
+inline ITC18StimOptions testOptions(long channels) {
+
+	ITC18StimOptions options;
+
+	options.streaming = false;
+	options.trainCacheMB = 64;
+	options.channels = channels;
+	memset(options.waveformDAChannels, 0, sizeof(options.waveformDAChannels));
+	options.waveformRateHz = 0;
+	options.simulate = true;
+	options.externalTrigger = false;
+	options.deviceIndex = 0;
+	options.ADChannels = 0;
+	options.verifyChannel = -1;
+	options.batchCodes = false;
+	return options;
+}
+
+// Set the parameters of the trains on every channel that shares channel 0's variables
+
+inline void setTrainParameters(TestVariables *pVars, long durationMS, double frequencyHZ, long widthUS,
+							   bool biphasic, double amplitude) {
+
+	pVars->trainDurationMS->setValue(Datum(durationMS));
+	pVars->pulseFreqHz->setValue(Datum(frequencyHZ));
+	pVars->pulseWidthUS->setValue(Datum(widthUS));
+	pVars->biphasicPulses->setValue(Datum(biphasic));
+	pVars->pulseAmplitude->setValue(Datum(amplitude));
+}
+
+// Make a device and initialize it as MWorks would, which opens the software ITC18 and primes it.  Variables that
+// are not given are made, with a 100 ms train of 200 us biphasic pulses at 100 Hz, 1 V.
+
+inline boost::shared_ptr<TestDevice> makeTestDevice(const ITC18StimOptions &options, TestVariables *pVars) {
+
+	boost::shared_ptr <Variable> *variables[] = {&pVars->prime, &pVars->run, &pVars->running, &pVars->trainDurationMS,
+			&pVars->currentPulses, &pVars->biphasicPulses, &pVars->pulseAmplitude, &pVars->pulseWidthUS,
+			&pVars->pulseFreqHz, &pVars->UAPerV};
+	Datum initialValues[] = {Datum(false), Datum(false), Datum(false), Datum(100L), Datum(false), Datum(true),
+			Datum(1.0), Datum(200L), Datum(100.0), Datum(100.0)};
+	boost::shared_ptr<TestDevice> device;
+
+	for (size_t index = 0; index < sizeof(variables) / sizeof(variables[0]); index++) {
+		if (*variables[index] == NULL) {
+			*variables[index] = boost::shared_ptr <Variable>(new Variable(initialValues[index]));
+		}
+	}
+	device = boost::shared_ptr<TestDevice>(new TestDevice(Scheduler::instance(), pVars->prime, pVars->run,
+			pVars->running, pVars->trainDurationMS, pVars->currentPulses, pVars->biphasicPulses, pVars->pulseAmplitude,
+			pVars->pulseWidthUS, pVars->pulseFreqHz, pVars->UAPerV, options, pVars->optional));
+	device->initialize();
+	return device;
+}
+
+// Wait for the current train to end.  Returns false if it is still running after timeoutMS.
+
+inline bool waitForTrainEnd(const boost::shared_ptr<TestDevice> &device, long timeoutMS) {
+
+	for (long waitedMS = 0; device->deviceState == kDeviceRunning; waitedMS++) {
+		if (waitedMS >= timeoutMS) {
+			return false;
+		}
+		boost::this_thread::sleep(boost::posix_time::milliseconds(1));
+	}
+	return true;
+}
+
+// Wait until the device has primed the train for the current parameters.  Returns false if it has not after
+// timeoutMS.
+
+inline bool waitForPrime(const boost::shared_ptr<TestDevice> &device, long timeoutMS) {
+
+	for (long waitedMS = 0; device->primedGeneration != device->parameterGeneration; waitedMS++) {
+		if (waitedMS >= timeoutMS) {
+			return false;
+		}
+		boost::this_thread::sleep(boost::posix_time::milliseconds(1));
+	}
+	return true;
+}
+
+// Everything the software ITC18 has played since it was last started
+
+inline vector<short> playedOutput(const boost::shared_ptr<TestDevice> &device) {
+
+	const short *pOutput;
+	long length;
+
+	boost::mutex::scoped_lock lock(device->ITC18DeviceLock);
+	length = ITC18Sim_GetOutput(device->itc, &pOutput);
+	return vector<short>(pOutput, pOutput + length);
+}
+
+// The samples of a compiled pulse train, expanding a train made of runs one sample set at a time
+
+inline vector<short> compiledSamples(const CompiledTrain &compiled) {
+
+	long instructionsPerSampleSet = compiled.channels + 1, run = 0;
+	vector<short> trainSamples;
+
+	if (compiled.samples != NULL) {
+		return vector<short>(compiled.samples.get(), compiled.samples.get() + compiled.bufferLengthSamples);
+	}
+	for (long set = 0; set < compiled.bufferLengthSamples / instructionsPerSampleSet; set++) {
+		while (run + 1 < compiled.numRuns && compiled.runs[run + 1].firstSet <= set) {
+			run++;
+		}
+		trainSamples.insert(trainSamples.end(), compiled.runs[run].values,
+							compiled.runs[run].values + instructionsPerSampleSet);
+	}
+	return trainSamples;
+}
+
+// The sample set loops of SetKernels written for any length of sample set, as the device's loops were before they
+// were compiled for each length
+
+inline void genericFillSets(short *buffer, const short *values, long setLength, long numSets) {
+
+	for (long set = 0; set < numSets; set++) {
+		for (long entry = 0; entry < setLength; entry++) {
+			buffer[set * setLength + entry] = values[entry];
+		}
+	}
+}
+
+inline void genericScaleFrames(short *buffer, const short *pFrames, const float *scale, short gateBits,
+							   short markerBits, long setLength, long numFrames) {
+
+	short anyValue;
+
+	for (long frame = 0; frame < numFrames; frame++) {
+		anyValue = 0;
+		for (long channel = 0; channel < setLength - 1; channel++) {
+			buffer[frame * setLength + channel] = pFrames[frame * (setLength - 1) + channel] * scale[channel];
+			anyValue |= pFrames[frame * (setLength - 1) + channel];
+		}
+		buffer[frame * setLength + setLength - 1] = gateBits | ((anyValue != 0) ? markerBits : 0);
+	}
+}
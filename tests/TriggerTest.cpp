@@ -0,0 +1,84 @@
+/*
+ *  TriggerTest.cpp
+ *  ITC18StimPlugin tests
+ *
+ *  Checks the external trigger start mode on the software ITC18: an armed train plays nothing until its trigger,
+ *  then plays in full, and the times it was armed and started are reported.
+ *
+ */
+
+#include "TestSupport.h"
+
+#define kOnsetToleranceUS		2000				// how far the reported onset may be from the trigger
+#define kSyntheticDelayUS		20000				// trigger delay after the start for the synthetic trigger
+
+// Set how long after an armed start the software ITC18 triggers, < 0 for only on ITC18Sim_Trigger.  Calls to it
+// are made under the driver lock.
+
+static void setTriggerDelay(const boost::shared_ptr<TestDevice> &device, long delayUS) {
+
+	boost::mutex::scoped_lock lock(device->ITC18DeviceLock);
+	ITC18Sim_SetTriggerDelay(device->itc, delayUS);
+}
+
+// Whether timeUS is within kOnsetToleranceUS of expectedUS
+
+static bool nearTime(long long timeUS, long long expectedUS) {
+
+	return timeUS > expectedUS - kOnsetToleranceUS && timeUS < expectedUS + kOnsetToleranceUS;
+}
+
+int main(int argc, char *argv[]) {
+
+	ITC18StimOptions options = testOptions(1);
+	TestVariables vars;
+	boost::shared_ptr<TestDevice> device;
+	boost::shared_ptr <Variable> armedTime, onsetTime;
+	PulseTrainData trains[ITC18_NUMBEROFDACOUTPUTS];
+	CompiledTrain compiled;
+	MWTime triggerUS;
+
+	options.externalTrigger = true;
+	armedTime = vars.optional["trigger_armed_time_us"] = boost::shared_ptr <Variable>(new Variable(Datum(0LL)));
+	onsetTime = vars.optional["stimulus_onset_time_us"] = boost::shared_ptr <Variable>(new Variable(Datum(0LL)));
+	device = makeTestDevice(options, &vars);
+	CHECK(device->itc != NULL);
+	if (device->itc == NULL) {
+		return testResult("TriggerTest");
+	}
+	setTrainParameters(&vars, 50, 100.0, 200, true, 2.0);
+	device->getTrainData(trains);
+	CHECK(device->makeTrainSamples(trains, 1, &compiled));
+
+	// Armed and waiting: the train is running but nothing has played and no onset has been reported
+
+	setTriggerDelay(device, -1);
+	vars.run->setValue(Datum(true));
+	boost::this_thread::sleep(boost::posix_time::milliseconds(100));
+	CHECK(device->deviceState == kDeviceRunning);
+	CHECK(playedOutput(device).empty());
+	CHECK((MWTime)armedTime->getValue() > 0);
+	CHECK((MWTime)onsetTime->getValue() == 0);
+
+	// The trigger starts the train, which plays in full, and its onset is timed from the instruction count
+
+	{
+		boost::mutex::scoped_lock lock(device->ITC18DeviceLock);
+		triggerUS = Clock::instance()->getCurrentTimeUS();
+		ITC18Sim_Trigger(device->itc);
+	}
+	CHECK(waitForTrainEnd(device, 5000));
+	CHECK(playedOutput(device) == compiledSamples(compiled));
+	CHECK(ITC18Sim_GetUnderflows(device->itc) == 0);
+	CHECK((MWTime)onsetTime->getValue() > (MWTime)armedTime->getValue());
+	CHECK(nearTime((MWTime)onsetTime->getValue(), triggerUS));
+
+	// A synthetic trigger that follows the start by a fixed delay gives an onset that much after the arming
+
+	setTriggerDelay(device, kSyntheticDelayUS);
+	vars.run->setValue(Datum(true));
+	CHECK(waitForTrainEnd(device, 5000));
+	CHECK(playedOutput(device) == compiledSamples(compiled));
+	CHECK(nearTime((MWTime)onsetTime->getValue(), (MWTime)armedTime->getValue() + kSyntheticDelayUS));
+	return testResult("TriggerTest");
+}
@@ -0,0 +1,96 @@
+/*
+ *  VerifyTest.cpp
+ *  ITC18StimPlugin tests
+ *
+ *  Checks verifyTrain: a train looped back on the software ITC18 verifies with no errors, and a captured trace that
+ *  is shifted either way, or inverted, is reported as such.
+ *
+ */
+
+#include "TestSupport.h"
+#include <math.h>
+
+#define kLagToleranceSets		0.5					// how far the reported offset may be from the shift
+#define kMaxLagSets				64					// largest offset verifyTrain searches, kVerifyMaxLagSets
+
+// A verification of the given train, with the captured trace shifted by lagSets (positive for captured late) and
+// scaled by gain
+
+static boost::shared_ptr<VerifyJob> makeJob(const CompiledTrain &compiled, long lagSets, double gain) {
+
+	boost::shared_ptr<VerifyJob> pJob(new VerifyJob);
+	vector<short> trainSamples = compiledSamples(compiled);
+
+	pJob->samples = compiled.samples;
+	pJob->numRuns = 0;
+	pJob->sets = compiled.bufferLengthSets;
+	pJob->instructionsPerSampleSet = compiled.channels + 1;
+	pJob->channel = 0;
+	pJob->sampleSetPeriodUS = pJob->instructionsPerSampleSet * compiled.ticksPerInstruction * 1.25;
+	pJob->captured.resize(pJob->sets);
+	for (long set = 0; set < pJob->sets; set++) {
+		if (set - lagSets >= 0 && set - lagSets < pJob->sets) {
+			pJob->captured[set] = gain * trainSamples[(set - lagSets) * pJob->instructionsPerSampleSet];
+		}
+	}
+	return pJob;
+}
+
+int main(int argc, char *argv[]) {
+
+	ITC18StimOptions options = testOptions(1);
+	TestVariables vars;
+	boost::shared_ptr<TestDevice> device;
+	boost::shared_ptr <Variable> amplitudeError, pulseCountError, offsetUS;
+	boost::shared_ptr<VerifyJob> pJob;
+	PulseTrainData trains[ITC18_NUMBEROFDACOUTPUTS];
+	CompiledTrain compiled;
+	long lagsSets[] = {-kMaxLagSets, -40, -7, -1, 0, 3, 50, kMaxLagSets};
+
+	options.verifyChannel = 0;
+	amplitudeError = vars.optional["verify_amplitude_error"] = boost::shared_ptr <Variable>(new Variable(Datum(1.0)));
+	pulseCountError = vars.optional["verify_pulse_count_error"] = boost::shared_ptr <Variable>(new Variable(Datum(1L)));
+	offsetUS = vars.optional["verify_offset_us"] = boost::shared_ptr <Variable>(new Variable(Datum(1.0e6)));
+	device = makeTestDevice(options, &vars);
+	CHECK(device->itc != NULL);
+	if (device->itc == NULL) {
+		return testResult("VerifyTest");
+	}
+
+	// A train looped back by the software ITC18 is captured exactly as it was played
+
+	setTrainParameters(&vars, 200, 25.0, 1000, false, 2000.0);
+	vars.run->setValue(Datum(true));
+	CHECK(waitForTrainEnd(device, 5000));
+	for (long waitedMS = 0; device->verifyRunning && waitedMS < 5000; waitedMS++) {
+		boost::this_thread::sleep(boost::posix_time::milliseconds(1));
+	}
+	CHECK(!device->verifyRunning);
+	CHECK(fabs((double)amplitudeError->getValue()) < 0.001);
+	CHECK((long)pulseCountError->getValue() == 0);
+	CHECK(fabs((double)offsetUS->getValue()) < 1.0);
+
+	// Shifted either way, the captured trace is found at its offset, out to the largest lags searched
+
+	device->getTrainData(trains);
+	CHECK(device->makeTrainSamples(trains, 1, &compiled));
+	CHECK(compiled.samples != NULL);
+	for (size_t lag = 0; lag < sizeof(lagsSets) / sizeof(lagsSets[0]); lag++) {
+		pJob = makeJob(compiled, lagsSets[lag], 0.8);
+		device->verifyTrain(pJob);
+		CHECK(fabs((double)offsetUS->getValue() - lagsSets[lag] * pJob->sampleSetPeriodUS) <
+			  kLagToleranceSets * pJob->sampleSetPeriodUS);
+		CHECK(fabs((double)amplitudeError->getValue() + 0.2) < 0.05);
+		CHECK((long)pulseCountError->getValue() == 0);
+	}
+
+	// An inverted trace correlates negatively at every lag near the pulses.  Its gain is negative wherever the
+	// best lag is found, and its pulses are still counted, by their size.
+
+	pJob = makeJob(compiled, 0, -1.0);
+	device->verifyTrain(pJob);
+	CHECK((double)amplitudeError->getValue() < -1.0);
+	CHECK(fabs((double)offsetUS->getValue()) <= (kMaxLagSets + kLagToleranceSets) * pJob->sampleSetPeriodUS);
+	CHECK((long)pulseCountError->getValue() == 0);
+	return testResult("VerifyTest");
+}
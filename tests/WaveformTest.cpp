@@ -0,0 +1,123 @@
+/*
+ *  WaveformTest.cpp
+ *  ITC18StimPlugin tests
+ *
+ *  Checks playback of a waveform file (see makeWaveformTrain) on the software ITC18: the file is mapped, expanded
+ *  into the FIFO kExpandChunkSets sample sets at a time, and played between the gate porches.  What plays must be
+ *  each frame scaled by its channel's amplitude, with the gate bit throughout and the pulse marker bit on every
+ *  frame that is not zero on all channels, for a file of a few frames and for one of several chunks.
+ *
+ */
+
+#include "TestSupport.h"
+#include <math.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#define kSetPeriodUS			187.5				// a whole number of ticks for one to four channels
+#define kGatePorchMS			25					// as set by getTrainData
+#define kGateBit				0x1
+#define kMarkerBit				0x2
+#define kFullRangeMV			10240.0				// POSITIVEVOLT
+
+// Write frames of channels int16 samples to a temporary file and return its name
+
+static string writeWaveform(const vector<short> &frames) {
+
+	char name[] = "/tmp/WaveformTestXXXXXX";
+	int fileDescriptor = mkstemp(name);
+
+	CHECK(fileDescriptor >= 0);
+	if (fileDescriptor >= 0) {
+		CHECK(write(fileDescriptor, &frames[0], frames.size() * sizeof(short)) ==
+			  (ssize_t)(frames.size() * sizeof(short)));
+		close(fileDescriptor);
+	}
+	return name;
+}
+
+// Play numFrames frames of a waveform file on channels channels and check what the software ITC18 played
+
+static void checkWaveform(long channels, long numFrames) {
+
+	ITC18StimOptions options = testOptions(channels);
+	TestVariables vars;
+	boost::shared_ptr<TestDevice> device;
+	vector<short> frames(numFrames * channels), played, set(channels + 1);
+	double amplitudesMV[] = {2000.0, -1500.0, 700.0, 10240.0};
+	long porchSets = kGatePorchMS * 1000.0 / kSetPeriodUS, sets = numFrames + 2 * porchSets, setLength = channels + 1;
+	short anyValue, word;
+	string fileName;
+
+	srand(numFrames);
+	for (long frame = 0; frame < numFrames; frame++) {
+		for (long channel = 0; channel < channels; channel++) {
+			frames[frame * channels + channel] = (frame % 5 == 2) ? 0 : rand() % 0xffff - 0x7fff;
+		}
+	}
+	if (numFrames > 1) {
+		frames[channels - 1] = 0x7fff;									// full scale either way
+		frames[channels] = -0x7fff;
+	}
+	fileName = writeWaveform(frames);
+	options.waveformFile = fileName;
+	options.waveformRateHz = 1000000.0 / kSetPeriodUS;
+	for (long channel = 1; channel < channels; channel++) {
+		char variableName[64];
+
+		snprintf(variableName, sizeof(variableName), "pulse_amplitude_%ld", channel);
+		vars.optional[variableName] = boost::shared_ptr <Variable>(new Variable(Datum(amplitudesMV[channel])));
+	}
+	vars.pulseAmplitude = boost::shared_ptr <Variable>(new Variable(Datum(amplitudesMV[0])));
+	device = makeTestDevice(options, &vars);
+	CHECK(device->itc != NULL);
+	if (device->itc == NULL) {
+		unlink(fileName.c_str());
+		return;
+	}
+	CHECK(waitForPrime(device, 1000));
+	CHECK(device->bufferLengthSamples == sets * setLength);
+	vars.run->setValue(Datum(true));
+	CHECK(waitForTrainEnd(device, sets * kSetPeriodUS / 1000 + 2000));
+	played = playedOutput(device);
+	unlink(fileName.c_str());
+	CHECK((long)played.size() == sets * setLength);
+	if ((long)played.size() != sets * setLength) {
+		return;
+	}
+
+	// The porches hold the gate open with every DA at zero, and each frame is scaled to its channel's amplitude, 
+	// give or take the rounding of the scale
+
+	for (long index = 0; index < sets; index++) {
+		anyValue = 0;
+		for (long channel = 0; channel < channels; channel++) {
+			if (index < porchSets || index >= porchSets + numFrames) {
+				set[channel] = 0;
+				continue;
+			}
+			set[channel] = frames[(index - porchSets) * channels + channel];
+			anyValue |= set[channel];
+		}
+		for (long channel = 0; channel < channels; channel++) {
+			if (fabs(played[index * setLength + channel] - set[channel] * amplitudesMV[channel] / kFullRangeMV) > 1.0) {
+				CHECK(!"played DA value is not the scaled frame");
+				return;
+			}
+		}
+		word = (index == sets - 1) ? 0 : kGateBit | ((anyValue != 0) ? kMarkerBit : 0);	// the last closes the gate
+		if (played[index * setLength + channels] != word) {
+			CHECK(!"played digital word is not the gate and marker bits of the frame");
+			return;
+		}
+	}
+}
+
+int main(int argc, char *argv[]) {
+
+	checkWaveform(2, 7);
+	checkWaveform(2, 3000);								// several kExpandChunkSets chunks, the last one partial
+	checkWaveform(1, 1024);
+	checkWaveform(4, 2049);
+	return testResult("WaveformTest");
+}
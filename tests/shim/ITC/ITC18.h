@@ -0,0 +1,56 @@
+/*
+ *  ITC18.h
+ *  ITC18StimPlugin tests
+ *
+ *  Stand-in for the Instrutech ITC18 driver header: the constants and calls that ITC18StimDevice and the software 
+ *  ITC18 use.  The tests always run on the software ITC18, which does not decode the sequence instructions, so only 
+ *  their layout matters here.  The driver calls themselves are in ITC18Driver.cpp, and find no ITC18.
+ *
+ */
+
+#pragma once
+
+#define ITC18_NUMBEROFDACOUTPUTS	4L
+#define ITC18_NUMBEROFADCINPUTS		8L
+#define ITC18_MINIMUM_TICKS			4
+#define ITC18_MAXIMUM_TICKS			65535
+#define ITC18_STANDARD				0
+
+#define ITC18_INPUT_AD0				0x0000
+#define ITC18_INPUT_AD1				0x0080
+#define ITC18_INPUT_AD2				0x0100
+#define ITC18_INPUT_AD3				0x0180
+#define ITC18_INPUT_SKIP			0x0780
+#define ITC18_INPUT_UPDATE			0x4000
+
+#define ITC18_OUTPUT_DA0			0x0000
+#define ITC18_OUTPUT_DA1			0x0800
+#define ITC18_OUTPUT_DA2			0x1000
+#define ITC18_OUTPUT_DA3			0x1800
+#define ITC18_OUTPUT_DIGITAL1		0x2800
+#define ITC18_OUTPUT_UPDATE			0x8000
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+int ITC18_Close(void *device);
+int ITC18_GetFIFOReadAvailableOverflow(void *device, int *available, int *overflow);
+int ITC18_GetFIFOSize(void *device);
+int ITC18_GetFIFOWriteAvailable(void *device, int *available);
+int ITC18_GetStructureSize(void);
+int ITC18_Initialize(void *device, int setup);
+int ITC18_Open(void *device, int deviceNumber);
+int ITC18_ReadFIFO(void *device, int length, short *buffer);
+int ITC18_SetDigitalInputMode(void *device, int latch, int invert);
+int ITC18_SetExternalTriggerMode(void *device, int transition, int invert);
+int ITC18_SetSamplingInterval(void *device, int timer, int externalClock);
+int ITC18_SetSequence(void *device, int length, int *instructions);
+int ITC18_Start(void *device, int externalTrigger, int outputEnable, int stopOnOverflow, int reserved);
+int ITC18_Stop(void *device);
+int ITC18_StopAndInitialize(void *device, int stop, int initialize);
+int ITC18_WriteFIFO(void *device, int length, short *buffer);
+
+#ifdef __cplusplus
+}
+#endif
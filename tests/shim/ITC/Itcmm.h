@@ -0,0 +1,11 @@
+/*
+ *  Itcmm.h
+ *  ITC18StimPlugin tests
+ *
+ *  Stand-in for the Instrutech multi-device header: the DA full range
+ *
+ */
+
+#pragma once
+
+#define POSITIVEVOLT				10.24
@@ -0,0 +1,35 @@
+/*
+ *  ITC18Driver.cpp
+ *  ITC18StimPlugin tests
+ *
+ *  The ITC18 driver calls, for a machine with no ITC18.  Every ITC18 fails to open, so a device that is not set to
+ *  simulate runs without hardware, as it would on a Mac with nothing attached.
+ *
+ */
+
+#include "ITC/ITC18.h"
+
+#define kNoITC18		-1
+
+extern "C" {
+
+int ITC18_Close(void *device) { return 0; }
+int ITC18_GetFIFOReadAvailableOverflow(void *device, int *available, int *overflow) { return kNoITC18; }
+int ITC18_GetFIFOSize(void *device) { return 0; }
+int ITC18_GetFIFOWriteAvailable(void *device, int *available) { return kNoITC18; }
+int ITC18_GetStructureSize(void) { return 1; }
+int ITC18_Initialize(void *device, int setup) { return kNoITC18; }
+int ITC18_Open(void *device, int deviceNumber) { return kNoITC18; }
+int ITC18_ReadFIFO(void *device, int length, short *buffer) { return kNoITC18; }
+int ITC18_SetDigitalInputMode(void *device, int latch, int invert) { return kNoITC18; }
+int ITC18_SetExternalTriggerMode(void *device, int transition, int invert) { return kNoITC18; }
+int ITC18_SetSamplingInterval(void *device, int timer, int externalClock) { return kNoITC18; }
+int ITC18_SetSequence(void *device, int length, int *instructions) { return kNoITC18; }
+int ITC18_Start(void *device, int externalTrigger, int outputEnable, int stopOnOverflow, int reserved) {
+	return kNoITC18;
+}
+int ITC18_Stop(void *device) { return kNoITC18; }
+int ITC18_StopAndInitialize(void *device, int stop, int initialize) { return kNoITC18; }
+int ITC18_WriteFIFO(void *device, int length, short *buffer) { return kNoITC18; }
+
+}
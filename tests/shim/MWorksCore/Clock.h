@@ -0,0 +1,23 @@
+/*
+ *  Clock.h
+ *  ITC18StimPlugin tests
+ *
+ *  Stand-in for the MWorksCore clock.  It reads the same host clock as the software ITC18.
+ *
+ */
+
+#pragma once
+
+#include "GenericData.h"
+
+namespace mw {
+
+class Clock {
+
+public:
+	static shared_ptr<Clock> instance(bool failIfMissing = true);
+
+	MWTime getCurrentTimeUS(void);
+};
+
+}
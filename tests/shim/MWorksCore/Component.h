@@ -0,0 +1,61 @@
+/*
+ *  Component.h
+ *  ITC18StimPlugin tests
+ *
+ *  Stand-in for the MWorksCore components and variables used by ITC18StimDevice.  A Variable holds its last value,
+ *  and setting it calls its notifications on the setting thread, as in MWorks.
+ *
+ */
+
+#pragma once
+
+#include "GenericData.h"
+#include <boost/thread/mutex.hpp>
+
+namespace mw {
+
+class Component : public boost::enable_shared_from_this<Component> {
+
+public:
+	std::string		tag;
+
+	virtual ~Component() {}
+
+	template <class T> shared_ptr<T> getSelfPtr() {
+		return dynamic_pointer_cast<T>(shared_from_this());
+	}
+};
+
+class VariableNotification {
+
+public:
+	virtual ~VariableNotification() {}
+	virtual void notify(const Datum &data, MWTime timeUS) = 0;
+};
+
+class Variable : public Component {
+
+protected:
+	Datum										value;
+	std::vector<shared_ptr<VariableNotification> >	notifications;
+	boost::mutex								lock;
+
+public:
+	Variable(const Datum &initialValue = Datum()) : value(initialValue) {}
+
+	virtual Datum getValue();
+	virtual void setValue(Datum newValue);
+	virtual void setValue(Datum newValue, MWTime timeUS);
+	void addNotification(shared_ptr<VariableNotification> notification);
+};
+
+class ConstantVariable : public Variable {
+
+public:
+	ConstantVariable(const Datum &constantValue) : Variable(constantValue) {}
+
+	virtual void setValue(Datum newValue) {}
+	virtual void setValue(Datum newValue, MWTime timeUS) {}
+};
+
+}
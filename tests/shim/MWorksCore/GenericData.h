@@ -0,0 +1,83 @@
+/*
+ *  GenericData.h
+ *  ITC18StimPlugin tests
+ *
+ *  Stand-in for the MWorksCore data types used by ITC18StimDevice.  A Datum holds a number, a string, a list or a
+ *  dictionary, which is all the device publishes.
+ *
+ */
+
+#pragma once
+
+#include <map>
+#include <string>
+#include <vector>
+#include <boost/enable_shared_from_this.hpp>
+#include <boost/function.hpp>
+#include <boost/shared_ptr.hpp>
+#include <boost/weak_ptr.hpp>
+
+namespace mw {
+
+using boost::dynamic_pointer_cast;
+using boost::shared_ptr;
+using boost::static_pointer_cast;
+using boost::weak_ptr;
+
+typedef long long MWTime;
+
+enum GenericDataType {M_UNDEFINED = 0, M_INTEGER, M_FLOAT, M_BOOLEAN, M_STRING, M_LIST, M_DICTIONARY};
+
+class Datum {
+
+	GenericDataType				type;
+	double						number;
+	std::string					text;
+	std::vector<std::string>	keys;						// of a dictionary, one for each element
+	std::vector<Datum>			elements;					// of a list or a dictionary
+
+public:
+	Datum() : type(M_UNDEFINED), number(0) {}
+	Datum(GenericDataType _type, int size) : type(_type), number(0) { elements.reserve(size); }
+	Datum(bool value) : type(M_BOOLEAN), number(value) {}
+	Datum(int value) : type(M_INTEGER), number(value) {}
+	Datum(long value) : type(M_INTEGER), number(value) {}
+	Datum(long long value) : type(M_INTEGER), number(value) {}
+	Datum(float value) : type(M_FLOAT), number(value) {}
+	Datum(double value) : type(M_FLOAT), number(value) {}
+	Datum(const char *value) : type(M_STRING), number(0), text(value) {}
+	Datum(const std::string &value) : type(M_STRING), number(0), text(value) {}
+
+	operator bool() const { return number != 0; }
+	operator int() const { return (int)number; }
+	operator long() const { return (long)number; }
+	operator long long() const { return (long long)number; }
+	operator float() const { return (float)number; }
+	operator double() const { return number; }
+
+	GenericDataType getDataType() const { return type; }
+	bool isUndefined() const { return type == M_UNDEFINED; }
+	std::string getString() const { return text; }
+	int getNElements() const { return elements.size(); }
+
+	void addElement(const Datum &element) {
+		elements.push_back(element);
+	}
+	void addElement(const char *key, const Datum &element) {
+		keys.push_back(key);
+		elements.push_back(element);
+	}
+	Datum getElement(int index) const {
+		return (index >= 0 && index < (int)elements.size()) ? elements[index] : Datum();
+	}
+	Datum getElement(const char *key) const {
+		for (size_t index = 0; index < keys.size(); index++) {
+			if (keys[index] == key) {
+				return elements[index];
+			}
+		}
+		return Datum();
+	}
+};
+
+}
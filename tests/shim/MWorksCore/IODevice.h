@@ -0,0 +1,30 @@
+/*
+ *  IODevice.h
+ *  ITC18StimPlugin tests
+ *
+ *  Stand-in for the MWorksCore IODevice base class
+ *
+ */
+
+#pragma once
+
+#include "Clock.h"
+#include "Component.h"
+#include "Scheduler.h"
+#include "Utilities.h"
+
+namespace mw {
+
+class IODevice : public Component {
+
+public:
+	virtual ~IODevice() {}
+
+	virtual bool startup() { return true; }
+	virtual bool shutdown() { return true; }
+	virtual bool initialize() { return true; }
+	virtual bool startDeviceIO() { return true; }
+	virtual bool stopDeviceIO() { return true; }
+};
+
+}
@@ -0,0 +1,11 @@
+/*
+ *  Plugin.h
+ *  ITC18StimPlugin tests
+ *
+ *  Stand-in for the MWorksCore plugin header.  The tests build the device directly, so nothing here is needed.
+ *
+ */
+
+#pragma once
+
+#include "GenericData.h"
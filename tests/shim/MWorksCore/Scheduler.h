@@ -0,0 +1,45 @@
+/*
+ *  Scheduler.h
+ *  ITC18StimPlugin tests
+ *
+ *  Stand-in for the MWorksCore scheduler.  Each scheduled task runs on its own thread, which sleeps through the
+ *  delay and each period, and stops once the task has run its repeats or has been cancelled.
+ *
+ */
+
+#pragma once
+
+#include "GenericData.h"
+#include <boost/thread/mutex.hpp>
+
+#define M_REPEAT_INDEFINITELY			-999
+#define M_DEFAULT_IODEVICE_PRIORITY		1
+#define M_MISSED_EXECUTION_DROP			1
+#define M_MISSED_EXECUTION_CATCH_UP		2
+
+namespace mw {
+
+class ScheduleTask {
+
+	bool			cancelled;
+	boost::mutex	lock;
+
+public:
+	ScheduleTask() : cancelled(false) {}
+
+	void cancel(void);
+	void kill(void);
+	bool isCancelled(void);
+};
+
+class Scheduler {
+
+public:
+	static shared_ptr<Scheduler> instance(bool failIfMissing = true);
+
+	shared_ptr<ScheduleTask> scheduleUS(const std::string &description, MWTime initialDelayUS, MWTime periodUS,
+										int numRepeats, boost::function<void *()> function, int priority,
+										MWTime warnSlopUS, MWTime failSlopUS, int missedExecutionBehavior);
+};
+
+}
@@ -0,0 +1,28 @@
+/*
+ *  Utilities.h
+ *  ITC18StimPlugin tests
+ *
+ *  Stand-in for the MWorksCore console messages.  Messages go to stderr, and are counted by type so that tests can
+ *  check for warnings and errors.
+ *
+ */
+
+#pragma once
+
+#include "GenericData.h"
+
+#define M_IODEVICE_MESSAGE_DOMAIN	0
+#define FILELINE					__FILE__
+
+namespace mw {
+
+enum {M_MESSAGE_COUNT_PRINTF = 0, M_MESSAGE_COUNT_WARNING, M_MESSAGE_COUNT_ERROR, M_MESSAGE_COUNTS};
+
+void mprintf(const char *format, ...);
+void mwarning(int domain, const char *format, ...);
+void merror(int domain, const char *format, ...);
+
+long messageCount(int type);
+void setMessagesQuiet(bool quiet);
+
+}
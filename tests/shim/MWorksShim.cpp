@@ -0,0 +1,170 @@
+/*
+ *  MWorksShim.cpp
+ *  ITC18StimPlugin tests
+ *
+ *  The parts of MWorksCore that ITC18StimDevice calls: console messages, variables, the clock and the scheduler.
+ *
+ */
+
+#include "MWorksCore/IODevice.h"
+#include <boost/bind.hpp>
+#include <boost/thread.hpp>
+#include <stdarg.h>
+#include <stdio.h>
+#include <sys/time.h>
+
+namespace mw {
+
+static long messageCounts[M_MESSAGE_COUNTS];
+static bool messagesQuiet = false;
+static boost::mutex messageLock;
+
+static void message(int type, const char *prefix, const char *format, va_list arguments) {
+
+	boost::mutex::scoped_lock lock(messageLock);
+	messageCounts[type]++;
+	if (!messagesQuiet) {
+		fprintf(stderr, "%s", prefix);
+		vfprintf(stderr, format, arguments);
+		fprintf(stderr, "\n");
+	}
+}
+
+void mprintf(const char *format, ...) {
+
+	va_list arguments;
+
+	va_start(arguments, format);
+	message(M_MESSAGE_COUNT_PRINTF, "", format, arguments);
+	va_end(arguments);
+}
+
+void mwarning(int domain, const char *format, ...) {
+
+	va_list arguments;
+
+	va_start(arguments, format);
+	message(M_MESSAGE_COUNT_WARNING, "warning: ", format, arguments);
+	va_end(arguments);
+}
+
+void merror(int domain, const char *format, ...) {
+
+	va_list arguments;
+
+	va_start(arguments, format);
+	message(M_MESSAGE_COUNT_ERROR, "error: ", format, arguments);
+	va_end(arguments);
+}
+
+long messageCount(int type) {
+
+	boost::mutex::scoped_lock lock(messageLock);
+	return messageCounts[type];
+}
+
+void setMessagesQuiet(bool quiet) {
+
+	boost::mutex::scoped_lock lock(messageLock);
+	messagesQuiet = quiet;
+}
+
+// Notifications are called without the variable locked, since they often set other variables
+
+Datum Variable::getValue() {
+
+	boost::mutex::scoped_lock locker(lock);
+	return value;
+}
+
+void Variable::setValue(Datum newValue) {
+
+	setValue(newValue, Clock::instance()->getCurrentTimeUS());
+}
+
+void Variable::setValue(Datum newValue, MWTime timeUS) {
+
+	std::vector<shared_ptr<VariableNotification> > toNotify;
+
+	{
+		boost::mutex::scoped_lock locker(lock);
+		value = newValue;
+		toNotify = notifications;
+	}
+	for (size_t index = 0; index < toNotify.size(); index++) {
+		toNotify[index]->notify(newValue, timeUS);
+	}
+}
+
+void Variable::addNotification(shared_ptr<VariableNotification> notification) {
+
+	boost::mutex::scoped_lock locker(lock);
+	notifications.push_back(notification);
+}
+
+shared_ptr<Clock> Clock::instance(bool failIfMissing) {
+
+	static shared_ptr<Clock> clock(new Clock);
+
+	return clock;
+}
+
+MWTime Clock::getCurrentTimeUS(void) {
+
+	struct timeval now;
+
+	gettimeofday(&now, NULL);
+	return now.tv_sec * 1000000LL + now.tv_usec;
+}
+
+void ScheduleTask::cancel(void) {
+
+	boost::mutex::scoped_lock locker(lock);
+	cancelled = true;
+}
+
+void ScheduleTask::kill(void) {
+
+	cancel();
+}
+
+bool ScheduleTask::isCancelled(void) {
+
+	boost::mutex::scoped_lock locker(lock);
+	return cancelled;
+}
+
+// The thread that runs one scheduled task.  It holds the task, so that a task nobody else holds still runs.
+
+static void runTask(shared_ptr<ScheduleTask> task, MWTime initialDelayUS, MWTime periodUS, int numRepeats,
+					boost::function<void *()> function) {
+
+	boost::this_thread::sleep(boost::posix_time::microseconds(initialDelayUS));
+	for (int repeat = 0; numRepeats == M_REPEAT_INDEFINITELY || repeat < numRepeats; repeat++) {
+		if (task->isCancelled()) {
+			return;
+		}
+		function();
+		boost::this_thread::sleep(boost::posix_time::microseconds(periodUS));
+	}
+}
+
+shared_ptr<Scheduler> Scheduler::instance(bool failIfMissing) {
+
+	static shared_ptr<Scheduler> scheduler(new Scheduler);
+
+	return scheduler;
+}
+
+shared_ptr<ScheduleTask> Scheduler::scheduleUS(const std::string &description, MWTime initialDelayUS,
+											   MWTime periodUS, int numRepeats, boost::function<void *()> function,
+											   int priority, MWTime warnSlopUS, MWTime failSlopUS,
+											   int missedExecutionBehavior) {
+
+	shared_ptr<ScheduleTask> task(new ScheduleTask);
+
+	boost::thread(boost::bind(runTask, task, initialDelayUS, periodUS, numRepeats, function)).detach();
+	return task;
+}
+
+}